@@ -12,10 +12,22 @@ done
 
 echo "Building code"
 
-rm -f hmap_test
+rm -f hmap_test hmap_counters_test hmap_cpp_test hmap_bench
 
 gcc -std=c99 -pedantic -Wall -Wextra -Werror -pthread -g -o hmap_test -pthread hmap.c err.c hmap_test.c; if [ $? -ne 0 ]; then exit 1; fi
 
+# Same tests with the operation counters compiled in.
+gcc -std=c99 -pedantic -Wall -Wextra -Werror -pthread -g -DHMAP_COUNTERS -o hmap_counters_test -pthread hmap.c err.c hmap_test.c; if [ $? -ne 0 ]; then exit 1; fi
+
+# The benchmark is optimized, so it measures what users will see.
+gcc -std=c99 -pedantic -Wall -Wextra -Werror -pthread -g -O2 -o hmap_bench -pthread hmap.c err.c hmap_bench.c -lm; if [ $? -ne 0 ]; then exit 1; fi
+
 gcc -std=c99 -pedantic -Wall -Wextra -Werror -pthread -g -o example -pthread hmap.c err.c example.c; if [ $? -ne 0 ]; then exit 1; fi
 
+# The C++ test links against the C objects. It is optimized because its
+# benchmark (-t 3) measures how well the header-only map inlines.
+gcc -std=c99 -pedantic -Wall -Wextra -Werror -pthread -g -c hmap.c err.c; if [ $? -ne 0 ]; then exit 1; fi
+g++ -std=c++11 -pedantic -Wall -Wextra -Werror -pthread -g -O2 -o hmap_cpp_test hmap_cpp_test.cpp hmap.o err.o; if [ $? -ne 0 ]; then exit 1; fi
+rm -f hmap.o err.o
+
 echo "Build successful"
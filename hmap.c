@@ -10,212 +10,3193 @@
  * Project home: https://github.com/fordsfords/hmap
  */
 
+#define _POSIX_C_SOURCE 200809L  /* For ftruncate() and fsync(). */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "err.h"
 #define HMAP_C
 #include "hmap.h"
+#include "hmap_murmur3.h"
+
+/* Group probing uses SSE2 where available; define HMAP_NO_SIMD to force
+ * the portable version. */
+#if defined(__SSE2__) && ! defined(HMAP_NO_SIMD)
+#  define HMAP_SSE2
+#  include <emmintrin.h>
+#endif
 
 
-/* Murmur3 32-bit hash function. */
 uint32_t hmap_murmur3_32(const void *key, size_t key_len, uint32_t seed) {
-  const uint8_t *data = (const uint8_t*)key;
-  uint32_t h1 = seed;
-
-  const uint32_t c1 = 0xcc9e2d51;
-  const uint32_t c2 = 0x1b873593;
-  const int r1 = 15;
-  const int r2 = 13;
-
-  /* Process 4-byte chunks. */
-  int nblocks = key_len / 4;
-  for (int i = 0; i < nblocks; i++) {
-    uint32_t k1;
-    memcpy(&k1, &data[i], sizeof(k1));  /* Key might not be mem aligned. */
-
-    k1 *= c1;
-    k1 = (k1 << r1) | (k1 >> (32 - r1));
-    k1 *= c2;
-
-    h1 ^= k1;
-    h1 = (h1 << r2) | (h1 >> (32 - r2));
-    h1 = h1 * 5 + 0xe6546b64;
-  }
-
-  /* Handle remaining bytes */
-  uint32_t k1 = 0;
-  int tail_size = key_len & 3;
-  if (tail_size >= 3) k1 ^= data[nblocks * 4 + 2] << 16;
-  if (tail_size >= 2) k1 ^= data[nblocks * 4 + 1] << 8;
-  if (tail_size >= 1) {
-    k1 ^= data[nblocks * 4];
-    k1 *= c1;
-    k1 = (k1 << r1) | (k1 >> (32 - r1));
-    k1 *= c2;
-    h1 ^= k1;
-  }
-
-  /* Finalization */
-  h1 ^= key_len;
-  h1 ^= (h1 >> 16);
-  h1 *= 0x85ebca6b;
-  h1 ^= (h1 >> 13);
-  h1 *= 0xc2b2ae35;
-  h1 ^= (h1 >> 16);
-
-  return h1;
+  return hmap_murmur3_32_inline(key, key_len, seed);
 }  /* hmap_murmur3_32 */
 
 
+void hmap_murmur3_x64_128(const void *key, size_t key_len, uint32_t seed, uint64_t *rtn_hash) {
+  hmap_murmur3_x64_128_inline(key, key_len, seed, rtn_hash);
+}  /* hmap_murmur3_x64_128 */
+
+
+/* Hash a key the way this map was configured to. */
+static uint64_t hmap_hash(const hmap_t *hmap, const void *key, size_t key_size) {
+  if (hmap->hash_fn) {
+    return hmap->hash_fn(key, key_size, hmap->seed);
+  }
+  if (hmap->hash_bits == 64) {
+    uint64_t hash[2];
+    hmap_murmur3_x64_128_inline(key, key_size, hmap->seed, hash);
+    return hash[0];
+  }
+  return hmap_murmur3_32_inline(key, key_size, hmap->seed);
+}  /* hmap_hash */
+
+
+/* Compare a stored entry's key with a caller's key. */
+static int hmap_key_equal(const hmap_t *hmap, const hmap_entry_t *entry, const void *key, size_t key_size) {
+  if (hmap->equal_fn) {
+    return hmap->equal_fn(entry->key, entry->key_size, key, key_size);
+  }
+  return key_size == entry->key_size && memcmp(entry->key, key, key_size) == 0;
+}  /* hmap_key_equal */
+
+
+/* Operation counters (see hmap_counters_t). Concurrent and mapped maps
+ * are looked up from many threads at once, and parallel batch loads
+ * search from several, so those need (slower) atomic adds. */
+#if defined(HMAP_COUNTERS)
+#  define HMAP_COUNT(count__hmap, count__field, count__n) do { \
+  if ((count__hmap)->conc || (count__hmap)->mapped || (count__hmap)->build_threads > 1) { \
+    __atomic_fetch_add(&(count__hmap)->counters.count__field, (uint64_t)(count__n), __ATOMIC_RELAXED); \
+  } else { \
+    (count__hmap)->counters.count__field += (uint64_t)(count__n); \
+  } \
+} while (0)
+#else
+#  define HMAP_COUNT(count__hmap, count__field, count__n) ((void)0)
+#endif
+
+
+/* Number of old buckets moved to the new table per write/lookup while a
+ * resize is in progress. The new table is twice as big, so this finishes
+ * well before the new table reaches max_load for any sane max_load. */
+#define HMAP_MIGRATE_BUCKETS 16
+
+/* Group layout control bytes: high bit set = empty, otherwise the top 7
+ * bits of the entry's hash. */
+#define HMAP_CTRL_EMPTY 0x80
+#define HMAP_CTRL_H2(ctrl__hash) ((uint8_t)((uint32_t)(ctrl__hash) >> 25))
+
+
+/* Concurrent mode (chained layout only). Writers take conc->write_lock.
+ * Readers take no lock: they see the table through conc->ctable, which
+ * writers only change by publishing new entries at the heads of chains
+ * (and new values in existing entries) with atomic stores. Growth builds
+ * a complete copy of the table and its entries, publishes it, and frees
+ * the old one only after every reader that might still see it has
+ * finished (see hmap_conc_synchronize()). */
+
+typedef struct hmap_ctable_s hmap_ctable_t;
+struct hmap_ctable_s {
+  hmap_entry_t **buckets;
+  size_t size;
+  uint64_t reduce_m;
+  uint32_t gen;  /* HMAP_BUCKET_GEN bit of this table's entries. */
+};
+
+/* Readers count themselves in one of HMAP_READER_SLOTS slots, chosen per
+ * thread, so readers on different cores don't share a cache line. Each
+ * slot has a count for each parity of conc->epoch. */
+#define HMAP_READER_SLOTS 64
+#define HMAP_CACHE_LINE 64
+
+typedef struct hmap_reader_slot_s hmap_reader_slot_t;
+struct hmap_reader_slot_s {
+  uint32_t active[2];
+  char pad[HMAP_CACHE_LINE - 2 * sizeof(uint32_t)];
+};
+
+struct hmap_conc_s {
+  hmap_reader_slot_t readers[HMAP_READER_SLOTS];  /* First, to be line-aligned. */
+  uint32_t epoch;
+  hmap_ctable_t *ctable;  /* What readers use (NULL for a segmented map). */
+  hmap_ctable_t *retired;  /* Table replaced by a grow that is still waiting for readers. */
+  hmap_conc_t *epoch_owner;  /* Whose readers and epoch to use (segments share their map's). */
+  void *conc_alloc;  /* The malloced block this struct is aligned within. */
+  char pad[HMAP_CACHE_LINE];  /* Keep writers' lock traffic off the readers' line. */
+  pthread_mutex_t write_lock;
+  uint64_t contended;  /* Writes that found write_lock already held. */
+  pthread_mutex_t sync_lock;  /* Serializes epoch flips. */
+};
+
+/* Segment of a segmented map, chosen by the high bits of the hash (buckets
+ * within a segment are chosen mostly by the low bits). */
+#define HMAP_SEGMENT(seg__hmap, seg__hash) \
+  ((seg__hmap)->segments[((uint64_t)(uint32_t)(seg__hash) * (uint64_t)(seg__hmap)->num_segments) >> 32])
+
+
+/* Snapshot files (hmap_save(), hmap_open_mmap()). Everything in the file
+ * is found by its byte offset from the start, so a mapping works wherever
+ * it lands and any number of processes can share one. The header is
+ * followed by the entry records, each 8-byte aligned: an
+ * hmap_file_entry_t, the key, then (if the file has a value_size) the
+ * value's bytes. The bucket table, an offset per bucket (0 = empty), is
+ * last. Numbers are in the saving machine's byte order. */
+#define HMAP_FILE_MAGIC "HMAPSNAP"
+#define HMAP_FILE_VERSION 1
+#define HMAP_FILE_BYTE_ORDER 0x01020304
+#define HMAP_FILE_CUSTOM_HASH 0x1  /* Saved from a map with a hash_fn. */
+#define HMAP_FILE_ALIGN(align__size) (((uint64_t)(align__size) + 7) & ~(uint64_t)7)
+
+typedef struct hmap_file_header_s hmap_file_header_t;
+struct hmap_file_header_s {
+  char magic[8];  /* HMAP_FILE_MAGIC, without the null. */
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t file_size;
+  uint64_t num_entries;
+  uint64_t table_size;
+  uint64_t table_offset;
+  uint64_t value_size;  /* 0 = values were saved as integers. */
+  uint32_t hash_bits;
+  uint32_t seed;
+  uint32_t flags;  /* HMAP_FILE_... */
+  uint32_t byte_order;  /* HMAP_FILE_BYTE_ORDER as the saver wrote it. */
+  uint64_t body_checksum;  /* Of everything after the header. */
+  uint64_t header_checksum;  /* Of the header up to here. */
+};
+
+typedef struct hmap_file_entry_s hmap_file_entry_t;
+struct hmap_file_entry_s {
+  uint64_t next;  /* Next record in the bucket (0 = end). */
+  uint64_t hash;
+  uint64_t key_size;
+  uint64_t value;  /* The value itself, or the offset of its bytes (0 = NULL). */
+};
+
+struct hmap_mapped_s {
+  char *base;  /* Read-only mapping of the whole file. */
+  size_t size;
+  const uint64_t *buckets;
+  size_t records_end;  /* Offset of the bucket table. */
+  size_t value_size;
+  hmap_entry_t entry;  /* What hmap_next() hands out. */
+  size_t next_record;  /* Offset of the record after "entry". */
+};
+
+
+/* "value_bytes" is 0 for values saved as integers, and for NULL values. */
+static uint64_t hmap_file_record_size(uint64_t key_size, uint64_t value_bytes) {
+  return sizeof(hmap_file_entry_t) + HMAP_FILE_ALIGN(key_size) + HMAP_FILE_ALIGN(value_bytes);
+}  /* hmap_file_record_size */
+
+
+/* The record at "offset" of a mapped file, or NULL if it (with its key and
+ * value) would not lie within the records, as in a damaged file. Only the
+ * header is checked when a file is opened, so every offset read from the
+ * file goes through here. */
+static const hmap_file_entry_t *hmap_mapped_record(const hmap_mapped_t *mapped, uint64_t offset) {
+  if (offset % 8 != 0 || offset < sizeof(hmap_file_header_t) ||
+      offset > mapped->records_end - sizeof(hmap_file_entry_t)) {
+    return NULL;
+  }
+  const hmap_file_entry_t *record = (const hmap_file_entry_t *)(mapped->base + offset);
+  uint64_t room = mapped->records_end - offset - sizeof(hmap_file_entry_t);
+  uint64_t value_bytes = (mapped->value_size > 0 && record->value) ? mapped->value_size : 0;
+  if (record->key_size > room || HMAP_FILE_ALIGN(record->key_size) + HMAP_FILE_ALIGN(value_bytes) > room) {
+    return NULL;
+  }
+  if (value_bytes > 0 && record->value != offset + sizeof(hmap_file_entry_t) + HMAP_FILE_ALIGN(record->key_size)) {
+    return NULL;
+  }
+  return record;
+}  /* hmap_mapped_record */
+
+
+static __thread int hmap_reader_slot = -1;
+static uint32_t hmap_reader_slots_assigned = 0;
+/* Read sections this thread has open, on any map. Waiting for readers
+ * from inside one would wait for ourselves. */
+static __thread int hmap_read_depth = 0;
+
+
+/* A segmented map has no table of its own; its conc only holds the
+ * readers and epoch shared by its segments. */
+static ERR_F hmap_conc_init(hmap_t *hmap) {
+  void *conc_alloc = calloc(1, sizeof(hmap_conc_t) + HMAP_CACHE_LINE);
+  ERR_ASSRT(conc_alloc, HMAP_ERR_NOMEM);
+  hmap_conc_t *conc = (hmap_conc_t *)(((uintptr_t)conc_alloc + HMAP_CACHE_LINE - 1) &
+      ~(uintptr_t)(HMAP_CACHE_LINE - 1));
+  conc->conc_alloc = conc_alloc;
+  conc->epoch_owner = conc;
+
+  if (hmap->table) {
+    conc->ctable = malloc(sizeof(hmap_ctable_t));
+    if (!conc->ctable) {
+      free(conc_alloc);
+      ERR_THROW(HMAP_ERR_NOMEM, "conc->ctable");
+    }
+    conc->ctable->buckets = hmap->table;
+    conc->ctable->size = hmap->table_size;
+    conc->ctable->reduce_m = hmap->reduce_m;
+    conc->ctable->gen = hmap->table_gen;
+  }
+  pthread_mutex_init(&conc->write_lock, NULL);
+  pthread_mutex_init(&conc->sync_lock, NULL);
+
+  hmap->conc = conc;
+  return ERR_OK;
+}  /* hmap_conc_init */
+
+
+uint32_t hmap_read_begin(hmap_t *hmap) {
+  if (!hmap->conc) {
+    return 0;
+  }
+  hmap_conc_t *conc = hmap->conc->epoch_owner;
+  if (hmap_reader_slot < 0) {
+    hmap_reader_slot = (int)(__atomic_fetch_add(&hmap_reader_slots_assigned, 1, __ATOMIC_RELAXED) %
+        HMAP_READER_SLOTS);
+  }
+  uint32_t parity = __atomic_load_n(&conc->epoch, __ATOMIC_SEQ_CST) & 1;
+  __atomic_fetch_add(&conc->readers[hmap_reader_slot].active[parity], 1, __ATOMIC_SEQ_CST);
+  hmap_read_depth++;
+  return (uint32_t)hmap_reader_slot * 2 + parity;
+}  /* hmap_read_begin */
+
+
+void hmap_read_end(hmap_t *hmap, uint32_t token) {
+  if (hmap->conc) {
+    __atomic_fetch_sub(&hmap->conc->epoch_owner->readers[token / 2].active[token & 1], 1, __ATOMIC_RELEASE);
+    hmap_read_depth--;
+  }
+}  /* hmap_read_end */
+
+
+/* Wait until no reader can still see anything the caller unpublished
+ * before calling this. A reader counts itself before loading conc->ctable,
+ * so one that isn't counted yet will load the new table. Flipping the
+ * epoch first sends new readers to the other count, so a steady stream of
+ * readers can't keep the old count from draining. Segments growing at the
+ * same time take turns, so one doesn't flip new readers back onto the
+ * count the other is waiting for. */
+static void hmap_conc_synchronize(hmap_conc_t *conc) {
+  conc = conc->epoch_owner;
+  pthread_mutex_lock(&conc->sync_lock);
+  uint32_t old_parity = __atomic_fetch_add(&conc->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+  int slot;
+  for (slot = 0; slot < HMAP_READER_SLOTS; slot++) {
+    while (__atomic_load_n(&conc->readers[slot].active[old_parity], __ATOMIC_SEQ_CST) != 0) {
+      sched_yield();
+    }
+  }
+  pthread_mutex_unlock(&conc->sync_lock);
+}  /* hmap_conc_synchronize */
+
+
+/* Lock-free find; the caller must be in a read section. */
+static hmap_entry_t *hmap_conc_find(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash) {
+  hmap_ctable_t *ctable = __atomic_load_n(&hmap->conc->ctable, __ATOMIC_SEQ_CST);
+  size_t bucket = hmap_reduce(hash, ctable->size, ctable->reduce_m);
+  hmap_entry_t *entry = __atomic_load_n(&ctable->buckets[bucket], __ATOMIC_ACQUIRE);
+  while (entry) {
+    HMAP_COUNT(hmap, probes, 1);
+    if (hash == entry->hash && hmap_key_equal(hmap, entry, key, key_size)) {
+      return entry;
+    }
+    entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE);
+  }
+  return NULL;
+}  /* hmap_conc_find */
+
+
+/* Lock-free hmap_next(); the caller must be in a read section. */
+static void hmap_conc_next(hmap_t *hmap, hmap_entry_t **in_entry) {
+  hmap_ctable_t *ctable = __atomic_load_n(&hmap->conc->ctable, __ATOMIC_SEQ_CST);
+  size_t bucket;
+  hmap_entry_t *next_entry;
+
+  if (*in_entry == NULL) {
+    bucket = 0;
+    next_entry = __atomic_load_n(&ctable->buckets[0], __ATOMIC_ACQUIRE);
+  } else {
+    if (((*in_entry)->bucket & HMAP_BUCKET_GEN) != ctable->gen) {
+      /* The table grew during this read section. The grow is waiting for
+       * this reader, so the entry's table is still there. */
+      ctable = __atomic_load_n(&hmap->conc->retired, __ATOMIC_SEQ_CST);
+    }
+    bucket = (*in_entry)->bucket & HMAP_BUCKET_MASK;
+    next_entry = __atomic_load_n(&(*in_entry)->next, __ATOMIC_ACQUIRE);
+  }
+
+  while (next_entry == NULL) {
+    bucket++;
+    if (bucket >= ctable->size) {
+      break;
+    }
+    next_entry = __atomic_load_n(&ctable->buckets[bucket], __ATOMIC_ACQUIRE);
+  }
+  *in_entry = next_entry;
+}  /* hmap_conc_next */
+
+
+void hmap_options_init(hmap_options_t *options) {
+  memset(options, 0, sizeof(*options));
+  options->max_load = 0;  /* Fixed-size table. */
+  options->layout = HMAP_LAYOUT_CHAINED;
+  options->arena_slab_size = 0;  /* Entries and keys are malloced. */
+  options->inline_key_max = HMAP_INLINE_KEY_DEFAULT;
+  options->pow2 = 0;  /* Use table_size as given. */
+  options->hash_bits = 32;
+  options->seed = 42;
+  options->hash_fn = NULL;  /* Murmur3 (see hash_bits). */
+  options->equal_fn = NULL;  /* Same size and bytes. */
+  options->concurrent = 0;  /* Single-threaded. */
+  options->segments = 0;  /* One table. */
+  options->build_threads = 0;  /* Bulk loads and resizes run on the caller. */
+  options->mem_budget = 0;  /* No limit. */
+}  /* hmap_options_init */
+
+
 ERR_F hmap_create(hmap_t **rtn_hmap, size_t table_size) {
+  ERR(hmap_create_opts(rtn_hmap, table_size, NULL));
+
+  return ERR_OK;
+}  /* hmap_create */
+
+
+/* A segmented map is a list of concurrent maps plus the reader state
+ * they share. It has no table of its own. */
+static ERR_F hmap_create_segmented(hmap_t **rtn_hmap, size_t table_size, const hmap_options_t *options) {
+  hmap_options_t segment_options = *options;
+  segment_options.concurrent = 1;
+  segment_options.segments = 0;
+  segment_options.mem_budget = options->mem_budget / options->segments;
+  size_t segment_size = (table_size + options->segments - 1) / options->segments;
+
+  hmap_t *hmap = calloc(1, sizeof(hmap_t));
+  ERR_ASSRT(hmap, HMAP_ERR_NOMEM);
+  (hmap)->seed = options->seed;
+  (hmap)->hash_fn = options->hash_fn;
+  (hmap)->equal_fn = options->equal_fn;
+  (hmap)->hash_bits = options->hash_bits;
+  (hmap)->layout = options->layout;
+  (hmap)->inline_key_max = options->inline_key_max;
+  (hmap)->max_load = options->max_load;
+  (hmap)->mem_budget = options->mem_budget;
+
+  (hmap)->segments = calloc(options->segments, sizeof(hmap_t *));
+  if (!(hmap)->segments) {
+    free(hmap);
+    ERR_THROW(HMAP_ERR_NOMEM, "hmap->segments");
+  }
+  err_t *err = hmap_conc_init(hmap);
+  if (err) {
+    free((hmap)->segments);
+    free(hmap);
+    ERR_RETHROW(err, "hmap_conc_init");
+  }
+
+  int segment;
+  for (segment = 0; segment < options->segments; segment++) {
+    err = hmap_create_opts(&(hmap)->segments[segment], segment_size, &segment_options);
+    if (err) {
+      err_dispose(hmap_delete(hmap));  /* Deletes the segments made so far. */
+      ERR_RETHROW(err, "hmap_create_opts");
+    }
+    (hmap)->segments[segment]->segment_num = segment;
+    (hmap)->segments[segment]->conc->epoch_owner = (hmap)->conc;
+    (hmap)->num_segments++;
+    (hmap)->table_size += (hmap)->segments[segment]->table_size;
+  }
+
+  *rtn_hmap = hmap;
+  return ERR_OK;
+}  /* hmap_create_segmented */
+
+
+ERR_F hmap_create_opts(hmap_t **rtn_hmap, size_t table_size, const hmap_options_t *options) {
+  hmap_options_t default_options;
+
   ERR_ASSRT(rtn_hmap, HMAP_ERR_PARAM);
   ERR_ASSRT(table_size > 0, HMAP_ERR_PARAM);
+  ERR_ASSRT(table_size <= HMAP_MAX_TABLE_SIZE, HMAP_ERR_PARAM);
+  if (options == NULL) {
+    hmap_options_init(&default_options);
+    options = &default_options;
+  }
+  ERR_ASSRT(options->max_load >= 0, HMAP_ERR_PARAM);
+  ERR_ASSRT(options->layout == HMAP_LAYOUT_CHAINED ||
+      options->layout == HMAP_LAYOUT_ROBINHOOD ||
+      options->layout == HMAP_LAYOUT_GROUP, HMAP_ERR_PARAM);
+  ERR_ASSRT(options->layout == HMAP_LAYOUT_CHAINED ||
+      options->max_load < 1, HMAP_ERR_PARAM);
+  ERR_ASSRT(options->inline_key_max <= HMAP_INLINE_KEY_LIMIT, HMAP_ERR_PARAM);
+  ERR_ASSRT(options->hash_bits == 32 || options->hash_bits == 64, HMAP_ERR_PARAM);
+  ERR_ASSRT(!options->concurrent || options->layout == HMAP_LAYOUT_CHAINED, HMAP_ERR_PARAM);
+  ERR_ASSRT(options->segments >= 0 && options->segments <= HMAP_MAX_SEGMENTS, HMAP_ERR_PARAM);
+  ERR_ASSRT(options->segments <= 1 || options->layout == HMAP_LAYOUT_CHAINED, HMAP_ERR_PARAM);
+  ERR_ASSRT(options->build_threads >= 0 && options->build_threads <= HMAP_MAX_BUILD_THREADS, HMAP_ERR_PARAM);
+  ERR_ASSRT(options->build_threads <= 1 || options->layout == HMAP_LAYOUT_CHAINED, HMAP_ERR_PARAM);
+  if (options->segments > 1) {
+    ERR(hmap_create_segmented(rtn_hmap, table_size, options));
+    return ERR_OK;
+  }
+
+  if (options->pow2) {
+    size_t pow2_size = 1;
+    while (pow2_size < table_size) {
+      pow2_size *= 2;
+    }
+    table_size = pow2_size;
+  }
+
+  hmap_t *hmap = calloc(1, sizeof(hmap_t));
+  ERR_ASSRT(hmap, HMAP_ERR_NOMEM);
+
+  (hmap)->table_size = table_size;
+  (hmap)->seed = options->seed;
+  (hmap)->hash_fn = options->hash_fn;
+  (hmap)->equal_fn = options->equal_fn;
+  (hmap)->num_entries = 0;
+  (hmap)->max_load = options->max_load;
+  (hmap)->layout = options->layout;
+  (hmap)->arena_slab_size = options->arena_slab_size;
+  (hmap)->inline_key_max = options->inline_key_max;
+  (hmap)->hash_bits = options->hash_bits;
+  (hmap)->slot_size = sizeof(hmap_entry_t) + ((options->inline_key_max + 7) & ~(size_t)7);
+  (hmap)->build_threads = options->build_threads;
+  (hmap)->mem_budget = options->mem_budget;
+  if ((hmap)->layout == HMAP_LAYOUT_CHAINED) {
+    (hmap)->table = calloc(table_size, sizeof(hmap_entry_t*));
+    if (!(hmap)->table) {
+      free(hmap);
+      ERR_THROW(HMAP_ERR_NOMEM, "hmap->table");
+    }
+  } else if ((hmap)->layout == HMAP_LAYOUT_GROUP) {
+    if ((hmap)->max_load == 0) {
+      (hmap)->max_load = HMAP_OPEN_DEFAULT_LOAD;
+    }
+    /* A probe window must never wrap onto itself. */
+    if (table_size < HMAP_GROUP_WIDTH) {
+      (hmap)->table_size = table_size = HMAP_GROUP_WIDTH;
+    }
+    (hmap)->slots = calloc(table_size, (hmap)->slot_size);
+    (hmap)->ctrl = malloc(table_size + HMAP_GROUP_WIDTH);
+    if (!(hmap)->slots || !(hmap)->ctrl) {
+      free((hmap)->slots);
+      free((hmap)->ctrl);
+      free(hmap);
+      ERR_THROW(HMAP_ERR_NOMEM, "hmap->slots");
+    }
+    memset((hmap)->ctrl, HMAP_CTRL_EMPTY, table_size + HMAP_GROUP_WIDTH);
+  } else {
+    if ((hmap)->max_load == 0) {
+      (hmap)->max_load = HMAP_OPEN_DEFAULT_LOAD;
+    }
+    (hmap)->slots = calloc(table_size, (hmap)->slot_size);
+    (hmap)->hashes = calloc(table_size, sizeof(uint32_t));
+    if (!(hmap)->slots || !(hmap)->hashes) {
+      free((hmap)->slots);
+      free((hmap)->hashes);
+      free(hmap);
+      ERR_THROW(HMAP_ERR_NOMEM, "hmap->slots");
+    }
+  }
+
+  (hmap)->reduce_m = hmap_reduce_init((hmap)->table_size);
+
+  if (options->concurrent) {
+    err_t *err = hmap_conc_init(hmap);
+    if (err) {
+      free((hmap)->table);
+      free(hmap);
+      ERR_RETHROW(err, "hmap_conc_init");
+    }
+  }
+
+  *rtn_hmap = hmap;
+  return ERR_OK;
+}  /* hmap_create_opts */
+
+
+/* Memory for entries and keys. In arena mode it is carved from large slabs
+ * and freed chunks go on a free list for their size, so small allocations
+ * cost a pointer bump and deleting the map is one free() per slab. */
+
+#define HMAP_ARENA_ROUND(arena__size) \
+  (((arena__size) + HMAP_ARENA_ALIGN - 1) & ~(size_t)(HMAP_ARENA_ALIGN - 1))
+#define HMAP_SLAB_HDR HMAP_ARENA_ROUND(sizeof(hmap_slab_t))
+
+
+/* What malloc() really takes for a block of "size" bytes, going by glibc:
+ * an 8-byte header, 16-byte granularity and a 32-byte minimum. Other
+ * allocators are close enough for accounting. */
+static size_t hmap_malloc_size(size_t size) {
+  size_t block_size = (size + 8 + 15) & ~(size_t)15;
+  return (block_size < 32) ? 32 : block_size;
+}  /* hmap_malloc_size */
+
+
+/* Every byte the allocator holds for entries and keys is counted. The
+ * caller counts what it asked for (mem_entry_bytes and mem_key_bytes);
+ * the rest is mem_overhead. In arena mode, slabs are overhead until
+ * carved up, and freed chunks go back to being overhead. */
+static void *hmap_mem_alloc(hmap_t *hmap, size_t size) {
+  if (hmap->arena_slab_size == 0) {
+    void *chunk = malloc(size);
+    if (chunk) {
+      hmap->mem_overhead += hmap_malloc_size(size) - size;
+    }
+    return chunk;
+  }
+
+  size_t request_size = size;
+  size = (size == 0) ? HMAP_ARENA_ALIGN : HMAP_ARENA_ROUND(size);
+  size_t size_class = size / HMAP_ARENA_ALIGN - 1;
+  void *chunk;
+  if (size_class < HMAP_ARENA_CLASSES && hmap->arena_free[size_class]) {
+    chunk = hmap->arena_free[size_class];
+    memcpy(&hmap->arena_free[size_class], chunk, sizeof(void *));  /* Pop. */
+  } else {
+    hmap_slab_t *slab = hmap->slabs;
+    if (slab == NULL || slab->size - slab->used < size) {
+      size_t slab_size = (size > hmap->arena_slab_size) ? size : hmap->arena_slab_size;
+      slab = malloc(HMAP_SLAB_HDR + slab_size);
+      if (slab == NULL) {
+        return NULL;
+      }
+      /* Whatever is left in the previous slab is abandoned. */
+      slab->next = hmap->slabs;
+      slab->size = slab_size;
+      slab->used = 0;
+      hmap->slabs = slab;
+      hmap->arena_reserved += HMAP_SLAB_HDR + slab_size;
+      hmap->mem_overhead += hmap_malloc_size(HMAP_SLAB_HDR + slab_size);
+    }
+    chunk = (char *)slab + HMAP_SLAB_HDR + slab->used;
+    slab->used += size;
+  }
+
+  hmap->arena_used += size;
+  hmap->mem_overhead -= request_size;
+  return chunk;
+}  /* hmap_mem_alloc */
+
+
+/* Size must be the same as when the chunk was allocated. */
+static void hmap_mem_free(hmap_t *hmap, void *chunk, size_t size) {
+  if (hmap->arena_slab_size == 0) {
+    free(chunk);
+    hmap->mem_overhead -= hmap_malloc_size(size) - size;
+    return;
+  }
+
+  hmap->mem_overhead += size;
+  size = (size == 0) ? HMAP_ARENA_ALIGN : HMAP_ARENA_ROUND(size);
+  size_t size_class = size / HMAP_ARENA_ALIGN - 1;
+  hmap->arena_used -= size;
+  if (size_class < HMAP_ARENA_CLASSES) {
+    memcpy(chunk, &hmap->arena_free[size_class], sizeof(void *));  /* Push. */
+    hmap->arena_free[size_class] = chunk;
+  }
+  /* Else big chunks are not reused; they go away with the slabs. */
+}  /* hmap_mem_free */
+
+
+static void hmap_arena_free_all(hmap_t *hmap) {
+  while (hmap->slabs) {
+    hmap_slab_t *next = hmap->slabs->next;
+    free(hmap->slabs);
+    hmap->slabs = next;
+  }
+}  /* hmap_arena_free_all */
+
+
+ERR_F hmap_arena_usage(hmap_t *hmap, size_t *rtn_used, size_t *rtn_reserved) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+
+  size_t used = hmap->arena_used;
+  size_t reserved = hmap->arena_reserved;
+  if (hmap->segments) {
+    int segment;
+    for (segment = 0; segment < hmap->num_segments; segment++) {
+      size_t segment_used = 0, segment_reserved = 0;
+      ERR(hmap_arena_usage(hmap->segments[segment], &segment_used, &segment_reserved));
+      used += segment_used;
+      reserved += segment_reserved;
+    }
+  }
+  if (rtn_used) {
+    *rtn_used = used;
+  }
+  if (rtn_reserved) {
+    *rtn_reserved = reserved;
+  }
+  return ERR_OK;
+}  /* hmap_arena_usage */
+
+
+/* How much the map's footprint grows if hmap_mem_alloc() is asked for
+ * "size" bytes: nothing if an arena chunk is free or the slab has room. */
+static size_t hmap_mem_cost(const hmap_t *hmap, size_t size) {
+  if (hmap->arena_slab_size == 0) {
+    return hmap_malloc_size(size);
+  }
+
+  size = (size == 0) ? HMAP_ARENA_ALIGN : HMAP_ARENA_ROUND(size);
+  size_t size_class = size / HMAP_ARENA_ALIGN - 1;
+  if (size_class < HMAP_ARENA_CLASSES && hmap->arena_free[size_class]) {
+    return 0;
+  }
+  if (hmap->slabs && hmap->slabs->size - hmap->slabs->used >= size) {
+    return 0;
+  }
+  return hmap_malloc_size(HMAP_SLAB_HDR + ((size > hmap->arena_slab_size) ? size : hmap->arena_slab_size));
+}  /* hmap_mem_cost */
+
+
+/* Add one map's memory (not its segments') to "mem". Tables and the map's
+ * own structures are worked out from their sizes. */
+static void hmap_memory_add(const hmap_t *hmap, hmap_memory_t *mem) {
+  size_t table_bytes = 0;
+  size_t blocks = hmap_malloc_size(sizeof(hmap_t));
+
+  if (hmap->table) {
+    table_bytes += hmap->table_size * sizeof(hmap_entry_t *);
+    blocks += hmap_malloc_size(hmap->table_size * sizeof(hmap_entry_t *));
+  }
+  if (hmap->old_table) {
+    table_bytes += hmap->old_table_size * sizeof(hmap_entry_t *);
+    blocks += hmap_malloc_size(hmap->old_table_size * sizeof(hmap_entry_t *));
+  }
+  if (hmap->slots) {
+    table_bytes += hmap->table_size * hmap->slot_size;
+    blocks += hmap_malloc_size(hmap->table_size * hmap->slot_size);
+  }
+  if (hmap->hashes) {
+    table_bytes += hmap->table_size * sizeof(uint32_t);
+    blocks += hmap_malloc_size(hmap->table_size * sizeof(uint32_t));
+  }
+  if (hmap->ctrl) {
+    table_bytes += hmap->table_size + HMAP_GROUP_WIDTH;
+    blocks += hmap_malloc_size(hmap->table_size + HMAP_GROUP_WIDTH);
+  }
+  if (hmap->conc) {
+    blocks += hmap_malloc_size(sizeof(hmap_conc_t) + HMAP_CACHE_LINE);
+    if (hmap->conc->ctable) {
+      blocks += hmap_malloc_size(sizeof(hmap_ctable_t));
+    }
+  }
+  if (hmap->segments) {
+    blocks += hmap_malloc_size(hmap->num_segments * sizeof(hmap_t *));
+  }
+  if (hmap->mapped) {
+    /* The file's pages belong to the page cache, not the map. */
+    blocks += hmap_malloc_size(sizeof(hmap_mapped_t));
+  }
+
+  mem->table_bytes += table_bytes;
+  mem->entry_bytes += hmap->mem_entry_bytes;
+  mem->key_bytes += hmap->mem_key_bytes;
+  mem->overhead_bytes += hmap->mem_overhead + blocks - table_bytes;
+}  /* hmap_memory_add */
+
+
+static size_t hmap_mem_total(const hmap_t *hmap) {
+  hmap_memory_t mem;
+  memset(&mem, 0, sizeof(mem));
+  hmap_memory_add(hmap, &mem);
+  return mem.table_bytes + mem.entry_bytes + mem.key_bytes + mem.overhead_bytes;
+}  /* hmap_mem_total */
+
+
+/* Whether "cost" more bytes would take the map past its mem_budget. */
+static int hmap_over_budget(const hmap_t *hmap, size_t cost) {
+  return hmap->mem_budget > 0 && hmap_mem_total(hmap) + cost > hmap->mem_budget;
+}  /* hmap_over_budget */
+
+
+ERR_F hmap_memory_usage(hmap_t *hmap, hmap_memory_t *rtn_mem) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(rtn_mem, HMAP_ERR_PARAM);
+
+  memset(rtn_mem, 0, sizeof(*rtn_mem));
+  if (hmap->segments) {
+    hmap_memory_add(hmap, rtn_mem);
+    int segment;
+    for (segment = 0; segment < hmap->num_segments; segment++) {
+      hmap_t *seg = hmap->segments[segment];
+      pthread_mutex_lock(&seg->conc->write_lock);
+      hmap_memory_add(seg, rtn_mem);
+      pthread_mutex_unlock(&seg->conc->write_lock);
+    }
+  } else if (hmap->conc) {
+    /* A grow may be swapping tables. */
+    pthread_mutex_lock(&hmap->conc->write_lock);
+    hmap_memory_add(hmap, rtn_mem);
+    pthread_mutex_unlock(&hmap->conc->write_lock);
+  } else {
+    hmap_memory_add(hmap, rtn_mem);
+  }
+  rtn_mem->total_bytes = rtn_mem->table_bytes + rtn_mem->entry_bytes +
+      rtn_mem->key_bytes + rtn_mem->overhead_bytes;
+
+  return ERR_OK;
+}  /* hmap_memory_usage */
+
+ERR_F hmap_segment_stats(hmap_t *hmap, int segment, int *rtn_entries, uint64_t *rtn_contended) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  if (hmap->segments) {
+    ERR_ASSRT(segment >= 0 && segment < hmap->num_segments, HMAP_ERR_PARAM);
+    hmap = hmap->segments[segment];
+  } else {
+    ERR_ASSRT(segment == 0, HMAP_ERR_PARAM);
+  }
+
+  if (hmap->conc) {
+    pthread_mutex_lock(&hmap->conc->write_lock);
+  }
+  if (rtn_entries) {
+    *rtn_entries = hmap->num_entries;
+  }
+  if (rtn_contended) {
+    *rtn_contended = hmap->conc ? __atomic_load_n(&hmap->conc->contended, __ATOMIC_RELAXED) : 0;
+  }
+  if (hmap->conc) {
+    pthread_mutex_unlock(&hmap->conc->write_lock);
+  }
+  return ERR_OK;
+}  /* hmap_segment_stats */
+
+
+static int hmap_slot_used(const hmap_t *hmap, size_t slot) {
+  if (hmap->layout == HMAP_LAYOUT_GROUP) {
+    return (hmap->ctrl[slot] & HMAP_CTRL_EMPTY) == 0;
+  }
+  return hmap->hashes[slot] != 0;
+}  /* hmap_slot_used */
+
+
+static void hmap_stats_hist(hmap_stats_t *stats, size_t length) {
+  stats->chain_hist[(length < HMAP_STATS_HIST) ? length : HMAP_STATS_HIST - 1]++;
+  if (length > stats->max_chain) {
+    stats->max_chain = length;
+  }
+}  /* hmap_stats_hist */
+
+
+static void hmap_stats_chains(hmap_stats_t *stats, hmap_entry_t **table, size_t first_bucket, size_t table_size) {
+  size_t bucket;
+  for (bucket = first_bucket; bucket < table_size; bucket++) {
+    size_t length = 0;
+    hmap_entry_t *entry;
+    for (entry = table[bucket]; entry; entry = entry->next) {
+      length++;
+    }
+    if (length == 0) {
+      stats->empty_buckets++;
+    } else {
+      stats->used_buckets++;
+    }
+    hmap_stats_hist(stats, length);
+  }
+}  /* hmap_stats_chains */
+
+
+/* Add one (unsegmented) map's numbers to the stats. */
+static void hmap_stats_add(hmap_t *hmap, hmap_stats_t *stats) {
+  if (hmap->conc) {
+    pthread_mutex_lock(&hmap->conc->write_lock);
+  }
+  stats->table_size += hmap->table_size;
+  stats->num_entries += (size_t)hmap->num_entries;
+
+  if (hmap->mapped) {
+    size_t bucket;
+    for (bucket = 0; bucket < hmap->table_size; bucket++) {
+      size_t length = 0;
+      uint64_t offset;
+      const hmap_file_entry_t *record;
+      for (offset = hmap->mapped->buckets[bucket];
+          offset && (record = hmap_mapped_record(hmap->mapped, offset)) != NULL;
+          offset = (record->next < offset) ? record->next : 0) {
+        length++;
+      }
+      if (length == 0) {
+        stats->empty_buckets++;
+      } else {
+        stats->used_buckets++;
+      }
+      hmap_stats_hist(stats, length);
+    }
+  } else if (hmap->layout == HMAP_LAYOUT_CHAINED) {
+    hmap_stats_chains(stats, hmap->table, 0, hmap->table_size);
+    if (hmap->old_table) {
+      /* Mid-resize: the old buckets still to be migrated count too. */
+      hmap_stats_chains(stats, hmap->old_table, hmap->migrate_bucket, hmap->old_table_size);
+    }
+  } else {
+    size_t slot;
+    for (slot = 0; slot < hmap->table_size; slot++) {
+      if (!hmap_slot_used(hmap, slot)) {
+        stats->empty_buckets++;
+        continue;
+      }
+      stats->used_buckets++;
+      size_t home = (hmap->layout == HMAP_LAYOUT_ROBINHOOD) ?
+          hmap_reduce(hmap->hashes[slot], hmap->table_size, hmap->reduce_m) :
+          hmap_reduce(HMAP_SLOT(hmap, slot)->hash, hmap->table_size, hmap->reduce_m);
+      hmap_stats_hist(stats, (slot >= home) ? slot - home : slot + hmap->table_size - home);
+    }
+  }
+
+  stats->counters.lookups += __atomic_load_n(&hmap->counters.lookups, __ATOMIC_RELAXED);
+  stats->counters.hits += __atomic_load_n(&hmap->counters.hits, __ATOMIC_RELAXED);
+  stats->counters.misses += __atomic_load_n(&hmap->counters.misses, __ATOMIC_RELAXED);
+  stats->counters.writes += __atomic_load_n(&hmap->counters.writes, __ATOMIC_RELAXED);
+  stats->counters.probes += __atomic_load_n(&hmap->counters.probes, __ATOMIC_RELAXED);
+  if (hmap->conc) {
+    pthread_mutex_unlock(&hmap->conc->write_lock);
+  }
+}  /* hmap_stats_add */
+
+
+/* Walks the whole table, so it's for monitoring, not for hot paths. */
+ERR_F hmap_stats(hmap_t *hmap, hmap_stats_t *rtn_stats) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(rtn_stats, HMAP_ERR_PARAM);
+
+  memset(rtn_stats, 0, sizeof(*rtn_stats));
+  if (hmap->segments) {
+    int segment;
+    for (segment = 0; segment < hmap->num_segments; segment++) {
+      hmap_stats_add(hmap->segments[segment], rtn_stats);
+    }
+  } else {
+    hmap_stats_add(hmap, rtn_stats);
+  }
+  rtn_stats->load_factor = (double)rtn_stats->num_entries / (double)rtn_stats->table_size;
+
+  return ERR_OK;
+}  /* hmap_stats */
+
+
+/* A chained entry with an inline key is allocated together with it. */
+static void hmap_free_entry(hmap_t *hmap, hmap_entry_t *entry) {
+  hmap->mem_entry_bytes -= sizeof(hmap_entry_t);
+  hmap->mem_key_bytes -= entry->key_size;
+  if (entry->flags & HMAP_ENTRY_BULK) {
+    /* Goes away with its block; until then it's unused space. */
+    hmap->mem_overhead += sizeof(hmap_entry_t) + entry->key_size;
+    return;
+  }
+  if (entry->key_size <= hmap->inline_key_max) {
+    hmap_mem_free(hmap, entry, sizeof(hmap_entry_t) + entry->key_size);
+  } else {
+    hmap_mem_free(hmap, entry->key, entry->key_size);
+    hmap_mem_free(hmap, entry, sizeof(hmap_entry_t));
+  }
+}  /* hmap_free_entry */
+
+
+static void hmap_free_chains(hmap_t *hmap, hmap_entry_t **table, size_t first_bucket, size_t table_size) {
+  size_t bucket;
+
+  /* Step to each bucket and delete the list of entries. */
+  for (bucket = first_bucket; bucket < table_size; bucket++) {
+    hmap_entry_t *entry = table[bucket];
+    while (entry) {
+      hmap_entry_t *next = entry->next;
+      /* The application is responsible for freeing the value. */
+      hmap_free_entry(hmap, entry);
+      entry = next;
+    }
+  }
+}  /* hmap_free_chains */
+
+
+ERR_F hmap_delete(hmap_t *hmap) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+
+  if (hmap->mapped) {
+    munmap(hmap->mapped->base, hmap->mapped->size);
+    free(hmap->mapped);
+    free(hmap);
+    return ERR_OK;
+  }
+
+  if (hmap->segments) {
+    int segment;
+    for (segment = 0; segment < hmap->num_segments; segment++) {
+      if (hmap->segments[segment]) {
+        ERR(hmap_delete(hmap->segments[segment]));
+      }
+    }
+    free(hmap->segments);
+  }
+
+  /* In arena mode, entries and keys all go away with the slabs.
+   * A segmented map has no entries of its own. */
+  if (hmap->arena_slab_size == 0 && !hmap->segments) {
+    if (hmap->layout == HMAP_LAYOUT_CHAINED) {
+      hmap_free_chains(hmap, hmap->table, 0, hmap->table_size);
+      if (hmap->old_table) {
+        /* Buckets below migrate_bucket have already been emptied. */
+        hmap_free_chains(hmap, hmap->old_table, hmap->migrate_bucket, hmap->old_table_size);
+      }
+    } else {
+      size_t slot;
+      for (slot = 0; slot < hmap->table_size; slot++) {
+        if (hmap_slot_used(hmap, slot)) {
+          hmap_entry_t *entry = HMAP_SLOT(hmap, slot);
+          if (entry->key_size > hmap->inline_key_max) {
+            hmap_mem_free(hmap, entry->key, entry->key_size);
+          }
+        }
+      }
+    }
+  }
+  hmap_arena_free_all(hmap);
+  while (hmap->bulk_blocks) {
+    hmap_slab_t *next = hmap->bulk_blocks->next;
+    free(hmap->bulk_blocks);
+    hmap->bulk_blocks = next;
+  }
+
+  if (hmap->conc) {
+    /* hmap->table is conc->ctable->buckets. */
+    pthread_mutex_destroy(&hmap->conc->write_lock);
+    pthread_mutex_destroy(&hmap->conc->sync_lock);
+    free(hmap->conc->ctable);
+    free(hmap->conc->conc_alloc);
+  }
+  free(hmap->table);
+  free(hmap->old_table);
+  free(hmap->slots);
+  free(hmap->hashes);
+  free(hmap->ctrl);
+  free(hmap);
+  return ERR_OK;
+}  /* hmap_delete */
+
+
+/* Move up to "num_buckets" buckets from old_table into table. */
+static void hmap_migrate(hmap_t *hmap, size_t num_buckets) {
+  while (num_buckets > 0 && hmap->migrate_bucket < hmap->old_table_size) {
+    hmap_entry_t *entry = hmap->old_table[hmap->migrate_bucket];
+    while (entry) {
+      hmap_entry_t *next = entry->next;
+      /* No need to rehash the key. */
+      uint32_t bucket = hmap_reduce(entry->hash, hmap->table_size, hmap->reduce_m);
+      entry->bucket = bucket | hmap->table_gen;
+      entry->next = hmap->table[bucket];
+      hmap->table[bucket] = entry;
+      entry = next;
+    }
+    hmap->old_table[hmap->migrate_bucket] = NULL;
+    hmap->migrate_bucket++;
+    num_buckets--;
+  }
+
+  if (hmap->migrate_bucket >= hmap->old_table_size) {
+    free(hmap->old_table);
+    hmap->old_table = NULL;
+    hmap->old_table_size = 0;
+    hmap->migrate_bucket = 0;
+  }
+}  /* hmap_migrate */
+
+
+/* Bytes allocated for a chained entry (including an inline key). */
+static size_t hmap_entry_alloc_size(const hmap_t *hmap, const hmap_entry_t *entry) {
+  if (entry->key_size <= hmap->inline_key_max) {
+    return sizeof(hmap_entry_t) + entry->key_size;
+  }
+  return sizeof(hmap_entry_t);
+}  /* hmap_entry_alloc_size */
+
+
+/* Free the entry structures (but not separately-allocated keys, which
+ * the copies share) of a replaced concurrent table. */
+static void hmap_conc_free_copies(hmap_t *hmap, hmap_entry_t **buckets, size_t size) {
+  size_t bucket;
+  for (bucket = 0; bucket < size; bucket++) {
+    hmap_entry_t *entry = buckets[bucket];
+    while (entry) {
+      hmap_entry_t *next = entry->next;
+      hmap_mem_free(hmap, entry, hmap_entry_alloc_size(hmap, entry));
+      entry = next;
+    }
+  }
+}  /* hmap_conc_free_copies */
+
+
+/* Stop-the-world growth for concurrent mode. Called with write_lock held,
+ * which it keeps while waiting for readers: hmap_conc_next() needs the one
+ * retired table to stay put. Failure isn't fatal; the map keeps using the
+ * current table. */
+static void hmap_conc_grow(hmap_t *hmap, size_t new_size) {
+  hmap_conc_t *conc = hmap->conc;
+  hmap_ctable_t *old_ctable = conc->ctable;
+  hmap_ctable_t *new_ctable = malloc(sizeof(hmap_ctable_t));
+  hmap_entry_t **new_buckets = calloc(new_size, sizeof(hmap_entry_t*));
+  if (!new_ctable || !new_buckets) {
+    free(new_ctable);
+    free(new_buckets);
+    return;
+  }
+  new_ctable->buckets = new_buckets;
+  new_ctable->size = new_size;
+  new_ctable->reduce_m = hmap_reduce_init(new_size);
+  new_ctable->gen = hmap->table_gen ^ HMAP_BUCKET_GEN;
+
+  /* Readers may be walking the old chains, so copy rather than relink. */
+  size_t bucket;
+  for (bucket = 0; bucket < hmap->table_size; bucket++) {
+    hmap_entry_t *entry;
+    for (entry = hmap->table[bucket]; entry; entry = entry->next) {
+      size_t alloc_size = hmap_entry_alloc_size(hmap, entry);
+      hmap_entry_t *copy = hmap_mem_alloc(hmap, alloc_size);
+      if (!copy) {
+        hmap_conc_free_copies(hmap, new_buckets, new_size);
+        free(new_buckets);
+        free(new_ctable);
+        return;
+      }
+      memcpy(copy, entry, alloc_size);
+      if (entry->key_size <= hmap->inline_key_max) {
+        copy->key = copy + 1;  /* Inline key. */
+      }
+      uint32_t new_bucket = hmap_reduce(entry->hash, new_size, new_ctable->reduce_m);
+      copy->bucket = new_bucket | new_ctable->gen;
+      copy->next = new_buckets[new_bucket];
+      new_buckets[new_bucket] = copy;
+    }
+  }
+
+  __atomic_store_n(&conc->retired, old_ctable, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&conc->ctable, new_ctable, __ATOMIC_SEQ_CST);
+  hmap->table = new_buckets;
+  hmap->table_size = new_size;
+  hmap->reduce_m = new_ctable->reduce_m;
+  hmap->table_gen = new_ctable->gen;
+
+  hmap_conc_synchronize(conc);
+  hmap_conc_free_copies(hmap, old_ctable->buckets, old_ctable->size);
+  free(old_ctable->buckets);
+  free(old_ctable);
+  __atomic_store_n(&conc->retired, NULL, __ATOMIC_SEQ_CST);
+}  /* hmap_conc_grow */
+
+
+/* Parallel jobs (build_threads option). A job is split into num_parts
+ * parts that touch disjoint data: part 0 runs on the caller and the rest
+ * on threads started for the job, all joined before returning. */
+typedef void (*hmap_part_fn_t)(void *job, int part);
+
+typedef struct hmap_part_s {
+  hmap_part_fn_t fn;
+  void *job;
+  int part;
+} hmap_part_t;
+
+/* Below this many keys or entries, a job runs on the caller alone;
+ * starting threads would cost more than they save. */
+#define HMAP_PARALLEL_MIN 16384
+
+/* Parts split a range of "total" items evenly: part p starts at
+ * HMAP_PART_START(p) and item n belongs to part HMAP_PART_OF(n). */
+#define HMAP_PART_START(start__part, start__total, start__parts) \
+  ((size_t)(((uint64_t)(start__part) * (start__total) + (start__parts) - 1) / (start__parts)))
+#define HMAP_PART_OF(of__n, of__total, of__parts) \
+  ((int)((uint64_t)(of__n) * (of__parts) / (of__total)))
+
+
+static void *hmap_part_thread(void *in_part) {
+  hmap_part_t *part = (hmap_part_t *)in_part;
+  part->fn(part->job, part->part);
+  return NULL;
+}  /* hmap_part_thread */
+
+
+/* If a thread can't be started, its part runs on the caller instead. */
+static void hmap_run_parts(hmap_part_fn_t fn, void *job, int num_parts) {
+  pthread_t threads[HMAP_MAX_BUILD_THREADS];
+  hmap_part_t parts[HMAP_MAX_BUILD_THREADS];
+  int started[HMAP_MAX_BUILD_THREADS];
+  int part;
+
+  for (part = 1; part < num_parts; part++) {
+    parts[part].fn = fn;
+    parts[part].job = job;
+    parts[part].part = part;
+    started[part] = (pthread_create(&threads[part], NULL, hmap_part_thread, &parts[part]) == 0);
+  }
+  fn(job, 0);
+  for (part = 1; part < num_parts; part++) {
+    if (started[part]) {
+      pthread_join(threads[part], NULL);
+    } else {
+      fn(job, part);
+    }
+  }
+}  /* hmap_run_parts */
+
+
+/* Parallel rehash. Each part walks its own range of old buckets and sorts
+ * the entries into lists by the part that owns their new bucket; then
+ * each part links its lists into its own range of new buckets. */
+typedef struct hmap_rehash_job_s {
+  hmap_t *hmap;
+  hmap_entry_t **new_table;
+  size_t new_size;
+  uint64_t new_reduce_m;
+  uint32_t new_gen;
+  int num_parts;
+  hmap_entry_t **lists;  /* [from_part * num_parts + to_part]. */
+} hmap_rehash_job_t;
+
+
+static void hmap_rehash_split(void *in_job, int part) {
+  hmap_rehash_job_t *job = (hmap_rehash_job_t *)in_job;
+  hmap_t *hmap = job->hmap;
+  hmap_entry_t **lists = &job->lists[part * job->num_parts];
+  size_t bucket = HMAP_PART_START(part, hmap->table_size, job->num_parts);
+  size_t end_bucket = HMAP_PART_START(part + 1, hmap->table_size, job->num_parts);
+
+  for (; bucket < end_bucket; bucket++) {
+    hmap_entry_t *entry = hmap->table[bucket];
+    while (entry) {
+      hmap_entry_t *next = entry->next;
+      uint32_t new_bucket = hmap_reduce(entry->hash, job->new_size, job->new_reduce_m);
+      int to_part = HMAP_PART_OF(new_bucket, job->new_size, job->num_parts);
+      entry->bucket = new_bucket | job->new_gen;
+      entry->next = lists[to_part];
+      lists[to_part] = entry;
+      entry = next;
+    }
+  }
+}  /* hmap_rehash_split */
+
+
+static void hmap_rehash_link(void *in_job, int part) {
+  hmap_rehash_job_t *job = (hmap_rehash_job_t *)in_job;
+  int from_part;
+
+  for (from_part = 0; from_part < job->num_parts; from_part++) {
+    hmap_entry_t *entry = job->lists[from_part * job->num_parts + part];
+    while (entry) {
+      hmap_entry_t *next = entry->next;
+      uint32_t new_bucket = entry->bucket & HMAP_BUCKET_MASK;
+      entry->next = job->new_table[new_bucket];
+      job->new_table[new_bucket] = entry;
+      entry = next;
+    }
+  }
+}  /* hmap_rehash_link */
+
+
+/* Resize a chained table all at once (finishing any incremental resize
+ * first), in parallel if build_threads is set and the table is big enough.
+ * Not fatal if the new table can't be allocated. */
+static void hmap_chain_resize(hmap_t *hmap, size_t new_size) {
+  if (hmap->old_table) {
+    hmap_migrate(hmap, hmap->old_table_size);
+  }
+  hmap_entry_t **new_table = calloc(new_size, sizeof(hmap_entry_t*));
+  if (!new_table) {
+    return;
+  }
+  uint64_t new_reduce_m = hmap_reduce_init(new_size);
+  uint32_t new_gen = hmap->table_gen ^ HMAP_BUCKET_GEN;
+
+  hmap_entry_t **lists = NULL;
+  int num_parts = hmap->build_threads;
+  if (num_parts > 1 && hmap->num_entries >= HMAP_PARALLEL_MIN) {
+    lists = calloc((size_t)num_parts * num_parts, sizeof(hmap_entry_t *));
+  }
+  if (lists) {
+    hmap_rehash_job_t job;
+    job.hmap = hmap;
+    job.new_table = new_table;
+    job.new_size = new_size;
+    job.new_reduce_m = new_reduce_m;
+    job.new_gen = new_gen;
+    job.num_parts = num_parts;
+    job.lists = lists;
+    hmap_run_parts(hmap_rehash_split, &job, num_parts);
+    hmap_run_parts(hmap_rehash_link, &job, num_parts);
+    free(lists);
+  } else {
+    size_t bucket;
+    for (bucket = 0; bucket < hmap->table_size; bucket++) {
+      hmap_entry_t *entry = hmap->table[bucket];
+      while (entry) {
+        hmap_entry_t *next = entry->next;
+        uint32_t new_bucket = hmap_reduce(entry->hash, new_size, new_reduce_m);
+        entry->bucket = new_bucket | new_gen;
+        entry->next = new_table[new_bucket];
+        new_table[new_bucket] = entry;
+        entry = next;
+      }
+    }
+  }
+
+  free(hmap->table);
+  hmap->table = new_table;
+  hmap->table_size = new_size;
+  hmap->reduce_m = new_reduce_m;
+  hmap->table_gen = new_gen;
+}  /* hmap_chain_resize */
+
+
+/* Start an incremental resize if the load factor has been exceeded. With
+ * build_threads, resize all at once in parallel instead: one short stall
+ * rather than a little extra work on each of many calls. */
+static void hmap_check_grow(hmap_t *hmap) {
+  if (hmap->max_load <= 0 ||
+      (double)hmap->num_entries <= hmap->max_load * (double)hmap->table_size ||
+      hmap->table_size >= HMAP_MAX_TABLE_SIZE) {
+    return;
+  }
+
+  size_t new_size = hmap->table_size * 2;
+  if (new_size > HMAP_MAX_TABLE_SIZE) {
+    new_size = HMAP_MAX_TABLE_SIZE;
+  }
+  /* Over budget, keep the current table; chains just get longer. A
+   * concurrent grow copies the entries, so needs room for them too. */
+  size_t cost = hmap_malloc_size(new_size * sizeof(hmap_entry_t *));
+  if (hmap->conc) {
+    cost += hmap->mem_entry_bytes + hmap->mem_key_bytes;
+  }
+  if (hmap_over_budget(hmap, cost)) {
+    return;
+  }
+  if (hmap->conc) {
+    /* A writer inside its own read section can't wait for readers; a
+     * later write outside one grows the table instead. */
+    if (hmap_read_depth == 0) {
+      hmap_conc_grow(hmap, new_size);
+    }
+    return;
+  }
+  if (hmap->build_threads > 1) {
+    hmap_chain_resize(hmap, new_size);
+    return;
+  }
+
+  if (hmap->old_table) {
+    /* Previous resize didn't finish in time; complete it now. */
+    hmap_migrate(hmap, hmap->old_table_size);
+  }
+
+  hmap_entry_t **new_table = calloc(new_size, sizeof(hmap_entry_t*));
+  if (!new_table) {
+    return;  /* Not fatal; keep using the current table. */
+  }
+
+  hmap->old_table = hmap->table;
+  hmap->old_table_size = hmap->table_size;
+  hmap->old_reduce_m = hmap->reduce_m;
+  hmap->migrate_bucket = 0;
+  hmap->table = new_table;
+  hmap->table_size = new_size;
+  hmap->reduce_m = hmap_reduce_init(new_size);
+  hmap->table_gen ^= HMAP_BUCKET_GEN;
+}  /* hmap_check_grow */
+
+
+/* Find a key in the current table and (if resizing) the old table. */
+static hmap_entry_t *hmap_chain_find(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash) {
+  hmap_entry_t *entry = hmap->table[hmap_reduce(hash, hmap->table_size, hmap->reduce_m)];
+  while (entry) {
+    HMAP_COUNT(hmap, probes, 1);
+    if (hash == entry->hash && hmap_key_equal(hmap, entry, key, key_size)) {
+      return entry;
+    }
+    entry = entry->next;
+  }
+
+  if (hmap->old_table) {
+    size_t old_bucket = hmap_reduce(hash, hmap->old_table_size, hmap->old_reduce_m);
+    if (old_bucket >= hmap->migrate_bucket) {  /* Not migrated yet. */
+      entry = hmap->old_table[old_bucket];
+      while (entry) {
+        HMAP_COUNT(hmap, probes, 1);
+        if (hash == entry->hash && hmap_key_equal(hmap, entry, key, key_size)) {
+          return entry;
+        }
+        entry = entry->next;
+      }
+    }
+  }
+
+  return NULL;
+}  /* hmap_chain_find */
+
+
+/* Slot-sized scratch space for moving open addressing entries around. */
+#define HMAP_SLOT_BUF_WORDS ((sizeof(hmap_entry_t) + HMAP_INLINE_KEY_LIMIT) / 8 + 1)
+
+
+/* Copy an entry (and its inline key) into a slot. An inline key moves
+ * with the entry, so its key pointer has to follow. */
+static void hmap_slot_put(const hmap_t *hmap, char *slots, size_t slot, const hmap_entry_t *entry) {
+  hmap_entry_t *dst = (hmap_entry_t *)(slots + slot * hmap->slot_size);
+  memcpy(dst, entry, hmap->slot_size);
+  dst->bucket = slot;
+  if (dst->key_size <= hmap->inline_key_max) {
+    dst->key = dst + 1;
+  }
+}  /* hmap_slot_put */
+
+
+/* Robin Hood open addressing. Entries live directly in the "slots" array
+ * and "hashes" holds each slot's hash, so a probe scans the compact hash
+ * array and only touches a slot (and its key) when the hashes match.
+ * Entries are kept ordered by distance from their home slot, so a probe
+ * can stop as soon as it passes an entry closer to home than itself. */
+
+/* "hashes" holds the low 32 bits of each slot's hash. Zero marks an empty
+ * slot, so a zero is stored as 1. */
+#define HMAP_RH_HASH(rh__hash) ((uint32_t)(rh__hash) ? (uint32_t)(rh__hash) : 1)
+
+
+static size_t hmap_rh_dist(size_t table_size, uint64_t reduce_m, size_t slot, uint32_t hash) {
+  size_t home = hmap_reduce(hash, table_size, reduce_m);
+  return (slot >= home) ? (slot - home) : (slot + table_size - home);
+}  /* hmap_rh_dist */
+
+
+static hmap_entry_t *hmap_rh_find(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash) {
+  size_t table_size = hmap->table_size;
+  uint64_t reduce_m = hmap->reduce_m;
+  uint32_t rh_hash = HMAP_RH_HASH(hash);
+  size_t slot = hmap_reduce(rh_hash, table_size, reduce_m);
+  size_t dist = 0;
+
+  /* The load factor is < 1, so there is always an empty slot to stop at. */
+  for (;;) {
+    uint32_t slot_hash = hmap->hashes[slot];
+    HMAP_COUNT(hmap, probes, 1);
+    if (slot_hash == 0 || dist > hmap_rh_dist(table_size, reduce_m, slot, slot_hash)) {
+      return NULL;
+    }
+    if (slot_hash == rh_hash) {
+      hmap_entry_t *entry = HMAP_SLOT(hmap, slot);
+      if (hash == entry->hash && hmap_key_equal(hmap, entry, key, key_size)) {
+        return entry;
+      }
+    }
+    slot++;
+    if (slot == table_size) {
+      slot = 0;
+    }
+    dist++;
+  }
+}  /* hmap_rh_find */
+
+
+/* Place an entry that is known not to be in the table, and return its
+ * slot. "in_entry" must be slot_size bytes. */
+static size_t hmap_rh_insert(const hmap_t *hmap, char *slots, uint32_t *hashes, size_t table_size,
+    uint64_t reduce_m, const hmap_entry_t *in_entry, uint32_t hash) {
+  uint64_t carry_buf[HMAP_SLOT_BUF_WORDS];
+  uint64_t tmp_buf[HMAP_SLOT_BUF_WORDS];
+  hmap_entry_t *carry = (hmap_entry_t *)carry_buf;
+  size_t slot = hmap_reduce(hash, table_size, reduce_m);
+  size_t dist = 0;
+  size_t in_slot = table_size;  /* None yet. */
+
+  memcpy(carry, in_entry, hmap->slot_size);
+  for (;;) {
+    if (hashes[slot] == 0) {
+      hmap_slot_put(hmap, slots, slot, carry);
+      hashes[slot] = hash;
+      return (in_slot == table_size) ? slot : in_slot;
+    }
+    size_t slot_dist = hmap_rh_dist(table_size, reduce_m, slot, hashes[slot]);
+    if (slot_dist < dist) {
+      /* Resident is closer to home than we are; take its slot and carry it on. */
+      uint32_t tmp_hash = hashes[slot];
+      memcpy(tmp_buf, slots + slot * hmap->slot_size, hmap->slot_size);
+      hmap_slot_put(hmap, slots, slot, carry);
+      hashes[slot] = hash;
+      if (in_slot == table_size) {
+        in_slot = slot;
+      }
+      memcpy(carry, tmp_buf, hmap->slot_size);
+      hash = tmp_hash;
+      dist = slot_dist;
+    }
+    slot++;
+    if (slot == table_size) {
+      slot = 0;
+    }
+    dist++;
+  }
+}  /* hmap_rh_insert */
+
+
+/* Open addressing resizes all at once (there is no incremental migration),
+ * but the stored hashes mean no key is rehashed. */
+static ERR_F hmap_rh_grow(hmap_t *hmap) {
+  size_t new_size = hmap->table_size * 2;
+  if (new_size > HMAP_MAX_TABLE_SIZE) {
+    new_size = HMAP_MAX_TABLE_SIZE;
+  }
+  ERR_ASSRT(new_size > hmap->table_size, HMAP_ERR_NOMEM);
+  ERR_ASSRT(!hmap_over_budget(hmap, hmap_malloc_size(new_size * hmap->slot_size) +
+      hmap_malloc_size(new_size * sizeof(uint32_t))), HMAP_ERR_BUDGET);
+
+  uint64_t new_reduce_m = hmap_reduce_init(new_size);
+  char *new_slots = calloc(new_size, hmap->slot_size);
+  uint32_t *new_hashes = calloc(new_size, sizeof(uint32_t));
+  if (!new_slots || !new_hashes) {
+    free(new_slots);
+    free(new_hashes);
+    ERR_THROW(HMAP_ERR_NOMEM, "new_slots");
+  }
+
+  size_t slot;
+  for (slot = 0; slot < hmap->table_size; slot++) {
+    if (hmap->hashes[slot] != 0) {
+      hmap_rh_insert(hmap, new_slots, new_hashes, new_size, new_reduce_m,
+          HMAP_SLOT(hmap, slot), hmap->hashes[slot]);
+    }
+  }
+
+  free(hmap->slots);
+  free(hmap->hashes);
+  hmap->slots = new_slots;
+  hmap->hashes = new_hashes;
+  hmap->table_size = new_size;
+  hmap->reduce_m = new_reduce_m;
+
+  return ERR_OK;
+}  /* hmap_rh_grow */
+
+
+/* Group probing (Swiss table style). Each slot has a control byte holding
+ * 7 bits of its hash. A probe loads HMAP_GROUP_WIDTH consecutive control
+ * bytes starting at the home slot and compares them all at once, so only
+ * slots whose 7 bits match get a key compare. Probing is linear (a window
+ * can start at any slot), and the first HMAP_GROUP_WIDTH control bytes are
+ * cloned after the end of the array so a window never has to wrap. */
+
+#if defined(HMAP_SSE2)
+
+/* Bit i set if ctrl[i] == h2. */
+static uint32_t hmap_group_match(const uint8_t *ctrl, uint8_t h2) {
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
+}  /* hmap_group_match */
+
+/* Bit i set if ctrl[i] is empty. */
+static uint32_t hmap_group_empty(const uint8_t *ctrl) {
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}  /* hmap_group_empty */
+
+#else  /* Portable: 8 bytes at a time in a 64-bit word (SWAR). */
+
+#define HMAP_SWAR_LO7 0x7f7f7f7f7f7f7f7fULL
+#define HMAP_SWAR_HI 0x8080808080808080ULL
+
+static uint64_t hmap_swar_load(const uint8_t *ctrl) {
+  uint64_t word = 0;
+  int i;
+  for (i = 0; i < 8; i++) {  /* Little-endian regardless of host. */
+    word |= (uint64_t)ctrl[i] << (i * 8);
+  }
+  return word;
+}  /* hmap_swar_load */
+
+/* Gather the high bit of each byte into the low 8 bits. */
+static uint32_t hmap_swar_bits(uint64_t hi_bits) {
+  return (uint32_t)(((hi_bits >> 7) * 0x0102040810204080ULL) >> 56);
+}  /* hmap_swar_bits */
+
+static uint32_t hmap_group_match(const uint8_t *ctrl, uint8_t h2) {
+  uint32_t bits = 0;
+  int half;
+  for (half = 0; half < 2; half++) {
+    uint64_t x = hmap_swar_load(ctrl + half * 8) ^ (0x0101010101010101ULL * h2);
+    /* High bit set in each byte of x that is zero (exact, no false hits). */
+    uint64_t zero = ~(((x & HMAP_SWAR_LO7) + HMAP_SWAR_LO7) | x) & HMAP_SWAR_HI;
+    bits |= hmap_swar_bits(zero) << (half * 8);
+  }
+  return bits;
+}  /* hmap_group_match */
+
+static uint32_t hmap_group_empty(const uint8_t *ctrl) {
+  return hmap_swar_bits(hmap_swar_load(ctrl) & HMAP_SWAR_HI) |
+      (hmap_swar_bits(hmap_swar_load(ctrl + 8) & HMAP_SWAR_HI) << 8);
+}  /* hmap_group_empty */
+
+#endif  /* HMAP_SSE2 */
+
+
+static int hmap_lowest_bit(uint32_t bits) {
+  return __builtin_ctz(bits);
+}  /* hmap_lowest_bit */
+
+
+static void hmap_group_set_ctrl(uint8_t *ctrl, size_t table_size, size_t slot, uint8_t value) {
+  ctrl[slot] = value;
+  if (slot < HMAP_GROUP_WIDTH) {
+    ctrl[table_size + slot] = value;  /* Keep the clone in sync. */
+  }
+}  /* hmap_group_set_ctrl */
+
+
+static hmap_entry_t *hmap_group_find(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash) {
+  size_t table_size = hmap->table_size;
+  size_t pos = hmap_reduce(hash, table_size, hmap->reduce_m);
+  uint8_t h2 = HMAP_CTRL_H2(hash);
+
+  /* The load factor is < 1, so there is always an empty slot to stop at. */
+  for (;;) {
+    uint32_t match = hmap_group_match(&hmap->ctrl[pos], h2);
+    HMAP_COUNT(hmap, probes, 1);
+    uint32_t empty = hmap_group_empty(&hmap->ctrl[pos]);
+    if (empty) {
+      /* With linear probing, the key can't be beyond the first empty slot. */
+      match &= (empty & (0 - empty)) - 1;
+    }
+    while (match) {
+      size_t slot = pos + hmap_lowest_bit(match);
+      if (slot >= table_size) {
+        slot -= table_size;
+      }
+      hmap_entry_t *entry = HMAP_SLOT(hmap, slot);
+      if (hash == entry->hash && hmap_key_equal(hmap, entry, key, key_size)) {
+        return entry;
+      }
+      match &= match - 1;
+    }
+    if (empty) {
+      return NULL;
+    }
+    pos += HMAP_GROUP_WIDTH;
+    if (pos >= table_size) {
+      pos -= table_size;
+    }
+  }
+}  /* hmap_group_find */
+
+
+/* Place an entry that is known not to be in the table, and return its
+ * slot. "in_entry" must be slot_size bytes. */
+static size_t hmap_group_insert(const hmap_t *hmap, char *slots, uint8_t *ctrl, size_t table_size,
+    uint64_t reduce_m, const hmap_entry_t *in_entry, uint64_t hash) {
+  size_t pos = hmap_reduce(hash, table_size, reduce_m);
+
+  for (;;) {
+    uint32_t empty = hmap_group_empty(&ctrl[pos]);
+    if (empty) {
+      size_t slot = pos + hmap_lowest_bit(empty);
+      if (slot >= table_size) {
+        slot -= table_size;
+      }
+      hmap_slot_put(hmap, slots, slot, in_entry);
+      hmap_group_set_ctrl(ctrl, table_size, slot, HMAP_CTRL_H2(hash));
+      return slot;
+    }
+    pos += HMAP_GROUP_WIDTH;
+    if (pos >= table_size) {
+      pos -= table_size;
+    }
+  }
+}  /* hmap_group_insert */
+
+
+/* Like Robin Hood, group tables resize all at once, using the hash
+ * cached in each entry. */
+static ERR_F hmap_group_grow(hmap_t *hmap) {
+  size_t new_size = hmap->table_size * 2;
+  if (new_size > HMAP_MAX_TABLE_SIZE) {
+    new_size = HMAP_MAX_TABLE_SIZE;
+  }
+  ERR_ASSRT(new_size > hmap->table_size, HMAP_ERR_NOMEM);
+  ERR_ASSRT(!hmap_over_budget(hmap, hmap_malloc_size(new_size * hmap->slot_size) +
+      hmap_malloc_size(new_size + HMAP_GROUP_WIDTH)), HMAP_ERR_BUDGET);
+
+  uint64_t new_reduce_m = hmap_reduce_init(new_size);
+  char *new_slots = calloc(new_size, hmap->slot_size);
+  uint8_t *new_ctrl = malloc(new_size + HMAP_GROUP_WIDTH);
+  if (!new_slots || !new_ctrl) {
+    free(new_slots);
+    free(new_ctrl);
+    ERR_THROW(HMAP_ERR_NOMEM, "new_slots");
+  }
+  memset(new_ctrl, HMAP_CTRL_EMPTY, new_size + HMAP_GROUP_WIDTH);
+
+  size_t slot;
+  for (slot = 0; slot < hmap->table_size; slot++) {
+    if (hmap_slot_used(hmap, slot)) {
+      hmap_entry_t *entry = HMAP_SLOT(hmap, slot);
+      hmap_group_insert(hmap, new_slots, new_ctrl, new_size, new_reduce_m, entry, entry->hash);
+    }
+  }
+
+  free(hmap->slots);
+  free(hmap->ctrl);
+  hmap->slots = new_slots;
+  hmap->ctrl = new_ctrl;
+  hmap->table_size = new_size;
+  hmap->reduce_m = new_reduce_m;
+
+  return ERR_OK;
+}  /* hmap_group_grow */
+
+
+/* Add a key known not to be in an open addressing table. */
+static ERR_F hmap_open_insert(hmap_t *hmap, const void *key, size_t key_size, void *val, uint64_t hash,
+    hmap_entry_t **rtn_entry) {
+  int is_group = (hmap->layout == HMAP_LAYOUT_GROUP);
+
+  if ((double)(hmap->num_entries + 1) > hmap->max_load * (double)hmap->table_size) {
+    err_t *err = is_group ? hmap_group_grow(hmap) : hmap_rh_grow(hmap);
+    if (err) {
+      /* Can limp along as long as there is a free slot left. */
+      if ((size_t)hmap->num_entries + 1 >= hmap->table_size) {
+        ERR_RETHROW(err, "grow");
+      }
+      err_dispose(err);
+    }
+  }
+
+  /* Build the new entry in a slot-sized buffer. */
+  uint64_t new_buf[HMAP_SLOT_BUF_WORDS];
+  hmap_entry_t *new_entry = (hmap_entry_t *)new_buf;
+  memset(new_entry, 0, hmap->slot_size);
+  if (key_size <= hmap->inline_key_max) {
+    new_entry->key = new_entry + 1;  /* hmap_slot_put() fixes this up. */
+  } else {
+    ERR_ASSRT(!hmap_over_budget(hmap, hmap_mem_cost(hmap, key_size)), HMAP_ERR_BUDGET);
+    new_entry->key = hmap_mem_alloc(hmap, key_size);
+    ERR_ASSRT(new_entry->key, HMAP_ERR_NOMEM);
+    hmap->mem_key_bytes += key_size;
+  }
+  memcpy(new_entry->key, key, key_size);
+  new_entry->key_size = key_size;
+  new_entry->value = val;
+  new_entry->hash = hash;
+
+  size_t slot;
+  if (is_group) {
+    slot = hmap_group_insert(hmap, hmap->slots, hmap->ctrl, hmap->table_size, hmap->reduce_m,
+        new_entry, hash);
+  } else {
+    slot = hmap_rh_insert(hmap, hmap->slots, hmap->hashes, hmap->table_size, hmap->reduce_m,
+        new_entry, HMAP_RH_HASH(hash));
+  }
+  hmap->num_entries ++;
+
+  if (rtn_entry) {
+    *rtn_entry = HMAP_SLOT(hmap, slot);
+  }
+  return ERR_OK;
+}  /* hmap_open_insert */
+
+
+/* Write for both open addressing layouts. */
+static ERR_F hmap_open_write(hmap_t *hmap, const void *key, size_t key_size, void *val, uint64_t hash) {
+  hmap_entry_t *entry = (hmap->layout == HMAP_LAYOUT_GROUP) ? hmap_group_find(hmap, key, key_size, hash)
+                                                            : hmap_rh_find(hmap, key, key_size, hash);
+  if (entry) {
+    entry->value = val;
+    return ERR_OK;
+  }
+
+  ERR(hmap_open_insert(hmap, key, key_size, val, hash, NULL));
+
+  return ERR_OK;
+}  /* hmap_open_write */
+
+
+/* Add a key known not to be in a chained table. In concurrent mode the
+ * caller holds the write lock, and stores that readers can see are atomic. */
+static ERR_F hmap_chain_insert(hmap_t *hmap, const void *key, size_t key_size, void *val, uint64_t hash,
+    hmap_entry_t **rtn_entry) {
+  /* Adding entries invalidates iterators, so there is no need to hold
+   * off migration. */
+  hmap->iterating = 0;
+  if (hmap->old_table) {
+    hmap_migrate(hmap, HMAP_MIGRATE_BUCKETS);
+  }
+
+  int inline_key = (key_size <= hmap->inline_key_max);
+  if (hmap->mem_budget > 0) {
+    size_t cost = inline_key ? hmap_mem_cost(hmap, sizeof(hmap_entry_t) + key_size)
+                             : hmap_mem_cost(hmap, sizeof(hmap_entry_t)) + hmap_mem_cost(hmap, key_size);
+    ERR_ASSRT(!hmap_over_budget(hmap, cost), HMAP_ERR_BUDGET);
+  }
+  hmap_entry_t *new_entry = hmap_mem_alloc(hmap,
+      sizeof(hmap_entry_t) + (inline_key ? key_size : 0));
+  ERR_ASSRT(new_entry, HMAP_ERR_NOMEM);
+  memset(new_entry, 0, sizeof(hmap_entry_t));
+
+  if (inline_key) {
+    new_entry->key = new_entry + 1;
+  } else {
+    new_entry->key = hmap_mem_alloc(hmap, key_size);
+    if (!new_entry->key) {
+      hmap_mem_free(hmap, new_entry, sizeof(hmap_entry_t));
+      ERR_THROW(HMAP_ERR_NOMEM, "new_entry->key");
+    }
+  }
+  uint32_t bucket = hmap_reduce(hash, hmap->table_size, hmap->reduce_m);
+  memcpy(new_entry->key, key, key_size);
+  new_entry->key_size = key_size;
+  new_entry->value = val;
+  new_entry->bucket = bucket | hmap->table_gen;
+  new_entry->hash = hash;
+
+  /* Insert at head of list for this bucket. The entry is complete before
+   * a concurrent reader can reach it. */
+  new_entry->next = hmap->table[bucket];
+  __atomic_store_n(&hmap->table[bucket], new_entry, __ATOMIC_RELEASE);
+  hmap->num_entries ++;
+  hmap->mem_entry_bytes += sizeof(hmap_entry_t);
+  hmap->mem_key_bytes += key_size;
+
+  /* Growing relinks entries without moving them, so *rtn_entry stays
+   * good (except in concurrent mode, which copies them). */
+  hmap_check_grow(hmap);
+
+  if (rtn_entry) {
+    *rtn_entry = new_entry;
+  }
+  return ERR_OK;
+}  /* hmap_chain_insert */
+
+
+/* Write to the chained layout (see hmap_chain_insert()). */
+static ERR_F hmap_chain_write(hmap_t *hmap, const void *key, size_t key_size, void *val, uint64_t hash) {
+  /* Search linked list(s).  */
+  hmap_entry_t *entry = hmap_chain_find(hmap, key, key_size, hash);
+  if (entry) {
+    __atomic_store_n(&entry->value, val, __ATOMIC_RELEASE);
+    return ERR_OK;
+  }
+
+  ERR(hmap_chain_insert(hmap, key, key_size, val, hash, NULL));
+
+  return ERR_OK;
+}  /* hmap_chain_write */
+
+
+/* hmap_write() for a key whose hash is already known. */
+static ERR_F hmap_write_hash(hmap_t *hmap, const void *key, size_t key_size, void *val, uint64_t hash) {
+  hmap_t *parent = NULL;
+  if (hmap->segments) {
+    parent = hmap;
+    hmap = HMAP_SEGMENT(hmap, hash);
+  }
+  HMAP_COUNT(hmap, writes, 1);
+  if (hmap->layout != HMAP_LAYOUT_CHAINED) {
+    ERR(hmap_open_write(hmap, key, key_size, val, hash));
+    return ERR_OK;
+  }
+
+  if (hmap->conc) {
+    if (pthread_mutex_trylock(&hmap->conc->write_lock) != 0) {
+      pthread_mutex_lock(&hmap->conc->write_lock);
+      __atomic_fetch_add(&hmap->conc->contended, 1, __ATOMIC_RELAXED);
+    }
+    int old_entries = hmap->num_entries;
+    err_t *err = hmap_chain_write(hmap, key, key_size, val, hash);
+    int added = hmap->num_entries - old_entries;
+    pthread_mutex_unlock(&hmap->conc->write_lock);
+    if (parent && added) {
+      /* Segments write in parallel, so the map's total is kept atomically. */
+      __atomic_fetch_add(&parent->num_entries, added, __ATOMIC_RELAXED);
+    }
+    if (err) {
+      ERR_RETHROW(err, "hmap_chain_write");
+    }
+  } else {
+    ERR(hmap_chain_write(hmap, key, key_size, val, hash));
+  }
+
+  return ERR_OK;
+}  /* hmap_write_hash */
+
+
+ERR_F hmap_write(hmap_t *hmap, const void *key, size_t key_size, void *val) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(key, HMAP_ERR_PARAM);
+  ERR_ASSRT(hmap->mapped == NULL, HMAP_ERR_PARAM);
+
+  ERR(hmap_write_hash(hmap, key, key_size, val, hmap_hash(hmap, key, key_size)));
+
+  return ERR_OK;
+}  /* hmap_write */
+
+
+/* Bytes a bulk entry takes in its block (kept 8-byte aligned). */
+#define HMAP_BULK_SIZE(bulk__key_size) \
+  (sizeof(hmap_entry_t) + (((bulk__key_size) + 7) & ~(size_t)7))
+
+/* Bucket partitions for grouping a batch: each covers this many buckets,
+ * so placing one partition's entries touches a few KB of the table. Very
+ * large tables use wider partitions, to bound the per-part counts. */
+#define HMAP_BULK_PARTITION_SHIFT 10
+#define HMAP_BULK_MAX_COUNTS (1 << 20)
+
+
+/* A batch is loaded in three passes, each split into parts. The hash pass
+ * and the scatter pass split the keys; the link pass splits the table, so
+ * each part links (and checks for duplicates in) only its own buckets. */
+typedef struct hmap_batch_job_s {
+  hmap_t *hmap;
+  const void *const *keys;
+  const size_t *key_sizes;
+  void *const *vals;
+  size_t num_keys;
+  int flags;
+  int num_parts;
+  int partition_shift;
+  size_t num_partitions;
+  uint64_t *hashes;
+  uint32_t *buckets;
+  size_t *order;  /* Key indexes, grouped by partition. */
+  size_t *counts;  /* [part * num_partitions + partition]: keys, then order positions. */
+  size_t *bytes;  /* [part * num_parts + owner]: entry bytes for the owning link part. */
+  size_t owner_starts[HMAP_MAX_BUILD_THREADS + 1];  /* Link part ranges of "order". */
+  char *chunks[HMAP_MAX_BUILD_THREADS];  /* Link part's first entry in the block. */
+  size_t used[HMAP_MAX_BUILD_THREADS];
+  size_t added[HMAP_MAX_BUILD_THREADS];
+  size_t added_key_bytes[HMAP_MAX_BUILD_THREADS];
+} hmap_batch_job_t;
+
+
+static void hmap_batch_hash(void *in_job, int part) {
+  hmap_batch_job_t *job = (hmap_batch_job_t *)in_job;
+  hmap_t *hmap = job->hmap;
+  size_t *counts = &job->counts[part * job->num_partitions];
+  size_t *bytes = &job->bytes[part * job->num_parts];
+  size_t i = HMAP_PART_START(part, job->num_keys, job->num_parts);
+  size_t end = HMAP_PART_START(part + 1, job->num_keys, job->num_parts);
+
+  for (; i < end; i++) {
+    job->hashes[i] = hmap_hash(hmap, job->keys[i], job->key_sizes[i]);
+    job->buckets[i] = (uint32_t)hmap_reduce(job->hashes[i], hmap->table_size, hmap->reduce_m);
+    size_t partition = job->buckets[i] >> job->partition_shift;
+    counts[partition]++;
+    bytes[HMAP_PART_OF(partition, job->num_partitions, job->num_parts)] += HMAP_BULK_SIZE(job->key_sizes[i]);
+  }
+}  /* hmap_batch_hash */
+
+
+static void hmap_batch_scatter(void *in_job, int part) {
+  hmap_batch_job_t *job = (hmap_batch_job_t *)in_job;
+  size_t *positions = &job->counts[part * job->num_partitions];
+  size_t i = HMAP_PART_START(part, job->num_keys, job->num_parts);
+  size_t end = HMAP_PART_START(part + 1, job->num_keys, job->num_parts);
+
+  for (; i < end; i++) {
+    job->order[positions[job->buckets[i] >> job->partition_shift]++] = i;
+  }
+}  /* hmap_batch_scatter */
+
+
+static void hmap_batch_link(void *in_job, int part) {
+  hmap_batch_job_t *job = (hmap_batch_job_t *)in_job;
+  hmap_t *hmap = job->hmap;
+  char *next_chunk = job->chunks[part];
+  size_t added = 0;
+  size_t added_key_bytes = 0;
+  size_t j;
+
+  for (j = job->owner_starts[part]; j < job->owner_starts[part + 1]; j++) {
+    size_t k = job->order[j];
+    uint32_t bucket = job->buckets[k];
+    if (!(job->flags & HMAP_BATCH_UNIQUE)) {
+      hmap_entry_t *entry = hmap_chain_find(hmap, job->keys[k], job->key_sizes[k], job->hashes[k]);
+      if (entry) {
+        entry->value = job->vals[k];
+        continue;
+      }
+    }
+
+    hmap_entry_t *new_entry = (hmap_entry_t *)next_chunk;
+    next_chunk += HMAP_BULK_SIZE(job->key_sizes[k]);
+    new_entry->key = new_entry + 1;
+    memcpy(new_entry->key, job->keys[k], job->key_sizes[k]);
+    new_entry->key_size = job->key_sizes[k];
+    new_entry->value = job->vals[k];
+    new_entry->bucket = bucket | hmap->table_gen;
+    new_entry->flags = HMAP_ENTRY_BULK;
+    new_entry->hash = job->hashes[k];
+    new_entry->next = hmap->table[bucket];
+    hmap->table[bucket] = new_entry;
+    added++;
+    added_key_bytes += job->key_sizes[k];
+  }
+  job->used[part] = (size_t)(next_chunk - job->chunks[part]);
+  job->added[part] = added;
+  job->added_key_bytes[part] = added_key_bytes;
+}  /* hmap_batch_link */
+
+
+/* Chained layout: one pass to hash, one to group the keys by bucket range,
+ * one allocation for all the entries and keys, and one pass to link them
+ * in (checking for duplicates unless HMAP_BATCH_UNIQUE). With build_threads,
+ * each pass is split across threads. */
+static ERR_F hmap_chain_write_batch(hmap_t *hmap, const void *const *keys, const size_t *key_sizes,
+    void *const *vals, size_t num_keys, int flags) {
+  hmap_batch_job_t job;
+  int part;
+
+  /* Size the table once, rather than growing it along the way. */
+  if (hmap->max_load > 0) {
+    size_t new_size = hmap->table_size;
+    while ((double)(hmap->num_entries + num_keys) > hmap->max_load * (double)new_size &&
+        new_size < HMAP_MAX_TABLE_SIZE) {
+      new_size *= 2;
+    }
+    if (new_size > HMAP_MAX_TABLE_SIZE) {
+      new_size = HMAP_MAX_TABLE_SIZE;
+    }
+    if (new_size != hmap->table_size &&
+        !hmap_over_budget(hmap, hmap_malloc_size(new_size * sizeof(hmap_entry_t *)))) {
+      hmap_chain_resize(hmap, new_size);
+    }
+  }
+  if (hmap->old_table) {
+    hmap_migrate(hmap, hmap->old_table_size);
+  }
+  hmap->iterating = 0;
+
+  memset(&job, 0, sizeof(job));
+  job.hmap = hmap;
+  job.keys = keys;
+  job.key_sizes = key_sizes;
+  job.vals = vals;
+  job.num_keys = num_keys;
+  job.flags = flags;
+  job.num_parts = 1;
+  if (hmap->build_threads > 1 && num_keys >= HMAP_PARALLEL_MIN) {
+    job.num_parts = hmap->build_threads;
+  }
+  job.partition_shift = HMAP_BULK_PARTITION_SHIFT;
+  while (((hmap->table_size >> job.partition_shift) + 1) * job.num_parts > HMAP_BULK_MAX_COUNTS) {
+    job.partition_shift++;
+  }
+  job.num_partitions = (hmap->table_size >> job.partition_shift) + 1;
+
+  job.hashes = malloc(num_keys * sizeof(uint64_t));
+  job.buckets = malloc(num_keys * sizeof(uint32_t));
+  job.order = malloc(num_keys * sizeof(size_t));
+  job.counts = calloc(job.num_partitions * job.num_parts, sizeof(size_t));
+  job.bytes = calloc((size_t)job.num_parts * job.num_parts, sizeof(size_t));
+  hmap_slab_t *block = NULL;
+  size_t block_size = 0;
+  int over_budget = 0;
+  if (job.hashes && job.buckets && job.order && job.counts && job.bytes) {
+    hmap_run_parts(hmap_batch_hash, &job, job.num_parts);
+    size_t i;
+    for (i = 0; i < (size_t)job.num_parts * job.num_parts; i++) {
+      block_size += job.bytes[i];
+    }
+    over_budget = hmap_over_budget(hmap, hmap_malloc_size(HMAP_SLAB_HDR + block_size));
+    if (!over_budget) {
+      block = malloc(HMAP_SLAB_HDR + block_size);
+    }
+  }
+  if (!block) {
+    free(job.hashes);
+    free(job.buckets);
+    free(job.order);
+    free(job.counts);
+    free(job.bytes);
+    ERR_THROW(over_budget ? HMAP_ERR_BUDGET : HMAP_ERR_NOMEM, "hmap_write_batch");
+  }
+  block->next = hmap->bulk_blocks;
+  block->size = block_size;
+  block->used = 0;
+  hmap->bulk_blocks = block;
+
+  /* Counting sort of the keys by partition (and within a partition, by
+   * hash part, which keeps batch order). Each link part gets the
+   * partitions it owns and the block space for their entries. */
+  size_t position = 0;
+  size_t partition;
+  int owner = 0;
+  for (partition = 0; partition < job.num_partitions; partition++) {
+    while (owner < job.num_parts && HMAP_PART_START(owner, job.num_partitions, job.num_parts) == partition) {
+      job.owner_starts[owner++] = position;
+    }
+    for (part = 0; part < job.num_parts; part++) {
+      size_t count = job.counts[part * job.num_partitions + partition];
+      job.counts[part * job.num_partitions + partition] = position;
+      position += count;
+    }
+  }
+  while (owner <= job.num_parts) {
+    job.owner_starts[owner++] = position;
+  }
+  char *next_chunk = (char *)block + HMAP_SLAB_HDR;
+  for (owner = 0; owner < job.num_parts; owner++) {
+    job.chunks[owner] = next_chunk;
+    for (part = 0; part < job.num_parts; part++) {
+      next_chunk += job.bytes[part * job.num_parts + owner];
+    }
+  }
+
+  hmap_run_parts(hmap_batch_scatter, &job, job.num_parts);
+  hmap_run_parts(hmap_batch_link, &job, job.num_parts);
+
+  /* The block is overhead, less the entries and keys that were added
+   * (duplicates leave gaps at its end). */
+  hmap->mem_overhead += hmap_malloc_size(HMAP_SLAB_HDR + block_size);
+  for (part = 0; part < job.num_parts; part++) {
+    block->used += job.used[part];
+    hmap->num_entries += (int)job.added[part];
+    hmap->mem_entry_bytes += job.added[part] * sizeof(hmap_entry_t);
+    hmap->mem_key_bytes += job.added_key_bytes[part];
+    hmap->mem_overhead -= job.added[part] * sizeof(hmap_entry_t) + job.added_key_bytes[part];
+  }
+
+  free(job.hashes);
+  free(job.buckets);
+  free(job.order);
+  free(job.counts);
+  free(job.bytes);
+  return ERR_OK;
+}  /* hmap_chain_write_batch */
+
+
+ERR_F hmap_write_batch(hmap_t *hmap, const void *const *keys, const size_t *key_sizes,
+    void *const *vals, size_t num_keys, int flags) {
+  size_t i;
+
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(num_keys == 0 || (keys && key_sizes && vals), HMAP_ERR_PARAM);
+  ERR_ASSRT(hmap->mapped == NULL, HMAP_ERR_PARAM);
+  if (num_keys == 0) {
+    return ERR_OK;
+  }
+
+  /* Bulk entries would be copied (and their keys shared) by a concurrent
+   * grow, so concurrent maps take the ordinary path, as do open
+   * addressing layouts, whose entries already live in one array. */
+  if (hmap->layout == HMAP_LAYOUT_CHAINED && hmap->conc == NULL && hmap->segments == NULL) {
+    ERR(hmap_chain_write_batch(hmap, keys, key_sizes, vals, num_keys, flags));
+    HMAP_COUNT(hmap, writes, num_keys);
+  } else {
+    for (i = 0; i < num_keys; i++) {
+      ERR(hmap_write(hmap, keys[i], key_sizes[i], vals[i]));
+    }
+  }
+
+  return ERR_OK;
+}  /* hmap_write_batch */
+
+
+/* Lookup shared by all the lookup APIs. Returns NULL if not found. */
+static hmap_entry_t *hmap_lookup_entry(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash) {
+  if (hmap->layout == HMAP_LAYOUT_ROBINHOOD) {
+    return hmap_rh_find(hmap, key, key_size, hash);
+  }
+  if (hmap->layout == HMAP_LAYOUT_GROUP) {
+    return hmap_group_find(hmap, key, key_size, hash);
+  }
+  if (hmap->old_table && !hmap->iterating) {
+    hmap_migrate(hmap, HMAP_MIGRATE_BUCKETS);
+  }
+  return hmap_chain_find(hmap, key, key_size, hash);
+}  /* hmap_lookup_entry */
+
+
+static uint64_t hmap_file_checksum(const void *data, size_t size) {
+  uint64_t hash[2];
+  hmap_murmur3_x64_128_inline(data, size, 0, hash);
+  return hash[0];
+}  /* hmap_file_checksum */
+
+
+static void *hmap_mapped_value(const hmap_mapped_t *mapped, const hmap_file_entry_t *record) {
+  if (mapped->value_size == 0) {
+    return (void *)(uintptr_t)record->value;
+  }
+  return record->value ? mapped->base + record->value : NULL;
+}  /* hmap_mapped_value */
+
+
+/* Nothing in a mapped map ever changes, so any number of threads (and
+ * processes) can search it without synchronizing. */
+static const hmap_file_entry_t *hmap_mapped_find(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash) {
+  const hmap_mapped_t *mapped = hmap->mapped;
+  uint64_t offset = mapped->buckets[hmap_reduce((uint32_t)hash, hmap->table_size, hmap->reduce_m)];
+
+  while (offset) {
+    const hmap_file_entry_t *record = hmap_mapped_record(mapped, offset);
+    if (!record) {
+      return NULL;
+    }
+    HMAP_COUNT(hmap, probes, 1);
+    if (record->hash == hash) {
+      const void *record_key = record + 1;
+      if (hmap->equal_fn ? hmap->equal_fn(record_key, record->key_size, key, key_size) :
+          (record->key_size == key_size && memcmp(record_key, key, key_size) == 0)) {
+        return record;
+      }
+    }
+    /* hmap_save() links each record to an earlier one, so a damaged file
+     * can't send a search round in circles. */
+    offset = (record->next < offset) ? record->next : 0;
+  }
+  return NULL;
+}  /* hmap_mapped_find */
+
+
+/* Records are visited in file order through one scratch entry in the map,
+ * so a mapped map can only be iterated by one thread, one iteration at a
+ * time. A damaged record ends the iteration. */
+static void hmap_mapped_next(hmap_t *hmap, hmap_entry_t **in_entry) {
+  hmap_mapped_t *mapped = hmap->mapped;
+  size_t offset = (*in_entry == NULL) ? sizeof(hmap_file_header_t) : mapped->next_record;
+  const hmap_file_entry_t *record = hmap_mapped_record(mapped, offset);
+
+  if (!record) {
+    *in_entry = NULL;
+    return;
+  }
+  size_t value_bytes = (mapped->value_size > 0 && record->value) ? mapped->value_size : 0;
+  mapped->entry.key = (void *)(record + 1);
+  mapped->entry.key_size = record->key_size;
+  mapped->entry.value = hmap_mapped_value(mapped, record);
+  mapped->entry.hash = record->hash;
+  mapped->entry.bucket = (uint32_t)hmap_reduce((uint32_t)record->hash, hmap->table_size, hmap->reduce_m);
+  mapped->next_record = offset + hmap_file_record_size(record->key_size, value_bytes);
+  *in_entry = &mapped->entry;
+}  /* hmap_mapped_next */
+
+
+/* Returns 1 with the value, or 0 with NULL. In concurrent mode the value
+ * is read inside a read section, since the entry may be freed after. */
+static int hmap_lookup_value(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash, void **rtn_val) {
+  int found;
+  void *val = NULL;
+
+  if (hmap->segments) {
+    hmap = HMAP_SEGMENT(hmap, hash);
+  }
+  if (hmap->mapped) {
+    const hmap_file_entry_t *record = hmap_mapped_find(hmap, key, key_size, hash);
+    found = (record != NULL);
+    if (record) {
+      val = hmap_mapped_value(hmap->mapped, record);
+    }
+  } else if (hmap->conc) {
+    uint32_t token = hmap_read_begin(hmap);
+    hmap_entry_t *entry = hmap_conc_find(hmap, key, key_size, hash);
+    found = (entry != NULL);
+    if (entry) {
+      val = __atomic_load_n(&entry->value, __ATOMIC_ACQUIRE);
+    }
+    hmap_read_end(hmap, token);
+  } else {
+    hmap_entry_t *entry = hmap_lookup_entry(hmap, key, key_size, hash);
+    found = (entry != NULL);
+    if (entry) {
+      val = entry->value;
+    }
+  }
+
+  HMAP_COUNT(hmap, lookups, 1);
+  HMAP_COUNT(hmap, hits, found);
+  HMAP_COUNT(hmap, misses, !found);
+
+  if (rtn_val) {
+    *rtn_val = val;
+  }
+  return found;
+}  /* hmap_lookup_value */
+
+
+ERR_F hmap_lookup(hmap_t *hmap, const void *key, size_t key_size, void **rtn_val) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(key, HMAP_ERR_PARAM);
+
+  if (hmap_lookup_value(hmap, key, key_size, hmap_hash(hmap, key, key_size), rtn_val)) {
+    return ERR_OK;
+  }
+  ERR_THROW(HMAP_ERR_NOTFOUND, "key not found");
+}  /* hmap_lookup */
+
+
+/* Never allocates, so a miss is as cheap as a hit. */
+int hmap_try_lookup(hmap_t *hmap, const void *key, size_t key_size, void **rtn_val) {
+  return hmap_lookup_value(hmap, key, key_size, hmap_hash(hmap, key, key_size), rtn_val);
+}  /* hmap_try_lookup */
+
+
+ERR_F hmap_swrite(hmap_t *hmap, const char *skey, void *val) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(skey, HMAP_ERR_PARAM);
+  ERR(hmap_write(hmap, skey, strlen(skey)+1, val));
+
+  return ERR_OK;
+}  /* hmap_swrite */
+
+
+ERR_F hmap_slookup(hmap_t *hmap, const char *skey, void **rtn_val) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(skey, HMAP_ERR_PARAM);
+  ERR(hmap_lookup(hmap, (void *)skey, strlen(skey)+1, rtn_val));
 
-  hmap_t *hmap = calloc(1, sizeof(hmap_t));
-  ERR_ASSRT(hmap, HMAP_ERR_NOMEM);
+  return ERR_OK;
+}  /* hmap_slookup */
 
-  (hmap)->table_size = table_size;
-  (hmap)->seed = 42;  /* Could be made an input parameter. */
-  (hmap)->num_entries = 0;
-  (hmap)->table = calloc(table_size, sizeof(hmap_entry_t*));
-  if (!(hmap)->table) {
-    free(hmap);
-    ERR_THROW(HMAP_ERR_NOMEM, "hmap->table");
-  }
 
-  *rtn_hmap = hmap;
-  return ERR_OK;
-}  /* hmap_create */
+int hmap_try_slookup(hmap_t *hmap, const char *skey, void **rtn_val) {
+  return hmap_try_lookup(hmap, skey, strlen(skey)+1, rtn_val);
+}  /* hmap_try_slookup */
 
 
-ERR_F hmap_delete(hmap_t *hmap) {
-  uint32_t bucket;
+/* One hash and one search for read-modify-write. Concurrent maps are not
+ * supported: readers could see the value mid-update, and growth copies
+ * entries, which would strand the returned pointer. */
+ERR_F hmap_get_or_insert(hmap_t *hmap, const void *key, size_t key_size, void ***rtn_val_ptr, int *rtn_inserted) {
+  int inserted = 0;
 
-  /* Step to each bucket and delete the list of entries. */
-  for (bucket = 0; bucket < hmap->table_size; bucket++) {
-    hmap_entry_t *entry = hmap->table[bucket];
-    while (entry) {
-      hmap_entry_t *next = entry->next;
-      /* The application is responsible for freeing the value. */
-      free(entry->key);
-      free(entry);
-      entry = next;
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(key, HMAP_ERR_PARAM);
+  ERR_ASSRT(rtn_val_ptr, HMAP_ERR_PARAM);
+  ERR_ASSRT(hmap->conc == NULL && hmap->segments == NULL && hmap->mapped == NULL, HMAP_ERR_PARAM);
+
+  uint64_t hash = hmap_hash(hmap, key, key_size);
+  hmap_entry_t *entry = hmap_lookup_entry(hmap, key, key_size, hash);
+  if (!entry) {
+    if (hmap->layout == HMAP_LAYOUT_CHAINED) {
+      ERR(hmap_chain_insert(hmap, key, key_size, NULL, hash, &entry));
+    } else {
+      ERR(hmap_open_insert(hmap, key, key_size, NULL, hash, &entry));
     }
+    inserted = 1;
   }
 
-  free(hmap);
+  *rtn_val_ptr = &entry->value;
+  if (rtn_inserted) {
+    *rtn_inserted = inserted;
+  }
   return ERR_OK;
-}  /* hmap_delete */
+}  /* hmap_get_or_insert */
 
 
-ERR_F hmap_write(hmap_t *hmap, const void *key, size_t key_size, void *val) {
+ERR_F hmap_sget_or_insert(hmap_t *hmap, const char *skey, void ***rtn_val_ptr, int *rtn_inserted) {
   ERR_ASSRT(hmap, HMAP_ERR_PARAM);
-  ERR_ASSRT(key, HMAP_ERR_PARAM);
+  ERR_ASSRT(skey, HMAP_ERR_PARAM);
+  ERR(hmap_get_or_insert(hmap, skey, strlen(skey)+1, rtn_val_ptr, rtn_inserted));
 
-  uint32_t bucket = hmap_murmur3_32(key, key_size, hmap->seed) % hmap->table_size;
+  return ERR_OK;
+}  /* hmap_sget_or_insert */
 
-  /* Search linked list.  */
-  hmap_entry_t *entry = hmap->table[bucket];
-  while (entry) {
-    if (key_size == entry->key_size && memcmp(entry->key, key, key_size) == 0) {
-      entry->value = val;
-      return ERR_OK;
+
+/* Unlink a key's entry from a chain. The unlinking store is atomic, so
+ * concurrent readers see the chain either with or without the entry. */
+static hmap_entry_t *hmap_chain_unlink(hmap_t *hmap, hmap_entry_t **link, const void *key, size_t key_size,
+    uint64_t hash) {
+  hmap_entry_t *entry;
+  while ((entry = *link) != NULL) {
+    if (hash == entry->hash && hmap_key_equal(hmap, entry, key, key_size)) {
+      __atomic_store_n(link, entry->next, __ATOMIC_RELEASE);
+      return entry;
     }
-    entry = entry->next;
+    link = &entry->next;
   }
+  return NULL;
+}  /* hmap_chain_unlink */
 
-  /* Not found, create new entry. */
-  hmap_entry_t *new_entry = calloc(1, sizeof(hmap_entry_t));
-  ERR_ASSRT(new_entry, HMAP_ERR_NOMEM);
 
-  new_entry->key = malloc(key_size);
-  if (!new_entry->key) {
-    free(new_entry);
-    ERR_THROW(HMAP_ERR_NOMEM, "new_entry->key");
+/* Remove from the current table or (if resizing) the old table. */
+static hmap_entry_t *hmap_chain_remove(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash) {
+  size_t bucket = hmap_reduce(hash, hmap->table_size, hmap->reduce_m);
+  hmap_entry_t *entry = hmap_chain_unlink(hmap, &hmap->table[bucket], key, key_size, hash);
+
+  if (!entry && hmap->old_table) {
+    size_t old_bucket = hmap_reduce(hash, hmap->old_table_size, hmap->old_reduce_m);
+    if (old_bucket >= hmap->migrate_bucket) {  /* Not migrated yet. */
+      entry = hmap_chain_unlink(hmap, &hmap->old_table[old_bucket], key, key_size, hash);
+    }
   }
-  memcpy(new_entry->key, key, key_size);
-  new_entry->key_size = key_size;
-  new_entry->value = val;
-  new_entry->bucket = bucket;
+  if (entry) {
+    hmap->num_entries--;
+  }
+  return entry;
+}  /* hmap_chain_remove */
 
-  /* Insert at head of list for this bucket */
-  new_entry->next = hmap->table[bucket];
-  hmap->table[bucket] = new_entry;
-  hmap->num_entries ++;
 
-  return ERR_OK;
-}  /* hmap_write */
+/* Robin Hood backward-shift deletion: following entries move back a slot
+ * until one is already in its home slot (or the slot is empty). */
+static void hmap_rh_remove_slot(hmap_t *hmap, size_t slot) {
+  size_t next = (slot + 1 == hmap->table_size) ? 0 : slot + 1;
+  while (hmap->hashes[next] != 0 &&
+      hmap_rh_dist(hmap->table_size, hmap->reduce_m, next, hmap->hashes[next]) > 0) {
+    hmap_slot_put(hmap, hmap->slots, slot, HMAP_SLOT(hmap, next));
+    hmap->hashes[slot] = hmap->hashes[next];
+    slot = next;
+    next = (slot + 1 == hmap->table_size) ? 0 : slot + 1;
+  }
+  hmap->hashes[slot] = 0;
+}  /* hmap_rh_remove_slot */
 
 
-ERR_F hmap_lookup(hmap_t *hmap, const void *key, size_t key_size, void **rtn_val) {
-  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
-  ERR_ASSRT(key, HMAP_ERR_PARAM);
+/* Group deletion (linear probing's backward shift, Knuth's Algorithm R):
+ * scan the run after the hole, moving back each entry whose home slot is
+ * not between the hole and where it is now. Every key stays before the
+ * first empty slot after its home, so lookups need no tombstones. */
+static void hmap_group_remove_slot(hmap_t *hmap, size_t hole) {
+  size_t table_size = hmap->table_size;
+  size_t slot = hole;
+
+  for (;;) {
+    slot = (slot + 1 == table_size) ? 0 : slot + 1;
+    if (!hmap_slot_used(hmap, slot)) {
+      break;
+    }
+    hmap_entry_t *entry = HMAP_SLOT(hmap, slot);
+    size_t home = hmap_reduce(entry->hash, table_size, hmap->reduce_m);
+    int movable = (hole <= slot) ? (home <= hole || home > slot) : (home <= hole && home > slot);
+    if (movable) {
+      hmap_slot_put(hmap, hmap->slots, hole, entry);
+      hmap_group_set_ctrl(hmap->ctrl, table_size, hole, hmap->ctrl[slot]);
+      hole = slot;
+    }
+  }
+  hmap_group_set_ctrl(hmap->ctrl, table_size, hole, HMAP_CTRL_EMPTY);
+}  /* hmap_group_remove_slot */
 
-  uint32_t bucket = hmap_murmur3_32(key, key_size, hmap->seed) % hmap->table_size;
 
-  /* Search linked list */
-  hmap_entry_t *entry = hmap->table[bucket];
-  while (entry) {
-    if (key_size == entry->key_size && memcmp(entry->key, key, key_size) == 0) {
-      if (rtn_val) {
-        *rtn_val = entry->value;
+/* Returns 1 with the removed value, or 0 with NULL. In concurrent mode the
+ * entry is freed once no reader can still be looking at it. */
+static int hmap_remove_hash(hmap_t *hmap, const void *key, size_t key_size, uint64_t hash, void **rtn_val) {
+  void *val = NULL;
+  int found = 0;
+  hmap_t *parent = NULL;
+
+  if (hmap->segments) {
+    parent = hmap;
+    hmap = HMAP_SEGMENT(hmap, hash);
+  }
+  if (hmap->layout != HMAP_LAYOUT_CHAINED) {
+    hmap_entry_t *entry = (hmap->layout == HMAP_LAYOUT_GROUP) ?
+        hmap_group_find(hmap, key, key_size, hash) : hmap_rh_find(hmap, key, key_size, hash);
+    if (entry) {
+      val = entry->value;
+      found = 1;
+      if (entry->key_size > hmap->inline_key_max) {
+        hmap_mem_free(hmap, entry->key, entry->key_size);
+        hmap->mem_key_bytes -= entry->key_size;
       }
-      return ERR_OK;
+      if (hmap->layout == HMAP_LAYOUT_GROUP) {
+        hmap_group_remove_slot(hmap, entry->bucket);
+      } else {
+        hmap_rh_remove_slot(hmap, entry->bucket);
+      }
+      hmap->num_entries--;
+    }
+  } else if (hmap->conc) {
+    if (pthread_mutex_trylock(&hmap->conc->write_lock) != 0) {
+      pthread_mutex_lock(&hmap->conc->write_lock);
+      __atomic_fetch_add(&hmap->conc->contended, 1, __ATOMIC_RELAXED);
+    }
+    hmap_entry_t *entry = hmap_chain_remove(hmap, key, key_size, hash);
+    pthread_mutex_unlock(&hmap->conc->write_lock);
+    if (entry) {
+      val = entry->value;
+      found = 1;
+      /* The entry is unlinked, so other writers can carry on while this
+       * waits for readers; only the free needs the lock again. */
+      hmap_conc_synchronize(hmap->conc);
+      pthread_mutex_lock(&hmap->conc->write_lock);
+      hmap_free_entry(hmap, entry);
+      pthread_mutex_unlock(&hmap->conc->write_lock);
+    }
+  } else {
+    hmap_entry_t *entry = hmap_chain_remove(hmap, key, key_size, hash);
+    if (entry) {
+      val = entry->value;
+      found = 1;
+      hmap_free_entry(hmap, entry);
     }
-    entry = entry->next;
   }
 
+  if (parent && found) {
+    __atomic_fetch_sub(&parent->num_entries, 1, __ATOMIC_RELAXED);
+  }
   if (rtn_val) {
-    *rtn_val = NULL;
+    *rtn_val = val;
+  }
+  return found;
+}  /* hmap_remove_hash */
+
+
+ERR_F hmap_remove(hmap_t *hmap, const void *key, size_t key_size, void **rtn_val) {
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(key, HMAP_ERR_PARAM);
+  ERR_ASSRT(hmap->mapped == NULL, HMAP_ERR_PARAM);
+  /* A concurrent remove waits for readers, including the caller's own. */
+  ERR_ASSRT(hmap->conc == NULL || hmap_read_depth == 0, HMAP_ERR_PARAM);
+
+  if (hmap_remove_hash(hmap, key, key_size, hmap_hash(hmap, key, key_size), rtn_val)) {
+    return ERR_OK;
   }
   ERR_THROW(HMAP_ERR_NOTFOUND, "key not found");
-}  /* hmap_lookup */
+}  /* hmap_remove */
 
 
-ERR_F hmap_swrite(hmap_t *hmap, const char *skey, void *val) {
+ERR_F hmap_sremove(hmap_t *hmap, const char *skey, void **rtn_val) {
   ERR_ASSRT(hmap, HMAP_ERR_PARAM);
   ERR_ASSRT(skey, HMAP_ERR_PARAM);
-  ERR(hmap_write(hmap, skey, strlen(skey)+1, val));
+  ERR(hmap_remove(hmap, skey, strlen(skey)+1, rtn_val));
 
   return ERR_OK;
-}  /* hmap_swrite */
+}  /* hmap_sremove */
 
 
-ERR_F hmap_slookup(hmap_t *hmap, const char *skey, void **rtn_val) {
+/* Keys are looked up HMAP_BATCH_CHUNK at a time: enough to cover a few
+ * memory latencies, few enough that the prefetched lines are still in
+ * cache when they're used. */
+#define HMAP_BATCH_CHUNK 32
+
+#if defined(__GNUC__)
+#  define HMAP_PREFETCH(prefetch__addr) __builtin_prefetch(prefetch__addr)
+#else
+#  define HMAP_PREFETCH(prefetch__addr) ((void)(prefetch__addr))
+#endif
+
+
+/* Hash a chunk of keys and prefetch where their searches will start, then
+ * (for chains) prefetch the first entries, then do the lookups. Each stage
+ * issues all of its memory reads before waiting on any of them. */
+ERR_F hmap_lookup_batch(hmap_t *hmap, const void *const *keys, const size_t *key_sizes,
+    size_t num_keys, void **rtn_vals, size_t *rtn_num_found) {
+  uint64_t hashes[HMAP_BATCH_CHUNK];
+  size_t starts[HMAP_BATCH_CHUNK];
+  size_t num_found = 0;
+  size_t chunk, i;
+
   ERR_ASSRT(hmap, HMAP_ERR_PARAM);
-  ERR_ASSRT(skey, HMAP_ERR_PARAM);
-  ERR(hmap_lookup(hmap, (void *)skey, strlen(skey)+1, rtn_val));
+  ERR_ASSRT(num_keys == 0 || (keys && key_sizes && rtn_vals), HMAP_ERR_PARAM);
+
+  /* Concurrent and segmented maps are looked up the usual way (after all
+   * the hashing), since their tables can change under a prefetch, as are
+   * mapped maps, which have no "table". */
+  int prefetch = (hmap->conc == NULL && hmap->segments == NULL && hmap->mapped == NULL);
+
+  for (chunk = 0; chunk < num_keys; chunk += HMAP_BATCH_CHUNK) {
+    size_t chunk_len = (num_keys - chunk < HMAP_BATCH_CHUNK) ? num_keys - chunk : HMAP_BATCH_CHUNK;
 
+    for (i = 0; i < chunk_len; i++) {
+      hashes[i] = hmap_hash(hmap, keys[chunk + i], key_sizes[chunk + i]);
+      if (!prefetch) {
+        continue;
+      }
+      if (hmap->layout == HMAP_LAYOUT_CHAINED) {
+        starts[i] = hmap_reduce(hashes[i], hmap->table_size, hmap->reduce_m);
+        HMAP_PREFETCH(&hmap->table[starts[i]]);
+      } else if (hmap->layout == HMAP_LAYOUT_ROBINHOOD) {
+        starts[i] = hmap_reduce(HMAP_RH_HASH(hashes[i]), hmap->table_size, hmap->reduce_m);
+        HMAP_PREFETCH(&hmap->hashes[starts[i]]);
+        HMAP_PREFETCH(HMAP_SLOT(hmap, starts[i]));
+      } else {
+        starts[i] = hmap_reduce(hashes[i], hmap->table_size, hmap->reduce_m);
+        HMAP_PREFETCH(&hmap->ctrl[starts[i]]);
+        HMAP_PREFETCH(HMAP_SLOT(hmap, starts[i]));
+      }
+    }
+
+    if (prefetch && hmap->layout == HMAP_LAYOUT_CHAINED) {
+      for (i = 0; i < chunk_len; i++) {
+        hmap_entry_t *entry = hmap->table[starts[i]];
+        if (entry) {
+          HMAP_PREFETCH(entry);
+        }
+      }
+    }
+
+    for (i = 0; i < chunk_len; i++) {
+      num_found += hmap_lookup_value(hmap, keys[chunk + i], key_sizes[chunk + i], hashes[i],
+          &rtn_vals[chunk + i]);
+    }
+  }
+
+  if (rtn_num_found) {
+    *rtn_num_found = num_found;
+  }
   return ERR_OK;
-}  /* hmap_slookup */
+}  /* hmap_lookup_batch */
 
 
 ERR_F hmap_next(hmap_t *hmap, hmap_entry_t **in_entry) {
-  uint32_t bucket;
+  hmap_entry_t **table;
+  size_t table_size;
+  size_t bucket;
   hmap_entry_t *next_entry;
 
   ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(in_entry, HMAP_ERR_PARAM);
+
+  if (hmap->segments) {
+    /* Each segment in turn. */
+    hmap_t *segment = (*in_entry == NULL) ? hmap->segments[0] : HMAP_SEGMENT(hmap, (*in_entry)->hash);
+    ERR(hmap_next(segment, in_entry));
+    while (*in_entry == NULL && segment != hmap->segments[hmap->num_segments - 1]) {
+      segment = hmap->segments[segment->segment_num + 1];
+      ERR(hmap_next(segment, in_entry));
+    }
+    return ERR_OK;
+  }
+
+  if (hmap->mapped) {
+    hmap_mapped_next(hmap, in_entry);
+    return ERR_OK;
+  }
+
+  if (hmap->layout != HMAP_LAYOUT_CHAINED) {
+    /* Scan forward to the next occupied slot. */
+    size_t slot = (*in_entry == NULL) ? 0 : (*in_entry)->bucket + 1;
+    while (slot < hmap->table_size && !hmap_slot_used(hmap, slot)) {
+      slot++;
+    }
+    *in_entry = (slot < hmap->table_size) ? HMAP_SLOT(hmap, slot) : NULL;
+    return ERR_OK;
+  }
 
+  if (hmap->conc) {
+    hmap_conc_next(hmap, in_entry);
+    return ERR_OK;
+  }
+
+  /* During a resize, iterate the not-yet-migrated part of the old table
+   * first, then the new table. */
   if (*in_entry == NULL) {
     /* If in_entry is NULL, user want's first entry in table. */
-    bucket = 0;
-    next_entry = hmap->table[bucket];
+    hmap->iterating = 1;  /* Don't let lookups move entries around. */
+    if (hmap->old_table) {
+      table = hmap->old_table;
+      table_size = hmap->old_table_size;
+      bucket = hmap->migrate_bucket;
+    } else {
+      table = hmap->table;
+      table_size = hmap->table_size;
+      bucket = 0;
+    }
+    next_entry = table[bucket];
   } else {
     /* Next entry in list. */
-    bucket = (*in_entry)->bucket;
+    if (hmap->old_table && ((*in_entry)->bucket & HMAP_BUCKET_GEN) != hmap->table_gen) {
+      table = hmap->old_table;
+      table_size = hmap->old_table_size;
+    } else {
+      table = hmap->table;
+      table_size = hmap->table_size;
+    }
+    bucket = (*in_entry)->bucket & HMAP_BUCKET_MASK;
     next_entry = (*in_entry)->next;
   }
 
   /* next_entry == NULL means we hit the end of a list;
    * check subsequent buckets till we find a non-empty one. */
-  while (next_entry == NULL && bucket < hmap->table_size) {
+  while (next_entry == NULL) {
     bucket++;
-    if (bucket < hmap->table_size) {
-      next_entry = hmap->table[bucket];
+    if (bucket >= table_size) {
+      if (table == hmap->table) {
+        break;  /* End of the (new) table. */
+      }
+      /* End of the old table, continue with the new one. */
+      table = hmap->table;
+      table_size = hmap->table_size;
+      bucket = 0;
     }
+    next_entry = table[bucket];
   }
 
+  if (next_entry == NULL) {
+    hmap->iterating = 0;
+  }
   *in_entry = next_entry;  /* If no more entries, it's NULL. */
   return ERR_OK;
 }  /* hmap_next */
+
+
+/* Fill in the records and bucket table of a snapshot that hmap_save() has
+ * sized from a first pass over the map. Each entry's cached hash is what
+ * a lookup computes for its key, so it is saved as is. */
+static ERR_F hmap_save_records(hmap_t *hmap, char *base, const hmap_file_header_t *header) {
+  uint64_t *buckets = (uint64_t *)(base + header->table_offset);
+  uint64_t reduce_m = hmap_reduce_init(header->table_size);
+  uint64_t offset = header->header_size;
+  uint64_t num_entries = 0;
+  hmap_entry_t *entry = NULL;
+
+  for (;;) {
+    ERR(hmap_next(hmap, &entry));
+    if (!entry) {
+      break;
+    }
+    size_t value_bytes = (header->value_size > 0 && entry->value) ? header->value_size : 0;
+    uint64_t record_size = hmap_file_record_size(entry->key_size, value_bytes);
+    /* A write since the first pass would make the map bigger. */
+    ERR_ASSRT(offset + record_size <= header->table_offset, HMAP_ERR_PARAM);
+
+    hmap_file_entry_t *record = (hmap_file_entry_t *)(base + offset);
+    uint64_t hash = entry->hash;
+    size_t bucket = hmap_reduce((uint32_t)hash, header->table_size, reduce_m);
+    record->next = buckets[bucket];
+    record->hash = hash;
+    record->key_size = entry->key_size;
+    memcpy(record + 1, entry->key, entry->key_size);
+    if (header->value_size == 0) {
+      record->value = (uint64_t)(uintptr_t)entry->value;
+    } else if (value_bytes > 0) {
+      record->value = offset + sizeof(hmap_file_entry_t) + HMAP_FILE_ALIGN(entry->key_size);
+      memcpy(base + record->value, entry->value, value_bytes);
+    }
+    buckets[bucket] = offset;
+    offset += record_size;
+    num_entries++;
+  }
+  ERR_ASSRT(offset == header->table_offset && num_entries == header->num_entries, HMAP_ERR_PARAM);
+
+  return ERR_OK;
+}  /* hmap_save_records */
+
+
+/* The map is written to "filename.tmp", which is renamed over "filename"
+ * once it is complete and synced, so readers never map a partial file.
+ * With a value_size of 0 the value pointers themselves are saved, which
+ * only makes sense for values that are really integers; otherwise each
+ * non-NULL value is taken to point at value_size bytes, which are saved.
+ * The map must not be written during the save. */
+ERR_F hmap_save(hmap_t *hmap, const char *filename, size_t value_size) {
+  hmap_file_header_t header;
+  hmap_entry_t *entry = NULL;
+  uint64_t records_size = 0;
+  uint64_t num_entries = 0;
+
+  ERR_ASSRT(hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(filename, HMAP_ERR_PARAM);
+
+  /* First pass: how big the file will be. */
+  for (;;) {
+    ERR(hmap_next(hmap, &entry));
+    if (!entry) {
+      break;
+    }
+    records_size += hmap_file_record_size(entry->key_size, (value_size > 0 && entry->value) ? value_size : 0);
+    num_entries++;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HMAP_FILE_MAGIC, sizeof(header.magic));
+  header.version = HMAP_FILE_VERSION;
+  header.header_size = sizeof(hmap_file_header_t);
+  header.num_entries = num_entries;
+  header.table_size = (num_entries > 0) ? num_entries : 1;  /* Load factor 1. */
+  header.table_offset = header.header_size + records_size;
+  header.file_size = header.table_offset + header.table_size * sizeof(uint64_t);
+  header.value_size = value_size;
+  header.hash_bits = (uint32_t)hmap->hash_bits;
+  header.seed = hmap->seed;
+  header.flags = hmap->hash_fn ? HMAP_FILE_CUSTOM_HASH : 0;
+  header.byte_order = HMAP_FILE_BYTE_ORDER;
+  ERR_ASSRT(header.file_size <= SIZE_MAX, HMAP_ERR_PARAM);
+
+  size_t name_len = strlen(filename);
+  char *tmp_name = malloc(name_len + sizeof(".tmp"));
+  ERR_ASSRT(tmp_name, HMAP_ERR_NOMEM);
+  memcpy(tmp_name, filename, name_len);
+  memcpy(tmp_name + name_len, ".tmp", sizeof(".tmp"));
+
+  /* Each step runs only if everything before it worked. */
+  const char *failed = NULL;
+  int fail_errno = 0;
+  err_t *err = ERR_OK;
+  int fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    failed = "open";
+    fail_errno = errno;
+  }
+  if (!failed && ftruncate(fd, (off_t)header.file_size) != 0) {  /* Zero filled: empty buckets. */
+    failed = "ftruncate";
+    fail_errno = errno;
+  }
+  if (!failed) {
+    char *base = mmap(NULL, (size_t)header.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      failed = "mmap";
+      fail_errno = errno;
+    } else {
+      err = hmap_save_records(hmap, base, &header);
+      if (!err) {
+        header.body_checksum = hmap_file_checksum(base + header.header_size,
+            (size_t)(header.file_size - header.header_size));
+        header.header_checksum = hmap_file_checksum(&header, offsetof(hmap_file_header_t, header_checksum));
+        memcpy(base, &header, sizeof(header));
+      }
+      munmap(base, (size_t)header.file_size);
+    }
+  }
+  if (!failed && !err && fsync(fd) != 0) {
+    failed = "fsync";
+    fail_errno = errno;
+  }
+  if (fd >= 0 && close(fd) != 0 && !failed && !err) {
+    failed = "close";
+    fail_errno = errno;
+  }
+  if (!failed && !err && rename(tmp_name, filename) != 0) {
+    failed = "rename";
+    fail_errno = errno;
+  }
+
+  if (failed || err) {
+    unlink(tmp_name);
+    free(tmp_name);
+    if (err) {
+      ERR_RETHROW(err, "hmap_save_records");
+    }
+    ERR_THROW(HMAP_ERR_IO, "%s %s: %s", failed, filename, strerror(fail_errno));
+  }
+  free(tmp_name);
+
+  return ERR_OK;
+}  /* hmap_save */
+
+
+/* Returns what is wrong with a mapped snapshot, or NULL. Everything but
+ * the body checksum is checked in constant time. */
+static const char *hmap_file_problem(const char *base, size_t size, int flags) {
+  const hmap_file_header_t *header = (const hmap_file_header_t *)base;
+
+  if (size < sizeof(hmap_file_header_t) || memcmp(header->magic, HMAP_FILE_MAGIC, sizeof(header->magic)) != 0) {
+    return "not an hmap snapshot";
+  }
+  if (header->byte_order != HMAP_FILE_BYTE_ORDER) {
+    return "saved with a different byte order";
+  }
+  if (header->version != HMAP_FILE_VERSION || header->header_size != sizeof(hmap_file_header_t)) {
+    return "unsupported version";
+  }
+  if (header->header_checksum != hmap_file_checksum(header, offsetof(hmap_file_header_t, header_checksum))) {
+    return "header checksum mismatch";
+  }
+  if (header->file_size != size) {
+    return "file size does not match header";
+  }
+  if ((header->hash_bits != 32 && header->hash_bits != 64) ||
+      header->table_size == 0 || header->table_size > HMAP_MAX_TABLE_SIZE ||
+      header->num_entries > INT32_MAX ||
+      header->table_offset % 8 != 0 || header->table_offset < header->header_size ||
+      header->table_offset > header->file_size ||
+      header->file_size - header->table_offset != header->table_size * sizeof(uint64_t) ||
+      header->value_size > header->table_offset - header->header_size) {
+    /* A bigger value_size couldn't fit, and could overflow when aligned. */
+    return "inconsistent header";
+  }
+  if ((flags & HMAP_MMAP_VERIFY) && header->body_checksum !=
+      hmap_file_checksum(base + header->header_size, size - header->header_size)) {
+    return "body checksum mismatch";
+  }
+  return NULL;
+}  /* hmap_file_problem */
+
+
+/* Opening reads only the header (unless HMAP_MMAP_VERIFY), so it takes
+ * constant time. Lookups and hmap_next() read the buckets and records in
+ * place as they need them, checking each offset (see hmap_mapped_record()),
+ * and processes mapping the same file share one copy in the page cache. The
+ * map is read-only. "options" (may be NULL) only supplies hash_fn and
+ * equal_fn, which must be given if the saved map had a hash_fn. */
+ERR_F hmap_open_mmap(hmap_t **rtn_hmap, const char *filename, const hmap_options_t *options, int flags) {
+  struct stat st;
+
+  ERR_ASSRT(rtn_hmap, HMAP_ERR_PARAM);
+  ERR_ASSRT(filename, HMAP_ERR_PARAM);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    int open_errno = errno;
+    ERR_THROW(HMAP_ERR_IO, "open %s: %s", filename, strerror(open_errno));
+  }
+  if (fstat(fd, &st) != 0) {
+    int stat_errno = errno;
+    close(fd);
+    ERR_THROW(HMAP_ERR_IO, "fstat %s: %s", filename, strerror(stat_errno));
+  }
+  if ((uint64_t)st.st_size < sizeof(hmap_file_header_t)) {
+    close(fd);
+    ERR_THROW(HMAP_ERR_FORMAT, "%s: not an hmap snapshot", filename);
+  }
+  size_t size = (size_t)st.st_size;
+  char *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  int map_errno = errno;
+  close(fd);  /* The mapping keeps its own reference to the file. */
+  if (base == MAP_FAILED) {
+    ERR_THROW(HMAP_ERR_IO, "mmap %s: %s", filename, strerror(map_errno));
+  }
+
+  const char *problem = hmap_file_problem(base, size, flags);
+  if (problem) {
+    munmap(base, size);
+    ERR_THROW(HMAP_ERR_FORMAT, "%s: %s", filename, problem);
+  }
+  const hmap_file_header_t *header = (const hmap_file_header_t *)base;
+  hmap_hash_fn_t hash_fn = options ? options->hash_fn : NULL;
+  if ((hash_fn != NULL) != ((header->flags & HMAP_FILE_CUSTOM_HASH) != 0)) {
+    munmap(base, size);
+    ERR_THROW(HMAP_ERR_PARAM, "%s: hash_fn must be given if and only if the saved map had one", filename);
+  }
+
+  hmap_t *hmap = calloc(1, sizeof(hmap_t));
+  hmap_mapped_t *mapped = calloc(1, sizeof(hmap_mapped_t));
+  if (!hmap || !mapped) {
+    free(hmap);
+    free(mapped);
+    munmap(base, size);
+    ERR_THROW(HMAP_ERR_NOMEM, "hmap");
+  }
+  mapped->base = base;
+  mapped->size = size;
+  mapped->buckets = (const uint64_t *)(base + header->table_offset);
+  mapped->records_end = (size_t)header->table_offset;
+  mapped->value_size = (size_t)header->value_size;
+
+  hmap->mapped = mapped;
+  hmap->layout = HMAP_LAYOUT_CHAINED;
+  hmap->table_size = (size_t)header->table_size;
+  hmap->reduce_m = hmap_reduce_init(hmap->table_size);
+  hmap->num_entries = (int)header->num_entries;
+  hmap->seed = header->seed;
+  hmap->hash_bits = (int)header->hash_bits;
+  hmap->hash_fn = hash_fn;
+  hmap->equal_fn = options ? options->equal_fn : NULL;
+
+  *rtn_hmap = hmap;
+  return ERR_OK;
+}  /* hmap_open_mmap */
+
+
+/* Sharded maps. Each queue is a ring written only by the "from" shard's
+ * thread and read only by the "to" shard's thread, so the two threads
+ * share nothing but the ring's indexes, which each keeps on its own cache
+ * line along with a cached copy of the other's. */
+
+typedef struct hmap_shard_msg_s hmap_shard_msg_t;
+struct hmap_shard_msg_s {
+  uint64_t hash;  /* So the owner needn't rehash. */
+  void *val;
+  char *key_copy;  /* Key longer than HMAP_SHARD_KEY_INLINE (the owner frees it). */
+  uint32_t key_size;
+  char key[HMAP_SHARD_KEY_INLINE];
+};
+
+struct hmap_shard_queue_s {
+  hmap_shard_msg_t *msgs;
+  char pad0[HMAP_CACHE_LINE - sizeof(hmap_shard_msg_t *)];
+  /* Consumer's. */
+  size_t head;  /* Next message to take. */
+  size_t tail_cache;
+  char pad1[HMAP_CACHE_LINE - 2 * sizeof(size_t)];
+  /* Producer's. */
+  size_t tail;  /* Messages before this are visible to the consumer. */
+  size_t next;  /* Next message to fill (> tail while a batch is pending). */
+  size_t head_cache;
+  char pad2[HMAP_CACHE_LINE - 3 * sizeof(size_t)];
+};
+
+#define HMAP_SHARD_OF(shard__sharded, shard__hash) \
+  ((int)(((uint64_t)(uint32_t)(shard__hash) * (uint64_t)(shard__sharded)->num_shards) >> 32))
+
+
+/* Shards are ordinary maps touched only by their own threads, so nothing
+ * is locked. With options->concurrent (shared reads), they are concurrent
+ * maps instead, so any thread can look up any key while the owners write;
+ * that costs the owners a lock per write and growth by copying. */
+ERR_F hmap_sharded_create(hmap_sharded_t **rtn_sharded, int num_shards, size_t table_size,
+    size_t queue_size, const hmap_options_t *options) {
+  hmap_options_t shard_options;
+
+  ERR_ASSRT(rtn_sharded, HMAP_ERR_PARAM);
+  ERR_ASSRT(num_shards > 0 && num_shards <= HMAP_MAX_SEGMENTS, HMAP_ERR_PARAM);
+  ERR_ASSRT(table_size > 0, HMAP_ERR_PARAM);
+  ERR_ASSRT(queue_size > 0 && queue_size <= HMAP_MAX_TABLE_SIZE, HMAP_ERR_PARAM);
+  if (options) {
+    shard_options = *options;
+  } else {
+    hmap_options_init(&shard_options);
+  }
+  ERR_ASSRT(shard_options.segments <= 1, HMAP_ERR_PARAM);
+
+  hmap_sharded_t *sharded = calloc(1, sizeof(hmap_sharded_t));
+  ERR_ASSRT(sharded, HMAP_ERR_NOMEM);
+  sharded->shared_reads = (shard_options.concurrent != 0);
+  sharded->queue_size = 2;
+  while (sharded->queue_size < queue_size) {
+    sharded->queue_size *= 2;
+  }
+
+  size_t num_queues = (size_t)num_shards * num_shards;
+  sharded->shards = calloc(num_shards, sizeof(hmap_t *));
+  sharded->queues_alloc = calloc(1, num_queues * sizeof(hmap_shard_queue_t) + HMAP_CACHE_LINE);
+  if (!sharded->shards || !sharded->queues_alloc) {
+    free(sharded->shards);
+    free(sharded->queues_alloc);
+    free(sharded);
+    ERR_THROW(HMAP_ERR_NOMEM, "sharded->queues");
+  }
+  sharded->queues = (hmap_shard_queue_t *)(((uintptr_t)sharded->queues_alloc + HMAP_CACHE_LINE - 1) &
+      ~(uintptr_t)(HMAP_CACHE_LINE - 1));
+
+  size_t shard_size = (table_size + num_shards - 1) / num_shards;
+  int shard;
+  for (shard = 0; shard < num_shards; shard++) {
+    err_t *err = hmap_create_opts(&sharded->shards[shard], shard_size, &shard_options);
+    if (err) {
+      err_dispose(hmap_sharded_delete(sharded));  /* Deletes the shards made so far. */
+      ERR_RETHROW(err, "hmap_create_opts");
+    }
+    sharded->num_shards++;
+  }
+
+  size_t queue;
+  for (queue = 0; queue < num_queues; queue++) {
+    if (queue / num_shards == queue % num_shards) {
+      continue;  /* A shard doesn't send to itself. */
+    }
+    sharded->queues[queue].msgs = malloc(sharded->queue_size * sizeof(hmap_shard_msg_t));
+    if (!sharded->queues[queue].msgs) {
+      err_dispose(hmap_sharded_delete(sharded));
+      ERR_THROW(HMAP_ERR_NOMEM, "queue msgs");
+    }
+  }
+
+  *rtn_sharded = sharded;
+  return ERR_OK;
+}  /* hmap_sharded_create */
+
+
+ERR_F hmap_sharded_delete(hmap_sharded_t *sharded) {
+  ERR_ASSRT(sharded, HMAP_ERR_PARAM);
+
+  /* Messages still queued are dropped. */
+  size_t queue;
+  for (queue = 0; queue < (size_t)sharded->num_shards * sharded->num_shards; queue++) {
+    hmap_shard_queue_t *q = &sharded->queues[queue];
+    size_t msg_num;
+    for (msg_num = q->head; q->msgs && msg_num != q->next; msg_num++) {
+      free(q->msgs[msg_num & (sharded->queue_size - 1)].key_copy);
+    }
+    free(q->msgs);
+  }
+  int shard;
+  for (shard = 0; shard < sharded->num_shards; shard++) {
+    ERR(hmap_delete(sharded->shards[shard]));
+  }
+  free(sharded->shards);
+  free(sharded->queues_alloc);
+  free(sharded);
+  return ERR_OK;
+}  /* hmap_sharded_delete */
+
+
+/* Returns -1 for a NULL map or key. */
+int hmap_sharded_owner(hmap_sharded_t *sharded, const void *key, size_t key_size) {
+  if (!sharded || !key) {
+    return -1;
+  }
+  return HMAP_SHARD_OF(sharded, hmap_hash(sharded->shards[0], key, key_size));
+}  /* hmap_sharded_owner */
+
+
+/* Make queued messages visible to the consumer. */
+static void hmap_shard_publish(hmap_shard_queue_t *queue) {
+  if (queue->next != queue->tail) {
+    __atomic_store_n(&queue->tail, queue->next, __ATOMIC_RELEASE);
+  }
+}  /* hmap_shard_publish */
+
+
+/* Queue a write for another shard. If the queue is full, work through this
+ * shard's own queues while waiting, so that two shards sending to each
+ * other can't wait forever. */
+static ERR_F hmap_shard_send(hmap_sharded_t *sharded, int from, int to, const void *key,
+    size_t key_size, void *val, uint64_t hash) {
+  hmap_shard_queue_t *queue = &sharded->queues[to * sharded->num_shards + from];
+
+  while (queue->next - queue->head_cache == sharded->queue_size) {
+    queue->head_cache = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (queue->next - queue->head_cache == sharded->queue_size) {
+      hmap_shard_publish(queue);
+      ERR(hmap_sharded_poll(sharded, from, NULL));
+      sched_yield();
+    }
+  }
+
+  hmap_shard_msg_t *msg = &queue->msgs[queue->next & (sharded->queue_size - 1)];
+  if (key_size > HMAP_SHARD_KEY_INLINE) {
+    msg->key_copy = malloc(key_size);
+    ERR_ASSRT(msg->key_copy, HMAP_ERR_NOMEM);
+    memcpy(msg->key_copy, key, key_size);
+  } else {
+    msg->key_copy = NULL;
+    memcpy(msg->key, key, key_size);
+  }
+  msg->hash = hash;
+  msg->val = val;
+  msg->key_size = (uint32_t)key_size;
+  queue->next++;
+  return ERR_OK;
+}  /* hmap_shard_send */
+
+
+ERR_F hmap_sharded_write(hmap_sharded_t *sharded, int shard, const void *key, size_t key_size, void *val) {
+  ERR_ASSRT(sharded, HMAP_ERR_PARAM);
+  ERR_ASSRT(shard >= 0 && shard < sharded->num_shards, HMAP_ERR_PARAM);
+  ERR_ASSRT(key, HMAP_ERR_PARAM);
+
+  uint64_t hash = hmap_hash(sharded->shards[0], key, key_size);
+  int owner = HMAP_SHARD_OF(sharded, hash);
+  if (owner == shard) {
+    ERR(hmap_write_hash(sharded->shards[shard], key, key_size, val, hash));
+  } else {
+    ERR_ASSRT(key_size <= UINT32_MAX, HMAP_ERR_PARAM);
+    ERR(hmap_shard_send(sharded, shard, owner, key, key_size, val, hash));
+    hmap_shard_publish(&sharded->queues[owner * sharded->num_shards + shard]);
+  }
+
+  return ERR_OK;
+}  /* hmap_sharded_write */
+
+
+/* Like hmap_sharded_write() for each key, but each queue's consumer is
+ * signalled once for the whole batch. */
+ERR_F hmap_sharded_write_batch(hmap_sharded_t *sharded, int shard, const void *const *keys,
+    const size_t *key_sizes, void *const *vals, size_t num_keys) {
+  ERR_ASSRT(sharded, HMAP_ERR_PARAM);
+  ERR_ASSRT(shard >= 0 && shard < sharded->num_shards, HMAP_ERR_PARAM);
+  ERR_ASSRT(keys && key_sizes && vals, HMAP_ERR_PARAM);
+
+  size_t i;
+  for (i = 0; i < num_keys; i++) {
+    uint64_t hash = hmap_hash(sharded->shards[0], keys[i], key_sizes[i]);
+    int owner = HMAP_SHARD_OF(sharded, hash);
+    if (owner == shard) {
+      ERR(hmap_write_hash(sharded->shards[shard], keys[i], key_sizes[i], vals[i], hash));
+    } else {
+      ERR_ASSRT(key_sizes[i] <= UINT32_MAX, HMAP_ERR_PARAM);
+      ERR(hmap_shard_send(sharded, shard, owner, keys[i], key_sizes[i], vals[i], hash));
+    }
+  }
+
+  int to;
+  for (to = 0; to < sharded->num_shards; to++) {
+    hmap_shard_publish(&sharded->queues[to * sharded->num_shards + shard]);
+  }
+  return ERR_OK;
+}  /* hmap_sharded_write_batch */
+
+
+/* Apply the writes other shards have queued for this one. Only call it
+ * from the shard's own thread. */
+ERR_F hmap_sharded_poll(hmap_sharded_t *sharded, int shard, size_t *rtn_count) {
+  ERR_ASSRT(sharded, HMAP_ERR_PARAM);
+  ERR_ASSRT(shard >= 0 && shard < sharded->num_shards, HMAP_ERR_PARAM);
+
+  hmap_t *hmap = sharded->shards[shard];
+  size_t count = 0;
+  int from;
+  for (from = 0; from < sharded->num_shards; from++) {
+    if (from == shard) {
+      continue;
+    }
+    hmap_shard_queue_t *queue = &sharded->queues[shard * sharded->num_shards + from];
+    if (queue->head == queue->tail_cache) {
+      queue->tail_cache = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    }
+    size_t head = queue->head;
+    while (head != queue->tail_cache) {
+      hmap_shard_msg_t *msg = &queue->msgs[head & (sharded->queue_size - 1)];
+      err_t *err = hmap_write_hash(hmap, msg->key_copy ? msg->key_copy : msg->key, msg->key_size,
+          msg->val, msg->hash);
+      if (err) {
+        /* Leave the message queued, to be retried. */
+        __atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+        ERR_RETHROW(err, "hmap_write_hash");
+      }
+      free(msg->key_copy);  /* The map has its own copy now. */
+      head++;
+      count++;
+    }
+    /* Let the producer reuse the messages. */
+    __atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+  }
+
+  if (rtn_count) {
+    *rtn_count = count;
+  }
+  return ERR_OK;
+}  /* hmap_sharded_poll */
+
+
+/* With shared reads, any thread may look up any key: the owner's map is
+ * searched lock-free. Otherwise only the owner's thread may, until every
+ * thread has stopped writing and the queues are drained. Writes still
+ * queued for the owner are not seen until it polls. */
+int hmap_sharded_try_lookup(hmap_sharded_t *sharded, const void *key, size_t key_size, void **rtn_val) {
+  if (!sharded || !key) {
+    if (rtn_val) {
+      *rtn_val = NULL;
+    }
+    return 0;
+  }
+  uint64_t hash = hmap_hash(sharded->shards[0], key, key_size);
+  return hmap_lookup_value(sharded->shards[HMAP_SHARD_OF(sharded, hash)], key, key_size, hash, rtn_val);
+}  /* hmap_sharded_try_lookup */
+
+
+/* hmap_sharded_try_lookup() for each key (with the same rules on which
+ * thread may call it). All the keys are hashed before any shard is
+ * searched. */
+ERR_F hmap_sharded_lookup_batch(hmap_sharded_t *sharded, const void *const *keys, const size_t *key_sizes,
+    size_t num_keys, void **rtn_vals, size_t *rtn_num_found) {
+  uint64_t hashes[HMAP_BATCH_CHUNK];
+  size_t num_found = 0;
+  size_t chunk, i;
+
+  ERR_ASSRT(sharded, HMAP_ERR_PARAM);
+  ERR_ASSRT(num_keys == 0 || (keys && key_sizes && rtn_vals), HMAP_ERR_PARAM);
+
+  for (chunk = 0; chunk < num_keys; chunk += HMAP_BATCH_CHUNK) {
+    size_t chunk_len = (num_keys - chunk < HMAP_BATCH_CHUNK) ? num_keys - chunk : HMAP_BATCH_CHUNK;
+    for (i = 0; i < chunk_len; i++) {
+      hashes[i] = hmap_hash(sharded->shards[0], keys[chunk + i], key_sizes[chunk + i]);
+    }
+    for (i = 0; i < chunk_len; i++) {
+      hmap_t *shard = sharded->shards[HMAP_SHARD_OF(sharded, hashes[i])];
+      num_found += hmap_lookup_value(shard, keys[chunk + i], key_sizes[chunk + i], hashes[i],
+          &rtn_vals[chunk + i]);
+    }
+  }
+
+  if (rtn_num_found) {
+    *rtn_num_found = num_found;
+  }
+  return ERR_OK;
+}  /* hmap_sharded_lookup_batch */
@@ -20,6 +20,14 @@ extern "C" {
 #include <stdint.h>
 #include "err.h"
 
+/* While a resize is in progress, the high bit of an entry's "bucket" tells
+ * which table it lives in (see hmap_t's "table_gen"). */
+#define HMAP_BUCKET_GEN 0x80000000u
+#define HMAP_BUCKET_MASK 0x7fffffffu
+#define HMAP_MAX_TABLE_SIZE ((size_t)HMAP_BUCKET_MASK + 1)
+#define HMAP_MAX_SEGMENTS 1024
+#define HMAP_MAX_BUILD_THREADS 64
+
 /* Linked list of entries for handling collisions */
 typedef struct hmap_entry_s hmap_entry_t;  /* Forward definition. */
 struct hmap_entry_s {
@@ -27,15 +35,184 @@ struct hmap_entry_s {
     size_t key_size;
     void *value;
     hmap_entry_t *next;
-    uint32_t bucket;  /* Bucket that this entry is under. */
+    uint32_t bucket;  /* Bucket that this entry is under (plus gen bit). */
+    uint32_t flags;  /* HMAP_ENTRY_... */
+    uint64_t hash;  /* Full hash of the key, checked before comparing keys. */
+};
+
+/* Entry (and key) are part of a block allocated by hmap_write_batch(),
+ * freed only when the map is deleted. */
+#define HMAP_ENTRY_BULK 0x1
+
+/* hmap_write_batch() flags. */
+#define HMAP_BATCH_UNIQUE 0x1  /* Caller guarantees no key is already in the map or repeated. */
+
+/* hmap_open_mmap() flags. */
+#define HMAP_MMAP_VERIFY 0x1  /* Check the body checksum (reads the whole file). */
+
+/* Table layouts. */
+#define HMAP_LAYOUT_CHAINED 0    /* Buckets of linked entries (default). */
+#define HMAP_LAYOUT_ROBINHOOD 1  /* Open addressing, entries stored in slots. */
+#define HMAP_LAYOUT_GROUP 2      /* Open addressing probed 16 control bytes at a time. */
+
+/* Open addressing can't exceed a load of 1, so those layouts always grow,
+ * by default when the load passes this. */
+#define HMAP_OPEN_DEFAULT_LOAD 0.85
+
+/* Control bytes examined per probe step by HMAP_LAYOUT_GROUP. */
+#define HMAP_GROUP_WIDTH 16
+
+/* Keys up to inline_key_max bytes are stored right after the entry
+ * instead of in a separate allocation. */
+#define HMAP_INLINE_KEY_DEFAULT 24
+#define HMAP_INLINE_KEY_LIMIT 256
+
+/* Arena mode hands out memory in multiples of HMAP_ARENA_ALIGN and keeps
+ * a free list for each size up to HMAP_ARENA_CLASSES * HMAP_ARENA_ALIGN. */
+#define HMAP_ARENA_ALIGN 16
+#define HMAP_ARENA_CLASSES 64
+
+typedef struct hmap_slab_s hmap_slab_t;
+struct hmap_slab_s {
+    hmap_slab_t *next;
+    size_t size;  /* Bytes usable after the header. */
+    size_t used;
+};
+
+/* Optional user callbacks (see hmap_options_t). A hash function must give
+ * equal keys equal hashes, and should mix well into the low 32 bits. */
+typedef uint64_t (*hmap_hash_fn_t)(const void *key, size_t key_size, uint32_t seed);
+typedef int (*hmap_equal_fn_t)(const void *key1, size_t key1_size, const void *key2, size_t key2_size);
+
+typedef struct hmap_options_s hmap_options_t;
+struct hmap_options_s {
+    double max_load;  /* Grow when num_entries/table_size exceeds this (0 = never). */
+    int layout;  /* HMAP_LAYOUT_... */
+    size_t arena_slab_size;  /* Carve entries and keys from slabs (0 = malloc each). */
+    size_t inline_key_max;  /* Store keys up to this size inside the entry. */
+    int pow2;  /* Round table_size up to a power of two. */
+    int hash_bits;  /* 32 (hmap_murmur3_32) or 64 (hmap_murmur3_x64_128). */
+    uint32_t seed;  /* Passed to the hash function. */
+    hmap_hash_fn_t hash_fn;  /* Replaces murmur3 (NULL = use hash_bits). */
+    hmap_equal_fn_t equal_fn;  /* Replaces memcmp (NULL = same size and bytes). */
+    int concurrent;  /* Lock-free lookups from many threads (CHAINED only). */
+    int segments;  /* Split into this many separately locked concurrent maps (0 = one). */
+    int build_threads;  /* Threads for bulk loads and resizes (0 = caller only; CHAINED). */
+    size_t mem_budget;  /* Fail writes that would use more than this many bytes (0 = no limit). */
 };
 
 typedef struct hmap_s hmap_t;
+typedef struct hmap_conc_s hmap_conc_t;  /* Private to hmap.c. */
+typedef struct hmap_mapped_s hmap_mapped_t;  /* Private to hmap.c. */
+
+/* Operation counts, kept only if hmap.c is compiled with -DHMAP_COUNTERS;
+ * otherwise they stay zero and the code to update them isn't compiled. */
+typedef struct hmap_counters_s hmap_counters_t;
+struct hmap_counters_s {
+    uint64_t lookups;  /* hmap_lookup(), hmap_try_lookup(), per key of hmap_lookup_batch(). */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writes;  /* hmap_write(), per key of hmap_write_batch(). */
+    uint64_t probes;  /* Searches: chained entries, Robin Hood slots, or groups visited. */
+};
+
+#define HMAP_STATS_HIST 16  /* Chain lengths 0 to 14, then 15 or more. */
+
+/* See hmap_stats(). */
+typedef struct hmap_stats_s hmap_stats_t;
+struct hmap_stats_s {
+    size_t table_size;  /* Buckets (or slots). */
+    size_t num_entries;
+    double load_factor;  /* num_entries / table_size. */
+    size_t empty_buckets;
+    size_t used_buckets;
+    size_t max_chain;  /* Open addressing: most slots any entry is from home. */
+    size_t chain_hist[HMAP_STATS_HIST];  /* Buckets by chain length (open: entries by slots from home). */
+    hmap_counters_t counters;
+};
+
+/* See hmap_memory_usage(). */
+typedef struct hmap_memory_s hmap_memory_t;
+struct hmap_memory_s {
+    size_t table_bytes;  /* Bucket arrays (open addressing: slots, with their inline keys, and hashes or control bytes). */
+    size_t entry_bytes;  /* Chained entries. */
+    size_t key_bytes;  /* Keys not stored in a slot. */
+    size_t overhead_bytes;  /* Allocator headers and rounding, unused arena and bulk space, the map's own structures. */
+    size_t total_bytes;
+};
+
+#define HMAP_SLOT(slot__hmap, slot__num) \
+  ((hmap_entry_t *)((slot__hmap)->slots + (size_t)(slot__num) * (slot__hmap)->slot_size))
+
 struct hmap_s {
     size_t table_size;
     uint32_t seed;
     hmap_entry_t **table;
     int num_entries;
+    uint64_t reduce_m;  /* hmap_reduce_init(table_size). */
+    double max_load;
+    /* Incremental resize. While old_table is non-NULL, entries are being
+     * migrated from it into "table" a few buckets at a time. */
+    hmap_entry_t **old_table;
+    size_t old_table_size;
+    uint64_t old_reduce_m;
+    size_t migrate_bucket;  /* Next old_table bucket to migrate. */
+    uint32_t table_gen;  /* HMAP_BUCKET_GEN bit of entries in "table". */
+    int iterating;  /* Pauses migration during lookups. */
+    int layout;
+    size_t inline_key_max;
+    int hash_bits;
+    hmap_hash_fn_t hash_fn;
+    hmap_equal_fn_t equal_fn;
+    /* Open addressing layouts: table_size slots of slot_size bytes (an
+     * entry plus room for an inline key); use HMAP_SLOT(). "table" is NULL. */
+    char *slots;
+    size_t slot_size;
+    uint32_t *hashes;  /* ROBINHOOD: per-slot hash, 0 = empty slot. */
+    uint8_t *ctrl;  /* GROUP: per-slot control byte (+ HMAP_GROUP_WIDTH clones). */
+    /* Arena mode (arena_slab_size > 0). */
+    size_t arena_slab_size;
+    hmap_slab_t *slabs;  /* Slab currently being carved is first. */
+    void *arena_free[HMAP_ARENA_CLASSES];  /* Free lists by size class. */
+    size_t arena_used;  /* Bytes handed out and not freed. */
+    size_t arena_reserved;  /* Bytes in all slabs. */
+    hmap_slab_t *bulk_blocks;  /* Blocks of entries from hmap_write_batch(). */
+    hmap_conc_t *conc;  /* Concurrent mode state (NULL if not concurrent). */
+    hmap_mapped_t *mapped;  /* hmap_open_mmap() state (NULL if not mapped). */
+    /* Segmented maps (segments option): the segments do all the work. */
+    hmap_t **segments;
+    int num_segments;
+    int segment_num;  /* Of a segment, its index in its map's segments. */
+    int build_threads;  /* Parallel bulk load and rehash (see hmap_options_t). */
+    hmap_counters_t counters;  /* -DHMAP_COUNTERS only. */
+    /* Memory accounting (see hmap_memory_usage()). Table sizes are
+     * worked out when needed; these are kept as entries come and go. */
+    size_t mem_budget;
+    size_t mem_entry_bytes;
+    size_t mem_key_bytes;
+    size_t mem_overhead;
+};
+
+
+/* Sharded map: one hmap_t per worker thread, each touched only by its own
+ * thread (unless created with shared reads). Writes of keys owned by
+ * another shard are passed to its thread through a single-producer,
+ * single-consumer queue. */
+
+/* Keys up to this long are sent to another shard inside the queue message
+ * (which is then one cache line); longer ones are sent as a malloced copy. */
+#define HMAP_SHARD_KEY_INLINE 36
+
+typedef struct hmap_shard_queue_s hmap_shard_queue_t;  /* Private to hmap.c. */
+
+typedef struct hmap_sharded_s hmap_sharded_t;
+struct hmap_sharded_s {
+    int num_shards;
+    hmap_t **shards;  /* shards[n] belongs to thread n. */
+    hmap_shard_queue_t *queues;  /* From shard f to shard t is [t * num_shards + f]. */
+    size_t queue_size;  /* Messages per queue (a power of two). */
+    int shared_reads;  /* Shards are concurrent, so any thread may look up. */
+    void *queues_alloc;  /* The malloced block "queues" is aligned within. */
 };
 
 
@@ -45,29 +222,120 @@ struct hmap_s {
 #  define ERR_CODE(err__code) ERR_API extern char *err__code
 #endif
 
+/* Map a hash onto a bucket in [0, table_size). Power-of-two sizes use a
+ * mask, after folding the high half of the hash into the low half so weak
+ * hashes still spread. Other sizes use "fastmod" (Lemire, Kaser & Kurz),
+ * which gives hash % table_size using multiplies by a precomputed
+ * reciprocal instead of a divide. "reduce_m" comes from hmap_reduce_init(),
+ * which returns 0 for powers of two. table_size must fit in 32 bits.
+ * 64-bit hashes are passed in truncated; their low half is as well mixed
+ * as the whole. */
+static inline uint64_t hmap_reduce_init(size_t table_size) {
+    if ((table_size & (table_size - 1)) == 0) {
+        return 0;
+    }
+    return UINT64_MAX / table_size + 1;
+}  /* hmap_reduce_init */
+
+static inline size_t hmap_reduce(uint32_t hash, size_t table_size, uint64_t reduce_m) {
+    if (reduce_m == 0) {
+        return (hash ^ (hash >> 16)) & (table_size - 1);
+    }
+    /* High 64 bits of the 96-bit product (reduce_m * hash) * table_size. */
+    uint64_t low_bits = reduce_m * hash;
+    return (size_t)(((low_bits >> 32) * table_size +
+        (((low_bits & 0xffffffff) * table_size) >> 32)) >> 32);
+}  /* hmap_reduce */
+
+
 ERR_CODE(HMAP_ERR_PARAM);
 ERR_CODE(HMAP_ERR_NOMEM);
 ERR_CODE(HMAP_ERR_NOTFOUND);
+ERR_CODE(HMAP_ERR_BUDGET);
+ERR_CODE(HMAP_ERR_IO);
+ERR_CODE(HMAP_ERR_FORMAT);
 
 #undef ERR_CODE
 
 
 uint32_t hmap_murmur3_32(const void *key, size_t len, uint32_t seed);
+void hmap_murmur3_x64_128(const void *key, size_t len, uint32_t seed, uint64_t *rtn_hash);
+
+void hmap_options_init(hmap_options_t *options);
 
 ERR_F hmap_create(hmap_t **rtn_hmap, size_t table_size);
 
+ERR_F hmap_create_opts(hmap_t **rtn_hmap, size_t table_size, const hmap_options_t *options);
+
 ERR_F hmap_delete(hmap_t *hmap);
 
+uint32_t hmap_read_begin(hmap_t *hmap);
+
+void hmap_read_end(hmap_t *hmap, uint32_t token);
+
 ERR_F hmap_write(hmap_t *hmap, const void *key, size_t key_size, void *val);
 
+ERR_F hmap_write_batch(hmap_t *hmap, const void *const *keys, const size_t *key_sizes,
+    void *const *vals, size_t num_keys, int flags);
+
 ERR_F hmap_lookup(hmap_t *hmap, const void *key, size_t key_size, void **rtn_val);
 
+/* Returns 1 if found, 0 if not. No err_t is created on a miss. */
+int hmap_try_lookup(hmap_t *hmap, const void *key, size_t key_size, void **rtn_val);
+
 ERR_F hmap_swrite(hmap_t *hmap, const char *key, void *val);
 
 ERR_F hmap_slookup(hmap_t *hmap, const char *key, void **rtn_val);
 
+int hmap_try_slookup(hmap_t *hmap, const char *key, void **rtn_val);
+
+/* Returns a pointer to the key's value, adding the key (with a NULL value)
+ * if needed. The pointer is good until the next write of a new key or
+ * remove (chained: until this key is removed). */
+ERR_F hmap_get_or_insert(hmap_t *hmap, const void *key, size_t key_size, void ***rtn_val_ptr, int *rtn_inserted);
+
+ERR_F hmap_sget_or_insert(hmap_t *hmap, const char *key, void ***rtn_val_ptr, int *rtn_inserted);
+
+ERR_F hmap_remove(hmap_t *hmap, const void *key, size_t key_size, void **rtn_val);
+
+ERR_F hmap_sremove(hmap_t *hmap, const char *key, void **rtn_val);
+
+ERR_F hmap_lookup_batch(hmap_t *hmap, const void *const *keys, const size_t *key_sizes,
+    size_t num_keys, void **rtn_vals, size_t *rtn_num_found);
+
 ERR_F hmap_next(hmap_t *hmap, hmap_entry_t **in_entry);
 
+ERR_F hmap_arena_usage(hmap_t *hmap, size_t *rtn_used, size_t *rtn_reserved);
+
+ERR_F hmap_segment_stats(hmap_t *hmap, int segment, int *rtn_entries, uint64_t *rtn_contended);
+
+ERR_F hmap_stats(hmap_t *hmap, hmap_stats_t *rtn_stats);
+
+ERR_F hmap_memory_usage(hmap_t *hmap, hmap_memory_t *rtn_mem);
+
+ERR_F hmap_save(hmap_t *hmap, const char *filename, size_t value_size);
+
+ERR_F hmap_open_mmap(hmap_t **rtn_hmap, const char *filename, const hmap_options_t *options, int flags);
+
+ERR_F hmap_sharded_create(hmap_sharded_t **rtn_sharded, int num_shards, size_t table_size,
+    size_t queue_size, const hmap_options_t *options);
+
+ERR_F hmap_sharded_delete(hmap_sharded_t *sharded);
+
+int hmap_sharded_owner(hmap_sharded_t *sharded, const void *key, size_t key_size);
+
+ERR_F hmap_sharded_write(hmap_sharded_t *sharded, int shard, const void *key, size_t key_size, void *val);
+
+ERR_F hmap_sharded_write_batch(hmap_sharded_t *sharded, int shard, const void *const *keys,
+    const size_t *key_sizes, void *const *vals, size_t num_keys);
+
+ERR_F hmap_sharded_poll(hmap_sharded_t *sharded, int shard, size_t *rtn_count);
+
+int hmap_sharded_try_lookup(hmap_sharded_t *sharded, const void *key, size_t key_size, void **rtn_val);
+
+ERR_F hmap_sharded_lookup_batch(hmap_sharded_t *sharded, const void *const *keys, const size_t *key_sizes,
+    size_t num_keys, void **rtn_vals, size_t *rtn_num_found);
+
 #ifdef __cplusplus
 }
 #endif
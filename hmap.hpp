@@ -0,0 +1,340 @@
+/* hmap.hpp - header-only C++ hashmap. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/hmap
+ */
+
+/* hmap::map<K, V, Hash, Eq> stores keys and values by value in an open
+ * addressed table laid out like HMAP_LAYOUT_GROUP: a slot array plus one
+ * control byte per slot holding 7 bits of the hash (or 0x80 if empty),
+ * so a probe only compares keys whose control byte matches. Buckets are
+ * chosen with hmap_reduce() and the table grows all at once when
+ * max_load is exceeded. Everything is inline; nothing needs hmap.c.
+ *
+ * Lookups never allocate. Allocation failures throw std::bad_alloc, as
+ * with the standard containers. Keys and values must have non-throwing
+ * move constructors. */
+
+#ifndef HMAP_HPP
+#define HMAP_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include "hmap.h"
+#include "hmap_murmur3.h"
+
+namespace hmap {
+
+/* Default hash functions: an integer mixer for integral keys and murmur3
+ * for std::string. Other key types need a Hash parameter, which can be
+ * any callable returning an integer (e.g. std::hash); buckets come from
+ * its low 32 bits. */
+template <typename K, typename Enable = void> struct hash;
+
+template <typename K>
+struct hash<K, typename std::enable_if<std::is_integral<K>::value>::type> {
+    uint32_t seed;
+    explicit hash(uint32_t in_seed = 42) : seed(in_seed) {}
+    uint32_t operator()(K key) const {
+        return (uint32_t)hmap_fmix64((uint64_t)key ^ seed);
+    }
+};
+
+template <> struct hash<std::string> {
+    uint32_t seed;
+    explicit hash(uint32_t in_seed = 42) : seed(in_seed) {}
+    uint32_t operator()(const std::string &key) const {
+        return hmap_murmur3_32_inline(key.data(), key.size(), seed);
+    }
+};
+
+
+template <typename K, typename V, typename Hash = hmap::hash<K>, typename Eq = std::equal_to<K> >
+class map {
+public:
+    struct entry {
+        K key;
+        V value;
+    };
+
+    /* What an iterator yields. The key is const: changing it would leave
+     * the entry in the wrong slot. */
+    struct entry_ref {
+        const K &key;
+        V &value;
+    };
+
+    class iterator {
+    public:
+        iterator(map *in_map, size_t in_slot) : map_(in_map), slot_(in_slot) { map_->skip_empty(&slot_); }
+        entry_ref operator*() const { entry &e = map_->slots_[slot_]; return entry_ref{e.key, e.value}; }
+        /* it->value works through a temporary that holds the entry_ref. */
+        struct arrow {
+            entry_ref ref;
+            const entry_ref *operator->() const { return &ref; }
+        };
+        arrow operator->() const { return arrow{**this}; }
+        iterator &operator++() { slot_++; map_->skip_empty(&slot_); return *this; }
+        bool operator==(const iterator &other) const { return slot_ == other.slot_; }
+        bool operator!=(const iterator &other) const { return slot_ != other.slot_; }
+    private:
+        map *map_;
+        size_t slot_;
+    };
+
+    class const_iterator {
+    public:
+        const_iterator(const map *in_map, size_t in_slot) : map_(in_map), slot_(in_slot) { map_->skip_empty(&slot_); }
+        const entry &operator*() const { return map_->slots_[slot_]; }
+        const entry *operator->() const { return &map_->slots_[slot_]; }
+        const_iterator &operator++() { slot_++; map_->skip_empty(&slot_); return *this; }
+        bool operator==(const const_iterator &other) const { return slot_ == other.slot_; }
+        bool operator!=(const const_iterator &other) const { return slot_ != other.slot_; }
+    private:
+        const map *map_;
+        size_t slot_;
+    };
+
+    /* max_load must be between 0 and 1. */
+    explicit map(size_t table_size = 16, double max_load = HMAP_OPEN_DEFAULT_LOAD,
+            const Hash &hash = Hash(), const Eq &eq = Eq())
+            : table_size_(0), reduce_m_(0), size_(0), max_load_(max_load),
+              ctrl_(NULL), slots_(NULL), hash_(hash), eq_(eq) {
+        if (table_size == 0 || table_size > HMAP_MAX_TABLE_SIZE || !(max_load > 0 && max_load < 1)) {
+            throw std::invalid_argument("hmap::map");
+        }
+        alloc_table(table_size, &ctrl_, &slots_);
+        table_size_ = table_size;
+        reduce_m_ = hmap_reduce_init(table_size);
+    }
+
+    ~map() { free_table(); }
+
+    /* A moved-from map is left empty. */
+    map(map &&other) noexcept
+            : table_size_(other.table_size_), reduce_m_(other.reduce_m_), size_(other.size_),
+              max_load_(other.max_load_), ctrl_(other.ctrl_), slots_(other.slots_),
+              hash_(std::move(other.hash_)), eq_(std::move(other.eq_)) {
+        other.forget();
+    }
+
+    map &operator=(map &&other) noexcept {
+        if (this != &other) {
+            free_table();
+            table_size_ = other.table_size_;
+            reduce_m_ = other.reduce_m_;
+            size_ = other.size_;
+            max_load_ = other.max_load_;
+            ctrl_ = other.ctrl_;
+            slots_ = other.slots_;
+            hash_ = std::move(other.hash_);
+            eq_ = std::move(other.eq_);
+            other.forget();
+        }
+        return *this;
+    }
+
+    map(const map &) = delete;
+    map &operator=(const map &) = delete;
+
+    /* Returns a pointer to the key's value, or NULL if not found. The
+     * pointer is valid until the next insert of a new key. */
+    V *find(const K &key) {
+        size_t slot;
+        if (size_ == 0 || !find_slot(key, (uint32_t)hash_(key), &slot)) {
+            return NULL;
+        }
+        return &slots_[slot].value;
+    }
+
+    const V *find(const K &key) const {
+        return const_cast<map *>(this)->find(key);
+    }
+
+    /* Inserts or overwrites. Returns true if the key was new. */
+    bool insert(K key, V value) {
+        size_t slot;
+        uint32_t hash;
+        if (place(key, &slot, &hash)) {
+            slots_[slot].value = std::move(value);
+            return false;
+        }
+        new (&slots_[slot]) entry{std::move(key), std::move(value)};
+        claim(slot, hash);
+        return true;
+    }
+
+    /* Returns the key's value, inserting a default-constructed one if needed. */
+    V &operator[](const K &key) {
+        size_t slot;
+        uint32_t hash;
+        if (!place(key, &slot, &hash)) {
+            new (&slots_[slot]) entry{key, V()};
+            claim(slot, hash);
+        }
+        return slots_[slot].value;
+    }
+
+    size_t size() const { return size_; }
+    size_t table_size() const { return table_size_; }
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, table_size_); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, table_size_); }
+
+private:
+    static const uint8_t ctrl_empty = 0x80;
+
+    static uint8_t ctrl_h2(uint32_t hash) { return (uint8_t)(hash >> 25); }
+
+    void skip_empty(size_t *slot) const {
+        while (*slot < table_size_ && ctrl_[*slot] == ctrl_empty) {
+            (*slot)++;
+        }
+    }
+
+    /* Returns true with the key's slot, or false with the empty slot where
+     * it would go. */
+    bool find_slot(const K &key, uint32_t hash, size_t *rtn_slot) const {
+        size_t slot = hmap_reduce(hash, table_size_, reduce_m_);
+        uint8_t h2 = ctrl_h2(hash);
+        /* The load factor is < 1, so there is always an empty slot to stop at. */
+        for (;;) {
+            uint8_t ctrl = ctrl_[slot];
+            if (ctrl == h2 && eq_(slots_[slot].key, key)) {
+                *rtn_slot = slot;
+                return true;
+            }
+            if (ctrl == ctrl_empty) {
+                *rtn_slot = slot;
+                return false;
+            }
+            slot++;
+            if (slot == table_size_) {
+                slot = 0;
+            }
+        }
+    }
+
+    /* Finds the key, or finds an empty slot for it (growing if needed).
+     * The caller constructs an entry there, then calls claim(). */
+    bool place(const K &key, size_t *rtn_slot, uint32_t *rtn_hash) {
+        if (ctrl_ == NULL) {  /* Moved-from. */
+            alloc_table(16, &ctrl_, &slots_);
+            table_size_ = 16;
+            reduce_m_ = 0;
+        }
+        uint32_t hash = (uint32_t)hash_(key);
+        *rtn_hash = hash;
+        if (find_slot(key, hash, rtn_slot)) {
+            return true;
+        }
+        if ((double)(size_ + 1) > max_load_ * (double)table_size_) {
+            grow();
+            find_slot(key, hash, rtn_slot);
+        }
+        return false;
+    }
+
+    void claim(size_t slot, uint32_t hash) {
+        ctrl_[slot] = ctrl_h2(hash);
+        size_++;
+    }
+
+    void grow() {
+        size_t new_size = table_size_ * 2;
+        if (new_size > HMAP_MAX_TABLE_SIZE) {
+            new_size = HMAP_MAX_TABLE_SIZE;
+        }
+        if (new_size == table_size_) {
+            if (size_ + 1 >= table_size_) {
+                throw std::length_error("hmap::map");
+            }
+            return;  /* Limp along above max_load. */
+        }
+        uint8_t *new_ctrl;
+        entry *new_slots;
+        alloc_table(new_size, &new_ctrl, &new_slots);
+
+        size_t old_size = table_size_;
+        uint8_t *old_ctrl = ctrl_;
+        entry *old_slots = slots_;
+        ctrl_ = new_ctrl;
+        slots_ = new_slots;
+        table_size_ = new_size;
+        reduce_m_ = hmap_reduce_init(new_size);
+
+        size_t slot;
+        for (slot = 0; slot < old_size; slot++) {
+            if (old_ctrl[slot] != ctrl_empty) {
+                uint32_t hash = (uint32_t)hash_(old_slots[slot].key);
+                size_t new_slot;
+                find_slot(old_slots[slot].key, hash, &new_slot);
+                new (&slots_[new_slot]) entry(std::move(old_slots[slot]));
+                ctrl_[new_slot] = ctrl_h2(hash);
+                old_slots[slot].~entry();
+            }
+        }
+        delete[] old_ctrl;
+        ::operator delete(old_slots);
+    }
+
+    static void alloc_table(size_t table_size, uint8_t **rtn_ctrl, entry **rtn_slots) {
+        uint8_t *ctrl = new uint8_t[table_size];
+        try {
+            *rtn_slots = static_cast<entry *>(::operator new(table_size * sizeof(entry)));
+        } catch (...) {
+            delete[] ctrl;
+            throw;
+        }
+        memset(ctrl, ctrl_empty, table_size);
+        *rtn_ctrl = ctrl;
+    }
+
+    void free_table() {
+        if (ctrl_ == NULL) {
+            return;
+        }
+        size_t slot;
+        for (slot = 0; slot < table_size_; slot++) {
+            if (ctrl_[slot] != ctrl_empty) {
+                slots_[slot].~entry();
+            }
+        }
+        delete[] ctrl_;
+        ::operator delete(slots_);
+    }
+
+    void forget() {
+        table_size_ = 0;
+        size_ = 0;
+        ctrl_ = NULL;
+        slots_ = NULL;
+    }
+
+    size_t table_size_;
+    uint64_t reduce_m_;
+    size_t size_;
+    double max_load_;
+    uint8_t *ctrl_;
+    entry *slots_;
+    Hash hash_;
+    Eq eq_;
+};
+
+}  /* namespace hmap */
+
+#endif  /* HMAP_HPP */
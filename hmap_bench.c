@@ -0,0 +1,748 @@
+/* hmap_bench.c - workload-driven benchmark. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/hmap
+ */
+
+/* Each run builds a map of "keys" entries and times a stream of
+ * operations on it: loading it from empty (load), lookups with a given
+ * share of misses (lookup), or lookups and overwrites in a given ratio
+ * (mixed). Lookup and mixed keys are drawn uniformly or from a Zipfian
+ * distribution. The operation stream is generated before the clock
+ * starts. Each stream is run twice: once timed as a whole for ns/op, and
+ * once reading the clock after every operation for the latency
+ * percentiles (which therefore include one clock read). With -p, Linux
+ * hardware counters are read around the first run. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE  /* For syscall(). */
+#endif
+#define _POSIX_C_SOURCE 200809L  /* For clock_gettime(). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "err.h"
+#include "hmap.h"
+#include "hmap_murmur3.h"
+
+#define E(e__test) do { \
+  err_t *e__err = (e__test); \
+  if (e__err != ERR_OK) { \
+    printf("ERROR [%s:%d]: '%s' returned error\n", __FILE__, __LINE__, #e__test); \
+    ERR_ABRT_ON_ERR(e__err, stdout); \
+    exit(1); \
+  } \
+} while (0)
+
+#define ASSRT(assrt__cond) do { \
+  if (! (assrt__cond)) { \
+    printf("ERROR [%s:%d]: assert '%s' failed\n", __FILE__, __LINE__, #assrt__cond); \
+    exit(1); \
+  } \
+} while (0)
+
+#define MAX_LIST 16  /* Most values in a comma-separated option. */
+#define STR_KEY_SIZE 24  /* Bytes per string key, including the NUL. */
+#define LOAD_TABLE_SIZE 1024  /* Maps start this small and grow. */
+
+/* An operation is a key index, plus this bit for a miss (lookup) or an
+ * overwrite (mixed). */
+#define OP_FLAG 0x80000000u
+
+#define WL_LOAD 0
+#define WL_LOOKUP 1
+#define WL_MIXED 2
+const char *wl_names[] = {"load", "lookup", "mixed"};
+
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+const char *dist_names[] = {"uniform", "zipf"};
+
+#define KT_BIN 0
+#define KT_STR 1
+const char *kt_names[] = {"bin", "str"};
+
+const char *layout_names[] = {"chained", "robinhood", "group"};  /* By HMAP_LAYOUT_... */
+
+#define FMT_TEXT 0
+#define FMT_CSV 1
+#define FMT_JSON 2
+const char *fmt_names[] = {"text", "csv", "json"};
+
+
+/* Options */
+int o_workloads[3];
+int o_num_workloads;
+size_t o_keys[MAX_LIST];
+int o_num_keys;
+int o_dists[2];
+int o_num_dists;
+int o_key_types[2];
+int o_num_key_types;
+int o_layouts[3];
+int o_num_layouts;
+size_t o_ops;
+size_t o_miss_pcts[MAX_LIST];
+int o_num_miss_pcts;
+size_t o_read_pcts[MAX_LIST];
+int o_num_read_pcts;
+double o_theta;
+int o_format;
+int o_smoke;
+int o_perf;
+
+
+/* Hardware counters (-p), reported per operation. */
+#define PERF_NUM 6
+const char *perf_names[PERF_NUM] = {"cycles", "instructions", "l1d_misses", "llc_misses",
+    "dtlb_misses", "branch_misses"};
+const char *perf_short_names[PERF_NUM] = {"cyc", "ins", "l1d", "llc", "dtlb", "brmis"};
+int perf_fds[PERF_NUM];
+
+
+/* One timed run. */
+typedef struct result_s {
+  int workload;
+  int layout;
+  int key_type;
+  size_t keys;
+  const char *dist;
+  size_t pct;  /* lookup: miss %, mixed: read %, load: 0. */
+  size_t ops;
+  double ns_per_op;
+  double ops_per_sec;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+  double perf[PERF_NUM];  /* Per op; negative if the counter isn't available. */
+} result_t;
+
+int num_results;
+volatile uint64_t sink;  /* Keeps lookups from being optimized away. */
+
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}  /* now_ns */
+
+
+char usage_str[] = "Usage: hmap_bench [-h] [-s] [-p] [-w workloads] [-n keys] [-d dists] [-k key_types]\n"
+    "                  [-l layouts] [-o ops] [-m miss_pcts] [-r read_pcts] [-z theta] [-f format]";
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "\n%s\n\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}  /* usage */
+
+void help() {
+  printf("%s\n"
+    "where (lists are comma-separated):\n"
+    "  -h - print help\n"
+    "  -s - smoke test: defaults of -n 500,20000 and -o 20000, to check that everything runs\n"
+    "  -w workloads - load, lookup, mixed [all]\n"
+    "  -n keys - map sizes [500,20000,500000,4000000]\n"
+    "  -d dists - key distribution for lookup and mixed: uniform, zipf [both]\n"
+    "  -k key_types - bin (8-byte keys, hmap_write()), str (C strings, hmap_swrite()) [both]\n"
+    "  -l layouts - chained, robinhood, group [all]\n"
+    "  -o ops - operations per lookup and mixed run [1000000]\n"
+    "  -m miss_pcts - percent of lookups that miss [10,90]\n"
+    "  -r read_pcts - percent of mixed operations that are lookups [90,50]\n"
+    "  -z theta - Zipfian skew, between 0 and 1 [0.99]\n"
+    "  -f format - text, csv, json [text]\n"
+    "  -p - also report hardware counters per op (Linux perf_event_open())\n"
+    "For details, see https://github.com/fordsfords/hmap\n",
+    usage_str);
+  exit(0);
+}  /* help */
+
+
+/* Parse a comma-separated list of numbers. */
+int parse_nums(const char *arg, size_t *vals, const char *opt) {
+  int count = 0;
+  const char *p = arg;
+  while (*p) {
+    char *end;
+    if (count == MAX_LIST) { fprintf(stderr, "Error, too many values for %s\n", opt);  exit(1); }
+    vals[count++] = (size_t)strtoull(p, &end, 10);
+    if (end == p || (*end != ',' && *end != '\0')) { fprintf(stderr, "Error, bad number list for %s\n", opt);  exit(1); }
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return count;
+}  /* parse_nums */
+
+
+/* Parse a comma-separated list of names from "names". */
+int parse_names(const char *arg, const char **names, int num_names, int *vals, const char *opt) {
+  int count = 0;
+  const char *p = arg;
+  while (*p) {
+    size_t len = strcspn(p, ",");
+    int n;
+    for (n = 0; n < num_names; n++) {
+      if (strlen(names[n]) == len && strncmp(p, names[n], len) == 0) {
+        break;
+      }
+    }
+    if (n == num_names || count == num_names) { fprintf(stderr, "Error, bad value for %s\n", opt);  exit(1); }
+    vals[count++] = n;
+    p += len;
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return count;
+}  /* parse_names */
+
+
+void parse_cmdline(int argc, char **argv) {
+  int i;
+  int keys_given = 0;
+  int ops_given = 0;
+
+  o_num_workloads = parse_names("load,lookup,mixed", wl_names, 3, o_workloads, "-w");
+  o_num_keys = parse_nums("500,20000,500000,4000000", o_keys, "-n");
+  o_num_dists = parse_names("uniform,zipf", dist_names, 2, o_dists, "-d");
+  o_num_key_types = parse_names("bin,str", kt_names, 2, o_key_types, "-k");
+  o_num_layouts = parse_names("chained,robinhood,group", layout_names, 3, o_layouts, "-l");
+  o_ops = 1000000;
+  o_num_miss_pcts = parse_nums("10,90", o_miss_pcts, "-m");
+  o_num_read_pcts = parse_nums("90,50", o_read_pcts, "-r");
+  o_theta = 0.99;
+  o_format = FMT_TEXT;
+
+  /* Since this is Unix and Windows, don't use getopts(). */
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0) {
+      help();  exit(0);
+
+    } else if (strcmp(argv[i], "-s") == 0) {
+      o_smoke = 1;
+
+    } else if (strcmp(argv[i], "-p") == 0) {
+      o_perf = 1;
+
+    } else if (argv[i][0] == '-' && argv[i][1] && argv[i][2] == '\0' && strchr("wndklomrzf", argv[i][1])) {
+      const char *opt = argv[i];
+      const char *arg;
+      int formats[3];  /* Takes just one, but parse_names() may return up to 3. */
+      if ((i + 1) < argc) {
+        i++;
+        arg = argv[i];
+      } else { fprintf(stderr, "Error, %s requires a value\n", opt);  exit(1); }
+      switch (opt[1]) {
+        case 'w': o_num_workloads = parse_names(arg, wl_names, 3, o_workloads, opt); break;
+        case 'n': o_num_keys = parse_nums(arg, o_keys, opt); keys_given = 1; break;
+        case 'd': o_num_dists = parse_names(arg, dist_names, 2, o_dists, opt); break;
+        case 'k': o_num_key_types = parse_names(arg, kt_names, 2, o_key_types, opt); break;
+        case 'l': o_num_layouts = parse_names(arg, layout_names, 3, o_layouts, opt); break;
+        case 'o': o_ops = (size_t)strtoull(arg, NULL, 10); ops_given = 1; break;
+        case 'm': o_num_miss_pcts = parse_nums(arg, o_miss_pcts, opt); break;
+        case 'r': o_num_read_pcts = parse_nums(arg, o_read_pcts, opt); break;
+        case 'z': o_theta = atof(arg); break;
+        case 'f':
+          if (parse_names(arg, fmt_names, 3, formats, opt) != 1) { fprintf(stderr, "Error, bad value for %s\n", opt);  exit(1); }
+          o_format = formats[0];
+          break;
+      }
+
+    } else { fprintf(stderr, "Error, unknown option '%s'\n", argv[i]);  exit(1); }
+  }  /* for i */
+
+  if (o_smoke && !keys_given) {
+    o_num_keys = parse_nums("500,20000", o_keys, "-s");
+  }
+  if (o_smoke && !ops_given) {
+    o_ops = 20000;
+  }
+  if (o_ops == 0) usage("Error, -o must be positive");
+  if (!(o_theta > 0 && o_theta < 1)) usage("Error, -z must be between 0 and 1");
+  for (i = 0; i < o_num_keys; i++) {
+    if (o_keys[i] == 0 || o_keys[i] >= OP_FLAG) usage("Error, bad -n value");
+  }
+  for (i = 0; i < o_num_miss_pcts; i++) {
+    if (o_miss_pcts[i] > 100) usage("Error, -m values are percents");
+  }
+  for (i = 0; i < o_num_read_pcts; i++) {
+    if (o_read_pcts[i] > 100) usage("Error, -r values are percents");
+  }
+}  /* parse_cmdline */
+
+
+/* xorshift64*: fast, and good enough for picking keys. */
+uint64_t rand_next(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}  /* rand_next */
+
+
+/* Uniform in [0, 1). */
+double rand_unit(uint64_t *state) {
+  return (double)(rand_next(state) >> 11) / (double)(1ULL << 53);
+}  /* rand_unit */
+
+
+/* Zipfian ranks in [0, n), rank 0 the most popular (Gray et al.,
+ * "Quickly Generating Billion-Record Synthetic Databases", as in YCSB). */
+typedef struct zipf_s {
+  size_t n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+} zipf_t;
+
+
+void zipf_init(zipf_t *zipf, size_t n, double theta) {
+  double zeta2 = 1.0 + pow(0.5, theta);
+  size_t i;
+
+  zipf->n = n;
+  zipf->theta = theta;
+  zipf->alpha = 1.0 / (1.0 - theta);
+  zipf->zetan = 0;
+  for (i = 1; i <= n; i++) {
+    zipf->zetan += 1.0 / pow((double)i, theta);
+  }
+  zipf->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+}  /* zipf_init */
+
+
+size_t zipf_next(const zipf_t *zipf, uint64_t *state) {
+  double u = rand_unit(state);
+  double uz = u * zipf->zetan;
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < 1.0 + pow(0.5, zipf->theta)) {
+    return 1;
+  }
+  size_t rank = (size_t)((double)zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+  return (rank < zipf->n) ? rank : zipf->n - 1;
+}  /* zipf_next */
+
+
+/* Keys 0 to num_keys - 1 are in the map; their misses are not. Binary
+ * keys are even (misses set the low bit); string keys start with 'k'
+ * (misses with 'm'). */
+typedef struct keyset_s {
+  int key_type;
+  size_t num_keys;
+  uint64_t *bin;
+  char *str;  /* num_keys hits, then num_keys misses, STR_KEY_SIZE apart. */
+} keyset_t;
+
+#define STR_KEY(str__keyset, str__i) ((str__keyset)->str + (size_t)(str__i) * STR_KEY_SIZE)
+
+
+void keyset_init(keyset_t *keyset, int key_type, size_t num_keys) {
+  size_t i;
+
+  keyset->key_type = key_type;
+  keyset->num_keys = num_keys;
+  keyset->bin = NULL;
+  keyset->str = NULL;
+  if (key_type == KT_BIN) {
+    keyset->bin = malloc(num_keys * sizeof(uint64_t));
+    ASSRT(keyset->bin);
+    for (i = 0; i < num_keys; i++) {
+      keyset->bin[i] = hmap_fmix64(i + 1) & ~(uint64_t)1;
+    }
+  } else {
+    keyset->str = malloc(2 * num_keys * STR_KEY_SIZE);
+    ASSRT(keyset->str);
+    for (i = 0; i < num_keys; i++) {
+      unsigned long long mixed = (unsigned long long)hmap_fmix64(i + 1);
+      snprintf(STR_KEY(keyset, i), STR_KEY_SIZE, "k%016llx", mixed);
+      snprintf(STR_KEY(keyset, num_keys + i), STR_KEY_SIZE, "m%016llx", mixed);
+    }
+  }
+}  /* keyset_init */
+
+
+void keyset_free(keyset_t *keyset) {
+  free(keyset->bin);
+  free(keyset->str);
+}  /* keyset_free */
+
+
+/* Fill "ops" with key indexes: every key once in a shuffled order (load),
+ * or drawn from the distribution, with OP_FLAG set on flag_pct percent. */
+void ops_init(uint32_t *ops, size_t num_ops, int workload, size_t num_keys, int dist,
+    const zipf_t *zipf, size_t flag_pct) {
+  uint64_t state = 0x9E3779B97F4A7C15ULL;
+  size_t i;
+
+  if (workload == WL_LOAD) {
+    for (i = 0; i < num_ops; i++) {
+      ops[i] = (uint32_t)i;
+    }
+    for (i = num_ops - 1; i > 0; i--) {
+      size_t j = rand_next(&state) % (i + 1);
+      uint32_t swap = ops[i];
+      ops[i] = ops[j];
+      ops[j] = swap;
+    }
+    return;
+  }
+
+  for (i = 0; i < num_ops; i++) {
+    size_t key;
+    if (dist == DIST_ZIPF) {
+      /* Scatter the popular ranks across the key set. */
+      key = (size_t)(hmap_fmix64(zipf_next(zipf, &state)) % num_keys);
+    } else {
+      key = (size_t)(rand_next(&state) % num_keys);
+    }
+    ops[i] = (uint32_t)key;
+    if (rand_next(&state) % 100 < flag_pct) {
+      ops[i] |= OP_FLAG;
+    }
+  }
+}  /* ops_init */
+
+
+void map_create(hmap_t **rtn_hmap, int layout, size_t table_size) {
+  hmap_options_t options;
+  hmap_options_init(&options);
+  options.layout = layout;
+  options.max_load = (layout == HMAP_LAYOUT_CHAINED) ? 1.0 : 0;  /* 0: open addressing default. */
+  E(hmap_create_opts(rtn_hmap, table_size, &options));
+}  /* map_create */
+
+
+/* Run the operations, storing each one's latency in "lat" if not NULL.
+ * Returns the elapsed time. */
+uint64_t ops_run(hmap_t *hmap, const keyset_t *keyset, int workload, const uint32_t *ops,
+    size_t num_ops, uint32_t *lat) {
+  uint64_t found = 0;
+  uint64_t start_ns = now_ns();
+  uint64_t prev_ns = start_ns;
+  size_t i;
+  void *val;
+
+  for (i = 0; i < num_ops; i++) {
+    uint32_t op = ops[i];
+    size_t key = op & ~OP_FLAG;
+    int flag = (op & OP_FLAG) != 0;
+    /* Load: insert. Lookup: hit, or miss if flagged. Mixed: hit, or overwrite if flagged. */
+    int write = (workload == WL_LOAD) || (workload == WL_MIXED && flag);
+    int miss = (workload == WL_LOOKUP && flag);
+
+    if (keyset->key_type == KT_BIN) {
+      uint64_t bin_key = keyset->bin[key] | (uint64_t)miss;
+      if (write) {
+        E(hmap_write(hmap, &bin_key, sizeof(bin_key), (void *)(uintptr_t)(key + 1)));
+      } else {
+        found += hmap_try_lookup(hmap, &bin_key, sizeof(bin_key), &val);
+      }
+    } else {
+      const char *str_key = STR_KEY(keyset, miss ? keyset->num_keys + key : key);
+      if (write) {
+        E(hmap_swrite(hmap, str_key, (void *)(uintptr_t)(key + 1)));
+      } else {
+        found += hmap_try_slookup(hmap, str_key, &val);
+      }
+    }
+
+    if (lat) {
+      uint64_t op_ns = now_ns();
+      lat[i] = (op_ns - prev_ns > UINT32_MAX) ? UINT32_MAX : (uint32_t)(op_ns - prev_ns);
+      prev_ns = op_ns;
+    }
+  }
+
+  sink += found;
+  return now_ns() - start_ns;
+}  /* ops_run */
+
+
+/* Open the counters, disabled, for this thread in user mode (which
+ * perf_event_paranoid 2 allows). Any that can't be opened, e.g. in a
+ * container or VM without access to the PMU, are reported as missing. */
+void perf_init() {
+  int num_open = 0;
+  int open_errno = 0;
+  int c;
+
+  for (c = 0; c < PERF_NUM; c++) {
+    perf_fds[c] = -1;
+  }
+#if defined(__linux__)
+  {
+    static const uint32_t types[PERF_NUM] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    static const uint64_t configs[PERF_NUM] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES};
+    for (c = 0; c < PERF_NUM; c++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[c];
+      attr.config = configs[c];
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      /* Counters may be multiplexed; these let perf_stop() scale them. */
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      perf_fds[c] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+      if (perf_fds[c] >= 0) {
+        num_open++;
+      } else {
+        open_errno = errno;
+      }
+    }
+  }
+#endif
+
+  if (num_open < PERF_NUM) {
+    fprintf(stderr, "Note: %d of %d hardware counters unavailable (%s); reporting them as missing.\n",
+        PERF_NUM - num_open, PERF_NUM, open_errno ? strerror(open_errno) : "not supported on this platform");
+  }
+}  /* perf_init */
+
+
+void perf_start() {
+#if defined(__linux__)
+  int c;
+  for (c = 0; c < PERF_NUM; c++) {
+    if (perf_fds[c] >= 0) {
+      ioctl(perf_fds[c], PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf_fds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#endif
+}  /* perf_start */
+
+
+/* Counts since perf_start(), divided by "num_ops" (-1 if missing). */
+void perf_stop(double *rtn_per_op, size_t num_ops) {
+  int c;
+  for (c = 0; c < PERF_NUM; c++) {
+    rtn_per_op[c] = -1;
+  }
+#if defined(__linux__)
+  for (c = 0; c < PERF_NUM; c++) {
+    if (perf_fds[c] >= 0) {
+      ioctl(perf_fds[c], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  for (c = 0; c < PERF_NUM; c++) {
+    uint64_t vals[3];  /* Value, time enabled, time running. */
+    if (perf_fds[c] >= 0 && read(perf_fds[c], vals, sizeof(vals)) == (ssize_t)sizeof(vals) && vals[2] > 0) {
+      rtn_per_op[c] = (double)vals[0] * ((double)vals[1] / (double)vals[2]) / (double)num_ops;
+    }
+  }
+#else
+  (void)num_ops;
+#endif
+}  /* perf_stop */
+
+
+int lat_cmp(const void *a, const void *b) {
+  uint32_t lat_a = *(const uint32_t *)a;
+  uint32_t lat_b = *(const uint32_t *)b;
+  return (lat_a > lat_b) - (lat_a < lat_b);
+}  /* lat_cmp */
+
+
+void result_print(const result_t *result) {
+  int c;
+
+  if (o_format == FMT_TEXT) {
+    if (num_results == 0) {
+      printf("%-7s %-10s %-4s %9s %-8s %4s %9s %9s %12s %8s %8s %8s", "workld", "layout", "key",
+          "keys", "dist", "pct", "ops", "ns/op", "ops/sec", "p50", "p99", "p999");
+      for (c = 0; o_perf && c < PERF_NUM; c++) {
+        printf(" %8s", perf_short_names[c]);
+      }
+      printf("\n");
+    }
+    printf("%-7s %-10s %-4s %9lu %-8s %4lu %9lu %9.1f %12.0f %8lu %8lu %8lu", wl_names[result->workload],
+        layout_names[result->layout], kt_names[result->key_type], (unsigned long)result->keys,
+        result->dist, (unsigned long)result->pct, (unsigned long)result->ops, result->ns_per_op,
+        result->ops_per_sec, (unsigned long)result->p50_ns, (unsigned long)result->p99_ns,
+        (unsigned long)result->p999_ns);
+    for (c = 0; o_perf && c < PERF_NUM; c++) {
+      if (result->perf[c] < 0) {
+        printf(" %8s", "-");
+      } else {
+        printf(" %8.2f", result->perf[c]);
+      }
+    }
+    printf("\n");
+  } else if (o_format == FMT_CSV) {
+    if (num_results == 0) {
+      printf("workload,layout,key_type,keys,dist,pct,ops,ns_per_op,ops_per_sec,p50_ns,p99_ns,p999_ns");
+      for (c = 0; o_perf && c < PERF_NUM; c++) {
+        printf(",%s_per_op", perf_names[c]);
+      }
+      printf("\n");
+    }
+    printf("%s,%s,%s,%lu,%s,%lu,%lu,%.1f,%.0f,%lu,%lu,%lu", wl_names[result->workload],
+        layout_names[result->layout], kt_names[result->key_type], (unsigned long)result->keys,
+        result->dist, (unsigned long)result->pct, (unsigned long)result->ops, result->ns_per_op,
+        result->ops_per_sec, (unsigned long)result->p50_ns, (unsigned long)result->p99_ns,
+        (unsigned long)result->p999_ns);
+    for (c = 0; o_perf && c < PERF_NUM; c++) {
+      if (result->perf[c] < 0) {
+        printf(",");  /* Missing. */
+      } else {
+        printf(",%.3f", result->perf[c]);
+      }
+    }
+    printf("\n");
+  } else {
+    printf("%s{\"workload\":\"%s\",\"layout\":\"%s\",\"key_type\":\"%s\",\"keys\":%lu,\"dist\":\"%s\","
+        "\"pct\":%lu,\"ops\":%lu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f,"
+        "\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu", (num_results == 0) ? "[\n" : ",\n",
+        wl_names[result->workload], layout_names[result->layout], kt_names[result->key_type],
+        (unsigned long)result->keys, result->dist, (unsigned long)result->pct,
+        (unsigned long)result->ops, result->ns_per_op, result->ops_per_sec,
+        (unsigned long)result->p50_ns, (unsigned long)result->p99_ns, (unsigned long)result->p999_ns);
+    for (c = 0; o_perf && c < PERF_NUM; c++) {
+      if (result->perf[c] < 0) {
+        printf(",\"%s_per_op\":null", perf_names[c]);
+      } else {
+        printf(",\"%s_per_op\":%.3f", perf_names[c], result->perf[c]);
+      }
+    }
+    printf("}");
+  }
+  fflush(stdout);
+  num_results++;
+}  /* result_print */
+
+
+/* Time one workload on "hmap" (a load makes its own maps and leaves the
+ * last one in *hmap_ptr). */
+void bench_one(hmap_t **hmap_ptr, const keyset_t *keyset, int layout, int workload, int dist,
+    const zipf_t *zipf, size_t pct) {
+  size_t num_ops = (workload == WL_LOAD) ? keyset->num_keys : o_ops;
+  uint32_t *ops = malloc(num_ops * sizeof(uint32_t));
+  uint32_t *lat = malloc(num_ops * sizeof(uint32_t));
+  result_t result;
+  uint64_t elapsed_ns;
+  ASSRT(ops && lat);
+  memset(&result, 0, sizeof(result));
+
+  /* Mixed runs take "pct" as the read share; flagged ops are the writes. */
+  ops_init(ops, num_ops, workload, keyset->num_keys, dist, zipf, (workload == WL_MIXED) ? 100 - pct : pct);
+
+  if (workload == WL_LOAD) {
+    map_create(hmap_ptr, layout, LOAD_TABLE_SIZE);
+  }
+  if (o_perf) {
+    perf_start();
+  }
+  elapsed_ns = ops_run(*hmap_ptr, keyset, workload, ops, num_ops, NULL);
+  if (o_perf) {
+    perf_stop(result.perf, num_ops);
+  }
+  if (workload == WL_LOAD) {
+    E(hmap_delete(*hmap_ptr));
+    map_create(hmap_ptr, layout, LOAD_TABLE_SIZE);
+  }
+  ops_run(*hmap_ptr, keyset, workload, ops, num_ops, lat);
+  qsort(lat, num_ops, sizeof(uint32_t), lat_cmp);
+
+  result.workload = workload;
+  result.layout = layout;
+  result.key_type = keyset->key_type;
+  result.keys = keyset->num_keys;
+  result.dist = (workload == WL_LOAD) ? "-" : dist_names[dist];
+  result.pct = (workload == WL_LOAD) ? 0 : pct;
+  result.ops = num_ops;
+  result.ns_per_op = (double)elapsed_ns / (double)num_ops;
+  result.ops_per_sec = (elapsed_ns > 0) ? (double)num_ops * 1e9 / (double)elapsed_ns : 0;
+  result.p50_ns = lat[num_ops / 2];
+  result.p99_ns = lat[(size_t)((double)num_ops * 0.99)];
+  result.p999_ns = lat[(size_t)((double)num_ops * 0.999)];
+  result_print(&result);
+
+  free(ops);
+  free(lat);
+}  /* bench_one */
+
+
+int main(int argc, char **argv) {
+  int l, k, n, d, w, p;
+
+  parse_cmdline(argc, argv);
+  if (o_perf) {
+    perf_init();
+  }
+
+  for (l = 0; l < o_num_layouts; l++) {
+    for (k = 0; k < o_num_key_types; k++) {
+      for (n = 0; n < o_num_keys; n++) {
+        keyset_t keyset;
+        hmap_t *hmap = NULL;
+        zipf_t zipf;
+        int wants_load = 0;
+        keyset_init(&keyset, o_key_types[k], o_keys[n]);
+        zipf_init(&zipf, o_keys[n], o_theta);
+
+        for (w = 0; w < o_num_workloads; w++) {
+          wants_load |= (o_workloads[w] == WL_LOAD);
+        }
+        if (wants_load) {
+          bench_one(&hmap, &keyset, o_layouts[l], WL_LOAD, DIST_UNIFORM, &zipf, 0);
+        } else {
+          /* Just build the map, untimed. */
+          uint32_t *ops = malloc(o_keys[n] * sizeof(uint32_t));
+          ASSRT(ops);
+          ops_init(ops, o_keys[n], WL_LOAD, o_keys[n], DIST_UNIFORM, &zipf, 0);
+          map_create(&hmap, o_layouts[l], LOAD_TABLE_SIZE);
+          ops_run(hmap, &keyset, WL_LOAD, ops, o_keys[n], NULL);
+          free(ops);
+        }
+
+        for (d = 0; d < o_num_dists; d++) {
+          for (w = 0; w < o_num_workloads; w++) {
+            if (o_workloads[w] == WL_LOOKUP) {
+              for (p = 0; p < o_num_miss_pcts; p++) {
+                bench_one(&hmap, &keyset, o_layouts[l], WL_LOOKUP, o_dists[d], &zipf, o_miss_pcts[p]);
+              }
+            } else if (o_workloads[w] == WL_MIXED) {
+              for (p = 0; p < o_num_read_pcts; p++) {
+                bench_one(&hmap, &keyset, o_layouts[l], WL_MIXED, o_dists[d], &zipf, o_read_pcts[p]);
+              }
+            }
+          }
+        }
+
+        E(hmap_delete(hmap));
+        keyset_free(&keyset);
+      }
+    }
+  }
+
+  if (o_format == FMT_JSON) {
+    printf("%s]\n", (num_results == 0) ? "[" : "\n");
+  }
+  return 0;
+}  /* main */
@@ -0,0 +1,322 @@
+/* hmap_cpp_test.cpp - tests of the C++ wrappers. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/hmap
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "err.h"
+#include "hmap_int.h"
+#include "hmap.hpp"
+
+#define E(e__test) do { \
+  err_t *e__err = (e__test); \
+  if (e__err != ERR_OK) { \
+    printf("ERROR [%s:%d]: '%s' returned error\n", __FILE__, __LINE__, #e__test); \
+    ERR_ABRT_ON_ERR(e__err, stdout); \
+    exit(1); \
+  } \
+} while (0)
+
+#define ASSRT(assrt__cond) do { \
+  if (! (assrt__cond)) { \
+    printf("ERROR [%s:%d]: assert '%s' failed\n", __FILE__, __LINE__, #assrt__cond); \
+    exit(1); \
+  } \
+} while (0)
+
+
+/* hmap::int_map. */
+void test1() {
+  hmap::int_map<uint64_t> map64;
+  hmap::int_map<uint32_t> map32;
+  hmap::int_map<uint64_t>::entry_t *entry;
+  uint64_t k;
+  int count;
+  void *v;
+
+  ASSRT(map64.size() == 0);  /* Not created yet. */
+  v = (void *)1;
+  ASSRT(!map64.try_lookup(1, &v) && v == NULL);
+
+  E(map64.create(10));
+  for (k = 0; k < 10000; k++) {
+    E(map64.write(k * 1000003, (void *)(uintptr_t)(k + 1)));
+  }
+  ASSRT(map64.size() == 10000);
+  for (k = 0; k < 10000; k++) {
+    ASSRT(map64.try_lookup(k * 1000003, &v));
+    ASSRT(v == (void *)(uintptr_t)(k + 1));
+  }
+  ASSRT(!map64.try_lookup(1, &v));
+
+  count = 0;
+  entry = NULL;
+  do {
+    E(map64.next(&entry));
+    if (entry) {
+      count++;
+    }
+  } while (entry);
+  ASSRT(count == 10000);
+
+  E(map32.create(10));
+  E(map32.write(5, (void *)5));
+  ASSRT(map32.try_lookup(5, &v) && v == (void *)5);
+  ASSRT(map32.c_map()->num_entries == 1);
+}  /* test1 */
+
+
+/* Counts live instances, to check that the map constructs and destroys
+ * values exactly once. */
+struct counted {
+  static int live;
+  int val;
+  counted() : val(0) { live++; }
+  explicit counted(int in_val) : val(in_val) { live++; }
+  counted(const counted &other) : val(other.val) { live++; }
+  counted(counted &&other) noexcept : val(other.val) { live++; }
+  counted &operator=(const counted &other) { val = other.val; return *this; }
+  ~counted() { live--; }
+};
+int counted::live = 0;
+
+struct nocase_hash {
+  uint32_t operator()(const std::string &key) const {
+    std::string lower(key);
+    for (size_t i = 0; i < lower.size(); i++) {
+      lower[i] = (char)tolower((unsigned char)lower[i]);
+    }
+    return hmap_murmur3_32_inline(lower.data(), lower.size(), 42);
+  }
+};
+
+struct nocase_eq {
+  bool operator()(const std::string &a, const std::string &b) const {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+      if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+
+/* hmap::map. */
+void test2() {
+  uint64_t k;
+
+  {
+    hmap::map<uint64_t, counted> map(4);
+    for (k = 0; k < 10000; k++) {
+      ASSRT(map.insert(k << 32, counted((int)k)));
+    }
+    ASSRT(map.size() == 10000);
+    ASSRT(map.table_size() >= 10000 / HMAP_OPEN_DEFAULT_LOAD);
+    ASSRT(counted::live == 10000);
+    for (k = 0; k < 10000; k++) {
+      counted *v = map.find(k << 32);
+      ASSRT(v && v->val == (int)k);
+      ASSRT(map.find((k << 32) + 1) == NULL);
+    }
+    ASSRT(!map.insert(0, counted(-1)));  /* Overwrite. */
+    ASSRT(map.find(0)->val == -1);
+    ASSRT(map.size() == 10000 && counted::live == 10000);
+
+    map[7].val = 7;  /* New key. */
+    map[7].val++;
+    ASSRT(map.find(7)->val == 8);
+    ASSRT(map.size() == 10001);
+
+    int count = 0;
+    for (hmap::map<uint64_t, counted>::iterator it = map.begin(); it != map.end(); ++it) {
+      ASSRT(map.find(it->key) == &it->value);
+      it->value.val++;  /* Values can be changed; keys are const. */
+      ASSRT(map.find(it->key) == &(*it).value);
+      count++;
+    }
+    ASSRT(count == 10001);
+    ASSRT(map.find(7)->val == 9);
+    const hmap::map<uint64_t, counted> &cmap = map;
+    count = 0;
+    for (hmap::map<uint64_t, counted>::const_iterator it = cmap.begin(); it != cmap.end(); ++it) {
+      ASSRT(cmap.find(it->key) == &it->value);
+      count++;
+    }
+    ASSRT(count == 10001);
+    count = 0;
+    for (const auto &e : map) {
+      ASSRT(map.find(e.key) == &e.value);
+      count++;
+    }
+    ASSRT(count == 10001);
+
+    /* Move construct and assign. */
+    hmap::map<uint64_t, counted> map2(std::move(map));
+    ASSRT(map2.size() == 10001 && map.size() == 0);
+    ASSRT(map.find(7) == NULL);
+    ASSRT(counted::live == 10001);
+    map = std::move(map2);
+    ASSRT(map.find(7)->val == 9);
+    map2.insert(1, counted(1));  /* Moved-from maps are usable. */
+    ASSRT(map2.find(1)->val == 1);
+    ASSRT(counted::live == 10002);
+  }
+  ASSRT(counted::live == 0);
+
+  /* Move-only values, string keys. */
+  {
+    hmap::map<std::string, std::unique_ptr<int> > map;
+    ASSRT(map.insert("one", std::unique_ptr<int>(new int(1))));
+    std::unique_ptr<int> two(new int(2));
+    ASSRT(map.insert("two", std::move(two)));
+    ASSRT(**map.find("one") == 1 && **map.find("two") == 2);
+    ASSRT(map.find("three") == NULL);
+    const hmap::map<std::string, std::unique_ptr<int> > &cmap = map;
+    ASSRT(**cmap.find("two") == 2);
+  }
+
+  /* User hash and equality. */
+  {
+    hmap::map<std::string, int, nocase_hash, nocase_eq> map;
+    map.insert("Hello", 1);
+    ASSRT(*map.find("HELLO") == 1);
+    ASSRT(!map.insert("hello", 2));
+    ASSRT(map.size() == 1 && *map.find("Hello") == 2);
+  }
+
+  /* std::hash works too. */
+  {
+    hmap::map<int, int, std::hash<int> > map(1, 0.5);
+    int i;
+    for (i = 0; i < 1000; i++) {
+      map[i] = i * 2;
+    }
+    for (i = 0; i < 1000; i++) {
+      ASSRT(*map.find(i) == i * 2);
+    }
+  }
+
+  bool threw = false;
+  try {
+    hmap::map<int, int> map(16, 1.0);
+  } catch (std::invalid_argument &) {
+    threw = true;
+  }
+  ASSRT(threw);
+}  /* test2 */
+
+
+static uint64_t now_ns() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}  /* now_ns */
+
+
+/* Benchmark: hmap::map vs. std::unordered_map. Keys are random, and are
+ * looked up in a different order than they were inserted, so neither map
+ * gets an unrealistically cache-friendly access pattern. */
+void test3() {
+  const size_t num_keys = 1000000;
+  std::unique_ptr<uint64_t[]> keys(new uint64_t[num_keys]);
+  std::unique_ptr<uint64_t[]> lookup_keys(new uint64_t[num_keys]);
+  hmap::map<uint64_t, uint64_t> hmap_map;
+  std::unordered_map<uint64_t, uint64_t> std_map;
+  size_t i;
+  uint64_t sum = 0;
+  uint64_t start_ns, hmap_insert_ns, hmap_hit_ns, hmap_miss_ns;
+  uint64_t std_insert_ns, std_hit_ns, std_miss_ns;
+
+  for (i = 0; i < num_keys; i++) {
+    keys[i] = hmap_fmix64(i + 1) & ~(uint64_t)1;  /* Even; misses are odd. */
+  }
+  for (i = 0; i < num_keys; i++) {
+    lookup_keys[i] = keys[(i * 7919) % num_keys];
+  }
+
+  start_ns = now_ns();
+  for (i = 0; i < num_keys; i++) {
+    hmap_map.insert(keys[i], i);
+  }
+  hmap_insert_ns = now_ns() - start_ns;
+  start_ns = now_ns();
+  for (i = 0; i < num_keys; i++) {
+    sum += *hmap_map.find(lookup_keys[i]);
+  }
+  hmap_hit_ns = now_ns() - start_ns;
+  start_ns = now_ns();
+  for (i = 0; i < num_keys; i++) {
+    sum += (hmap_map.find(lookup_keys[i] + 1) != NULL);
+  }
+  hmap_miss_ns = now_ns() - start_ns;
+
+  start_ns = now_ns();
+  for (i = 0; i < num_keys; i++) {
+    std_map.insert(std::make_pair(keys[i], (uint64_t)i));
+  }
+  std_insert_ns = now_ns() - start_ns;
+  start_ns = now_ns();
+  for (i = 0; i < num_keys; i++) {
+    sum += std_map.find(lookup_keys[i])->second;
+  }
+  std_hit_ns = now_ns() - start_ns;
+  start_ns = now_ns();
+  for (i = 0; i < num_keys; i++) {
+    sum += (std_map.find(lookup_keys[i] + 1) != std_map.end());
+  }
+  std_miss_ns = now_ns() - start_ns;
+
+  printf("map,insert_ns,hit_ns,miss_ns\n");
+  printf("hmap::map,%.1f,%.1f,%.1f\n", (double)hmap_insert_ns / num_keys,
+      (double)hmap_hit_ns / num_keys, (double)hmap_miss_ns / num_keys);
+  printf("std::unordered_map,%.1f,%.1f,%.1f\n", (double)std_insert_ns / num_keys,
+      (double)std_hit_ns / num_keys, (double)std_miss_ns / num_keys);
+  printf("(checksum %lu)\n", (unsigned long)sum);
+}  /* test3 */
+
+
+int main(int argc, char **argv) {
+  int o_testnum = 0;
+  if (argc == 3 && strcmp(argv[1], "-t") == 0) {
+    o_testnum = atoi(argv[2]);
+  } else if (argc != 1) {
+    fprintf(stderr, "Usage: hmap_cpp_test [-t testnum]\n"
+        "  benchmark [3] only runs when selected.\n");
+    exit(1);
+  }
+
+  if (o_testnum == 0 || o_testnum == 1) {
+    test1();
+    printf("cpp test1: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 2) {
+    test2();
+    printf("cpp test2: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 3) {
+    test3();
+    printf("cpp test3: success\n"); fflush(stdout);
+  }
+
+  return 0;
+}  /* main */
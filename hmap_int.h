@@ -0,0 +1,311 @@
+/* hmap_int.h - integer-key hashmaps generated by macro. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/hmap
+ */
+
+/* HMAP_INT_DEFINE(name, key_type, val_type, mix) generates a map type
+ * "name_t" and static inline functions "name_create()", "name_write()",
+ * etc. that mirror the hmap_t API, but take keys by value. Keys are stored
+ * in the slot, hashed with "mix" (uint32_t mix(key_type key, uint32_t seed))
+ * and compared with "==". The table is open addressed (linear probing),
+ * and grows all at once like the HMAP_LAYOUT_ROBINHOOD and
+ * HMAP_LAYOUT_GROUP layouts.
+ *
+ * hmap_u32_t and hmap_u64_t (keys of uint32_t and uint64_t, values of
+ * void *) are defined here. */
+
+#ifndef HMAP_INT_H
+#define HMAP_INT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "err.h"
+#include "hmap.h"
+#include "hmap_murmur3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Integer mixers. The full avalanche matters because buckets come from
+ * the low bits, and integer keys are often sequential or strided. */
+static inline uint32_t hmap_int_mix32(uint32_t key, uint32_t seed) {
+    uint32_t h = key ^ seed;
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
+}  /* hmap_int_mix32 */
+
+static inline uint32_t hmap_int_mix64(uint64_t key, uint32_t seed) {
+    return (uint32_t)hmap_fmix64(key ^ seed);
+}  /* hmap_int_mix64 */
+
+
+#define HMAP_INT_DEFINE(name, key_type, val_type, mix) \
+ \
+typedef struct name##_entry_s name##_entry_t; \
+struct name##_entry_s { \
+    key_type key; \
+    val_type value; \
+}; \
+ \
+typedef struct name##_s name##_t; \
+struct name##_s { \
+    size_t table_size; \
+    uint32_t seed; \
+    int num_entries; \
+    uint64_t reduce_m;  /* hmap_reduce_init(table_size). */ \
+    double max_load; \
+    name##_entry_t *slots; \
+    uint8_t *used;  /* Non-zero for occupied slots. */ \
+}; \
+ \
+/* Options as for hmap_create_opts(); only max_load (0 selects \
+ * HMAP_OPEN_DEFAULT_LOAD), pow2 and seed apply. */ \
+static inline ERR_F name##_create(name##_t **rtn_map, size_t table_size, const hmap_options_t *options) { \
+    hmap_options_t default_options; \
+    ERR_ASSRT(rtn_map, HMAP_ERR_PARAM); \
+    *rtn_map = NULL; \
+    ERR_ASSRT(table_size > 0, HMAP_ERR_PARAM); \
+    ERR_ASSRT(table_size <= HMAP_MAX_TABLE_SIZE, HMAP_ERR_PARAM); \
+    if (options == NULL) { \
+        hmap_options_init(&default_options); \
+        options = &default_options; \
+    } \
+    ERR_ASSRT(options->max_load >= 0 && options->max_load < 1, HMAP_ERR_PARAM); \
+ \
+    if (options->pow2) { \
+        size_t pow2_size = 1; \
+        while (pow2_size < table_size) { \
+            pow2_size *= 2; \
+        } \
+        table_size = pow2_size; \
+    } \
+    name##_t *map = (name##_t *)calloc(1, sizeof(name##_t)); \
+    ERR_ASSRT(map, HMAP_ERR_NOMEM); \
+    map->table_size = table_size; \
+    map->seed = options->seed; \
+    map->reduce_m = hmap_reduce_init(table_size); \
+    map->max_load = (options->max_load == 0) ? HMAP_OPEN_DEFAULT_LOAD : options->max_load; \
+    map->slots = (name##_entry_t *)malloc(table_size * sizeof(name##_entry_t)); \
+    map->used = (uint8_t *)calloc(table_size, 1); \
+    if (!map->slots || !map->used) { \
+        free(map->slots); \
+        free(map->used); \
+        free(map); \
+        ERR_THROW(HMAP_ERR_NOMEM, "map->slots"); \
+    } \
+ \
+    *rtn_map = map; \
+    return ERR_OK; \
+}  /* name##_create */ \
+ \
+static inline ERR_F name##_delete(name##_t *map) { \
+    ERR_ASSRT(map, HMAP_ERR_PARAM); \
+    free(map->slots); \
+    free(map->used); \
+    free(map); \
+    return ERR_OK; \
+}  /* name##_delete */ \
+ \
+/* Returns the key's slot, or the empty slot where it would go. */ \
+static inline size_t name##_find_slot(const name##_entry_t *slots, const uint8_t *used, \
+        size_t table_size, uint64_t reduce_m, key_type key, uint32_t seed) { \
+    size_t slot = hmap_reduce(mix(key, seed), table_size, reduce_m); \
+    /* The load factor is < 1, so there is always an empty slot to stop at. */ \
+    while (used[slot] && slots[slot].key != key) { \
+        slot++; \
+        if (slot == table_size) { \
+            slot = 0; \
+        } \
+    } \
+    return slot; \
+}  /* name##_find_slot */ \
+ \
+static inline ERR_F name##_grow(name##_t *map) { \
+    size_t new_size = map->table_size * 2; \
+    if (new_size > HMAP_MAX_TABLE_SIZE) { \
+        new_size = HMAP_MAX_TABLE_SIZE; \
+    } \
+    ERR_ASSRT(new_size > map->table_size, HMAP_ERR_NOMEM); \
+ \
+    uint64_t new_reduce_m = hmap_reduce_init(new_size); \
+    name##_entry_t *new_slots = (name##_entry_t *)malloc(new_size * sizeof(name##_entry_t)); \
+    uint8_t *new_used = (uint8_t *)calloc(new_size, 1); \
+    if (!new_slots || !new_used) { \
+        free(new_slots); \
+        free(new_used); \
+        ERR_THROW(HMAP_ERR_NOMEM, "new_slots"); \
+    } \
+ \
+    size_t slot; \
+    for (slot = 0; slot < map->table_size; slot++) { \
+        if (map->used[slot]) { \
+            size_t new_slot = name##_find_slot(new_slots, new_used, new_size, new_reduce_m, \
+                map->slots[slot].key, map->seed); \
+            new_slots[new_slot] = map->slots[slot]; \
+            new_used[new_slot] = 1; \
+        } \
+    } \
+ \
+    free(map->slots); \
+    free(map->used); \
+    map->slots = new_slots; \
+    map->used = new_used; \
+    map->table_size = new_size; \
+    map->reduce_m = new_reduce_m; \
+    return ERR_OK; \
+}  /* name##_grow */ \
+ \
+static inline ERR_F name##_write(name##_t *map, key_type key, val_type val) { \
+    ERR_ASSRT(map, HMAP_ERR_PARAM); \
+    size_t slot = name##_find_slot(map->slots, map->used, map->table_size, map->reduce_m, \
+        key, map->seed); \
+    if (map->used[slot]) { \
+        map->slots[slot].value = val; \
+        return ERR_OK; \
+    } \
+ \
+    if ((double)(map->num_entries + 1) > map->max_load * (double)map->table_size) { \
+        err_t *err = name##_grow(map); \
+        if (err) { \
+            /* Can limp along as long as there is a free slot left. */ \
+            if ((size_t)map->num_entries + 1 >= map->table_size) { \
+                ERR_RETHROW(err, "grow"); \
+            } \
+            err_dispose(err); \
+        } \
+        slot = name##_find_slot(map->slots, map->used, map->table_size, map->reduce_m, \
+            key, map->seed); \
+    } \
+ \
+    map->slots[slot].key = key; \
+    map->slots[slot].value = val; \
+    map->used[slot] = 1; \
+    map->num_entries ++; \
+    return ERR_OK; \
+}  /* name##_write */ \
+ \
+/* Never allocates; returns 1 if found, 0 (with a zeroed value) if not. */ \
+static inline int name##_try_lookup(const name##_t *map, key_type key, val_type *rtn_val) { \
+    size_t slot = name##_find_slot(map->slots, map->used, map->table_size, map->reduce_m, \
+        key, map->seed); \
+    if (!map->used[slot]) { \
+        if (rtn_val) { \
+            memset(rtn_val, 0, sizeof(*rtn_val)); \
+        } \
+        return 0; \
+    } \
+    if (rtn_val) { \
+        *rtn_val = map->slots[slot].value; \
+    } \
+    return 1; \
+}  /* name##_try_lookup */ \
+ \
+static inline ERR_F name##_lookup(const name##_t *map, key_type key, val_type *rtn_val) { \
+    ERR_ASSRT(map, HMAP_ERR_PARAM); \
+    if (!name##_try_lookup(map, key, rtn_val)) { \
+        ERR_THROW(HMAP_ERR_NOTFOUND, "key not found"); \
+    } \
+    return ERR_OK; \
+}  /* name##_lookup */ \
+ \
+/* Set *in_entry to NULL to start; it is NULL again after the last entry. \
+ * Writing a new key invalidates the iteration. */ \
+static inline ERR_F name##_next(const name##_t *map, name##_entry_t **in_entry) { \
+    ERR_ASSRT(map, HMAP_ERR_PARAM); \
+    ERR_ASSRT(in_entry, HMAP_ERR_PARAM); \
+    size_t slot = (*in_entry == NULL) ? 0 : (size_t)(*in_entry - map->slots) + 1; \
+    while (slot < map->table_size && !map->used[slot]) { \
+        slot++; \
+    } \
+    *in_entry = (slot < map->table_size) ? &map->slots[slot] : NULL; \
+    return ERR_OK; \
+}  /* name##_next */
+
+
+HMAP_INT_DEFINE(hmap_u32, uint32_t, void *, hmap_int_mix32)
+HMAP_INT_DEFINE(hmap_u64, uint64_t, void *, hmap_int_mix64)
+
+#ifdef __cplusplus
+}  /* extern "C" */
+
+
+/* C++ wrapper: hmap::int_map<uint32_t> and hmap::int_map<uint64_t>.
+ * Errors are returned as err_t objects, as in C. */
+namespace hmap {
+
+template <typename K> struct int_map_traits;
+
+template <> struct int_map_traits<uint32_t> {
+    typedef hmap_u32_t map_t;
+    typedef hmap_u32_entry_t entry_t;
+    static err_t *create(map_t **m, size_t s, const hmap_options_t *o) { return hmap_u32_create(m, s, o); }
+    static err_t *destroy(map_t *m) { return hmap_u32_delete(m); }
+    static err_t *write(map_t *m, uint32_t k, void *v) { return hmap_u32_write(m, k, v); }
+    static int try_lookup(const map_t *m, uint32_t k, void **v) { return hmap_u32_try_lookup(m, k, v); }
+    static err_t *next(const map_t *m, entry_t **e) { return hmap_u32_next(m, e); }
+};
+
+template <> struct int_map_traits<uint64_t> {
+    typedef hmap_u64_t map_t;
+    typedef hmap_u64_entry_t entry_t;
+    static err_t *create(map_t **m, size_t s, const hmap_options_t *o) { return hmap_u64_create(m, s, o); }
+    static err_t *destroy(map_t *m) { return hmap_u64_delete(m); }
+    static err_t *write(map_t *m, uint64_t k, void *v) { return hmap_u64_write(m, k, v); }
+    static int try_lookup(const map_t *m, uint64_t k, void **v) { return hmap_u64_try_lookup(m, k, v); }
+    static err_t *next(const map_t *m, entry_t **e) { return hmap_u64_next(m, e); }
+};
+
+template <typename K>
+class int_map {
+public:
+    typedef int_map_traits<K> traits;
+    typedef typename traits::entry_t entry_t;
+
+    int_map() : map_(NULL) {}
+    ~int_map() {
+        if (map_) {
+            err_t *err = traits::destroy(map_);
+            (void)err;  /* Only fails for a NULL map. */
+        }
+    }
+
+    ERR_F create(size_t table_size, const hmap_options_t *options = NULL) {
+        return traits::create(&map_, table_size, options);
+    }
+    ERR_F write(K key, void *val) { return traits::write(map_, key, val); }
+    bool try_lookup(K key, void **rtn_val) const {
+        if (!map_) {  /* Not created. */
+            if (rtn_val) {
+                *rtn_val = NULL;
+            }
+            return false;
+        }
+        return traits::try_lookup(map_, key, rtn_val) != 0;
+    }
+    ERR_F next(entry_t **in_entry) const { return traits::next(map_, in_entry); }
+    int size() const { return map_ ? map_->num_entries : 0; }
+    typename traits::map_t *c_map() { return map_; }
+
+private:
+    int_map(const int_map &);  /* Not copyable. */
+    int_map &operator=(const int_map &);
+    typename traits::map_t *map_;
+};
+
+}  /* namespace hmap */
+#endif  /* __cplusplus */
+
+#endif  /* HMAP_INT_H */
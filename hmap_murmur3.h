@@ -0,0 +1,155 @@
+/* hmap_murmur3.h - inline murmur3 hash functions. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/hmap
+ */
+
+/* Shared by hmap.c (which exports them as hmap_murmur3_32() and
+ * hmap_murmur3_x64_128()) and the header-only C++ map in hmap.hpp. */
+
+#ifndef HMAP_MURMUR3_H
+#define HMAP_MURMUR3_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Murmur3 32-bit hash function (MurmurHash3_x86_32). Blocks are read
+ * little-endian, so hashes match the reference implementation on
+ * little-endian machines. */
+static inline uint32_t hmap_murmur3_32_inline(const void *key, size_t key_len, uint32_t seed) {
+    const uint8_t *data = (const uint8_t*)key;
+    uint32_t h1 = seed;
+
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    const int r1 = 15;
+    const int r2 = 13;
+
+    /* Process 4-byte chunks. */
+    size_t nblocks = key_len / 4;
+    for (size_t i = 0; i < nblocks; i++) {
+        uint32_t k1;
+        memcpy(&k1, &data[i * 4], sizeof(k1));  /* Key might not be mem aligned. */
+
+        k1 *= c1;
+        k1 = (k1 << r1) | (k1 >> (32 - r1));
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = (h1 << r2) | (h1 >> (32 - r2));
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    /* Handle remaining bytes */
+    uint32_t k1 = 0;
+    int tail_size = key_len & 3;
+    if (tail_size >= 3) k1 ^= (uint32_t)data[nblocks * 4 + 2] << 16;
+    if (tail_size >= 2) k1 ^= (uint32_t)data[nblocks * 4 + 1] << 8;
+    if (tail_size >= 1) {
+        k1 ^= data[nblocks * 4];
+        k1 *= c1;
+        k1 = (k1 << r1) | (k1 >> (32 - r1));
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    /* Finalization */
+    h1 ^= (uint32_t)key_len;
+    h1 ^= (h1 >> 16);
+    h1 *= 0x85ebca6b;
+    h1 ^= (h1 >> 13);
+    h1 *= 0xc2b2ae35;
+    h1 ^= (h1 >> 16);
+
+    return h1;
+}  /* hmap_murmur3_32_inline */
+
+
+static inline uint64_t hmap_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}  /* hmap_rotl64 */
+
+
+static inline uint64_t hmap_fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}  /* hmap_fmix64 */
+
+
+/* Murmur3 128-bit hash function for 64-bit platforms (MurmurHash3_x64_128).
+ * rtn_hash[0] and [1] get the two halves (h1 and h2 of the reference). */
+static inline void hmap_murmur3_x64_128_inline(const void *key, size_t key_len, uint32_t seed, uint64_t *rtn_hash) {
+    const uint8_t *data = (const uint8_t*)key;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+
+    const uint64_t c1 = 0x87c37b91114253d5ull;
+    const uint64_t c2 = 0x4cf5ad432745937full;
+
+    /* Process 16-byte chunks. */
+    size_t nblocks = key_len / 16;
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, &data[i * 16], sizeof(k1));  /* Key might not be mem aligned. */
+        memcpy(&k2, &data[i * 16 + 8], sizeof(k2));
+
+        k1 *= c1; k1 = hmap_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = hmap_rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = hmap_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = hmap_rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    /* Handle remaining bytes */
+    const uint8_t *tail = &data[nblocks * 16];
+    int tail_size = key_len & 15;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    int i;
+    for (i = tail_size - 1; i >= 8; i--) {
+        k2 ^= (uint64_t)tail[i] << ((i - 8) * 8);
+    }
+    if (tail_size > 8) {
+        k2 *= c2; k2 = hmap_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (i = (tail_size < 8 ? tail_size : 8) - 1; i >= 0; i--) {
+        k1 ^= (uint64_t)tail[i] << (i * 8);
+    }
+    if (tail_size > 0) {
+        k1 *= c1; k1 = hmap_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    /* Finalization */
+    h1 ^= (uint64_t)key_len;
+    h2 ^= (uint64_t)key_len;
+    h1 += h2;
+    h2 += h1;
+    h1 = hmap_fmix64(h1);
+    h2 = hmap_fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    rtn_hash[0] = h1;
+    rtn_hash[1] = h2;
+}  /* hmap_murmur3_x64_128_inline */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* HMAP_MURMUR3_H */
@@ -10,15 +10,22 @@
  * Project home: https://github.com/fordsfords/hmap
  */
 
+#if ! defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L  /* For clock_gettime(). */
+#endif
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #if ! defined(_WIN32)
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #endif
 #include "err.h"
 #include "hmap.h"
+#include "hmap_int.h"
 
 #if defined(_WIN32)
 #define MY_SLEEP_MS(msleep_msecs) Sleep(msleep_msecs)
@@ -47,6 +54,13 @@
 int o_testnum;
 
 
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}  /* now_ns */
+
+
 char usage_str[] = "Usage: hmap_test [-h] [-t testnum]";
 void usage(char *msg) {
   if (msg) fprintf(stderr, "\n%s\n\n", msg);
@@ -58,7 +72,8 @@ void help() {
   printf("%s\n"
     "where:\n"
     "  -h - print help\n"
-    "  -t testnum - Specify which test to run [1].\n"
+    "  -t testnum - Specify which test to run [1-4, 7-9, 11, 13-14, 16, 18-19, 21, 23, 25, 27-28, 30-32];\n"
+    "               benchmarks [5-6, 10, 12, 15, 17, 20, 22, 24, 26, 29] only run when selected.\n"
     "For details, see https://github.com/fordsfords/hmap\n",
     usage_str);
   exit(0);
@@ -126,6 +141,7 @@ void test1() {
   ASSRT(n->next == NULL);
   ASSRT(n->key_size == sizeof(k));
   ASSRT(memcmp(n->key, k, sizeof(k)) == 0);
+  ASSRT(n->hash == hmap_murmur3_32(k, sizeof(k), hmap->seed));
 
   E(hmap_lookup(hmap, k, sizeof(k), &v));
   ASSRT(v == &a);
@@ -134,6 +150,12 @@ void test1() {
   err_dispose(err);  /* Since we are handling, delete the err object. */
   err = hmap_lookup(hmap, "foobar", 6, NULL);  ASSRT(err->code == HMAP_ERR_NOTFOUND);
   err_dispose(err);  /* Since we are handling, delete the err object. */
+  ASSRT(hmap_try_lookup(hmap, k, sizeof(k), &v) == 1);
+  ASSRT(v == &a);
+  ASSRT(hmap_try_lookup(hmap, k, sizeof(k), NULL) == 1);
+  ASSRT(hmap_try_lookup(hmap, "foobar", 6, &v) == 0);
+  ASSRT(v == NULL);
+  ASSRT(hmap_try_lookup(hmap, "foobar", 6, NULL) == 0);
 
   iterator = NULL;
   E(hmap_next(hmap, &iterator));
@@ -314,6 +336,11 @@ void test1() {
   char *fetch;
   E(hmap_slookup(hmap, "abc", (void *)&fetch));
   ASSRT(strcmp(fetch, "ABC") == 0);
+  fetch = NULL;
+  ASSRT(hmap_try_slookup(hmap, "abc", (void *)&fetch) == 1);
+  ASSRT(strcmp(fetch, "ABC") == 0);
+  ASSRT(hmap_try_slookup(hmap, "abcd", (void *)&fetch) == 0);
+  ASSRT(fetch == NULL);
 
   iterator = NULL;
   E(hmap_next(hmap, &iterator));
@@ -326,12 +353,3267 @@ void test1() {
 }  /* test1 */
 
 
-int main(int argc, char **argv) {
-  parse_cmdline(argc, argv);
+/* Automatic incremental resizing. */
+void test2() {
+  hmap_t *hmap;
+  hmap_options_t options;
+  hmap_entry_t *iterator;
+  err_t *err;
+  int keys[10000];
+  char seen[10000];
+  int i, migrating_checked = 0;
+  void *v;
 
-  if (o_testnum == 0 || o_testnum == 1) {
-    test1();
-    printf("test1: success\n"); fflush(stdout);
+  hmap_options_init(&options);
+  options.max_load = -1;  /* Error. */
+  err = hmap_create_opts(&hmap, 7, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+
+  options.max_load = 2.0;
+  E(hmap_create_opts(&hmap, 7, &options));
+  ASSRT(hmap->table_size == 7);
+  ASSRT(hmap->old_table == NULL);
+
+  for (i = 0; i < 10000; i++) {
+    keys[i] = i;
+    E(hmap_write(hmap, &keys[i], sizeof(keys[i]), &keys[i]));
+    ASSRT(hmap->num_entries == i + 1);
+    ASSRT(hmap->num_entries <= hmap->max_load * hmap->table_size);
+
+    if (hmap->old_table && i > 1000 && !migrating_checked) {
+      /* Iterate while a migration is in progress, with lookups mixed in. */
+      size_t migrate_bucket = hmap->migrate_bucket;
+      int count = 0;
+      memset(seen, 0, sizeof(seen));
+      iterator = NULL;
+      do {
+        E(hmap_next(hmap, &iterator));
+        if (iterator) {
+          int k = *(int *)iterator->key;
+          ASSRT(k >= 0 && k <= i);
+          ASSRT(iterator->hash == hmap_murmur3_32(&k, sizeof(k), hmap->seed));
+          ASSRT(seen[k] == 0);
+          seen[k] = 1;
+          count++;
+          E(hmap_lookup(hmap, &keys[(k * 7) % (i + 1)], sizeof(int), &v));
+        }
+      } while (iterator);
+      ASSRT(count == i + 1);
+      ASSRT(hmap->migrate_bucket == migrate_bucket);  /* Lookups didn't migrate. */
+      ASSRT(hmap->iterating == 0);
+      migrating_checked = 1;
+    }
+  }
+  ASSRT(migrating_checked);
+  ASSRT(hmap->table_size == 7 * 1024);
+
+  /* Lookups outside of iteration finish the migration. */
+  for (i = 0; i < 10000; i++) {
+    E(hmap_lookup(hmap, &keys[i], sizeof(keys[i]), &v));
+    ASSRT(v == &keys[i]);
+  }
+  ASSRT(hmap->old_table == NULL);
+  err = hmap_lookup(hmap, "foobar", 6, &v);  ASSRT(err->code == HMAP_ERR_NOTFOUND);
+  err_dispose(err);
+
+  /* Overwrite doesn't add entries. */
+  E(hmap_write(hmap, &keys[5], sizeof(keys[5]), &keys[6]));
+  ASSRT(hmap->num_entries == 10000);
+  E(hmap_lookup(hmap, &keys[5], sizeof(keys[5]), &v));
+  ASSRT(v == &keys[6]);
+
+  E(hmap_delete(hmap));
+
+  /* Delete in the middle of a migration. */
+  E(hmap_create_opts(&hmap, 1, &options));
+  i = 0;
+  while (hmap->old_table == NULL || hmap->migrate_bucket == 0) {
+    E(hmap_write(hmap, &keys[i], sizeof(keys[i]), NULL));
+    i++;
+  }
+  E(hmap_delete(hmap));
+}  /* test2 */
+
+
+/* Robin Hood open addressing layout. */
+void test3() {
+  hmap_t *hmap;
+  hmap_options_t options;
+  hmap_entry_t *iterator;
+  err_t *err;
+  int keys[10000];
+  char seen[10000];
+  int i, count;
+  size_t slot;
+  void *v;
+
+  hmap_options_init(&options);
+  options.layout = HMAP_LAYOUT_ROBINHOOD;
+  options.max_load = 1.0;  /* Error, open addressing needs an empty slot. */
+  err = hmap_create_opts(&hmap, 7, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+
+  options.max_load = 0;  /* Use default. */
+  E(hmap_create_opts(&hmap, 2, &options));
+  ASSRT(hmap->table == NULL);
+  ASSRT(hmap->max_load > 0 && hmap->max_load < 1);
+
+  /* Iterate over empty table. */
+  iterator = NULL;
+  E(hmap_next(hmap, &iterator));
+  ASSRT(iterator == NULL);
+  err = hmap_lookup(hmap, "foobar", 6, &v);  ASSRT(err->code == HMAP_ERR_NOTFOUND);
+  err_dispose(err);
+
+  for (i = 0; i < 10000; i++) {
+    keys[i] = i;
+    E(hmap_write(hmap, &keys[i], sizeof(keys[i]), &keys[i]));
+    ASSRT(hmap->num_entries == i + 1);
+    ASSRT((size_t)hmap->num_entries < hmap->table_size);
+  }
+
+  /* Every entry knows its slot, and slots keep the Robin Hood ordering. */
+  count = 0;
+  for (slot = 0; slot < hmap->table_size; slot++) {
+    if (hmap->hashes[slot] != 0) {
+      ASSRT(HMAP_SLOT(hmap, slot)->bucket == slot);
+      ASSRT(HMAP_SLOT(hmap, slot)->next == NULL);
+      ASSRT(hmap->hashes[slot] == hmap_murmur3_32(HMAP_SLOT(hmap, slot)->key, sizeof(int), hmap->seed));
+      count++;
+      size_t next_slot = (slot + 1) % hmap->table_size;
+      if (hmap->hashes[next_slot] != 0) {
+        size_t home = hmap_reduce(hmap->hashes[slot], hmap->table_size, hmap->reduce_m);
+        size_t next_home = hmap_reduce(hmap->hashes[next_slot], hmap->table_size, hmap->reduce_m);
+        size_t dist = (slot + hmap->table_size - home) % hmap->table_size;
+        size_t next_dist = (next_slot + hmap->table_size - next_home) % hmap->table_size;
+        ASSRT(next_dist <= dist + 1);
+      }
+    }
+  }
+  ASSRT(count == 10000);
+
+  for (i = 0; i < 10000; i++) {
+    E(hmap_lookup(hmap, &keys[i], sizeof(keys[i]), &v));
+    ASSRT(v == &keys[i]);
+  }
+  err = hmap_lookup(hmap, "foobar", 6, &v);  ASSRT(err->code == HMAP_ERR_NOTFOUND);
+  err_dispose(err);
+  ASSRT(v == NULL);
+  ASSRT(hmap_try_lookup(hmap, "foobar", 6, &v) == 0);
+  ASSRT(hmap_try_lookup(hmap, &keys[9999], sizeof(keys[9999]), &v) == 1);
+  ASSRT(v == &keys[9999]);
+
+  /* Overwrite. */
+  E(hmap_write(hmap, &keys[5], sizeof(keys[5]), &keys[6]));
+  ASSRT(hmap->num_entries == 10000);
+  E(hmap_lookup(hmap, &keys[5], sizeof(keys[5]), &v));
+  ASSRT(v == &keys[6]);
+
+  memset(seen, 0, sizeof(seen));
+  count = 0;
+  iterator = NULL;
+  do {
+    E(hmap_next(hmap, &iterator));
+    if (iterator) {
+      int k = *(int *)iterator->key;
+      ASSRT(iterator->key_size == sizeof(int));
+      ASSRT(seen[k] == 0);
+      seen[k] = 1;
+      count++;
+    }
+  } while (iterator);
+  ASSRT(count == 10000);
+
+  /* String interfaces. */
+  E(hmap_swrite(hmap, "abc", "ABC"));
+  char *fetch;
+  E(hmap_slookup(hmap, "abc", (void *)&fetch));
+  ASSRT(strcmp(fetch, "ABC") == 0);
+
+  E(hmap_delete(hmap));
+}  /* test3 */
+
+
+/* Group probing layout. */
+void test4() {
+  hmap_t *hmap;
+  hmap_options_t options;
+  hmap_entry_t *iterator;
+  err_t *err;
+  int keys[10000];
+  char seen[10000];
+  int i, count;
+  size_t slot;
+  void *v;
+
+  hmap_options_init(&options);
+  options.layout = HMAP_LAYOUT_GROUP;
+  E(hmap_create_opts(&hmap, 3, &options));
+  ASSRT(hmap->table_size == HMAP_GROUP_WIDTH);  /* Rounded up. */
+  ASSRT(hmap->table == NULL);
+
+  iterator = NULL;
+  E(hmap_next(hmap, &iterator));
+  ASSRT(iterator == NULL);
+  err = hmap_lookup(hmap, "foobar", 6, &v);  ASSRT(err->code == HMAP_ERR_NOTFOUND);
+  err_dispose(err);
+
+  for (i = 0; i < 10000; i++) {
+    keys[i] = i;
+    E(hmap_write(hmap, &keys[i], sizeof(keys[i]), &keys[i]));
+    ASSRT(hmap->num_entries == i + 1);
+    ASSRT((size_t)hmap->num_entries < hmap->table_size);
+  }
+
+  /* Control bytes match the entries, and the clones match the start. */
+  count = 0;
+  for (slot = 0; slot < hmap->table_size; slot++) {
+    if ((hmap->ctrl[slot] & 0x80) == 0) {
+      uint32_t hash = hmap_murmur3_32(HMAP_SLOT(hmap, slot)->key, sizeof(int), hmap->seed);
+      ASSRT(hmap->ctrl[slot] == (hash >> 25));
+      ASSRT(HMAP_SLOT(hmap, slot)->hash == hash);
+      ASSRT(HMAP_SLOT(hmap, slot)->bucket == slot);
+      count++;
+    }
+  }
+  ASSRT(count == 10000);
+  for (slot = 0; slot < HMAP_GROUP_WIDTH; slot++) {
+    ASSRT(hmap->ctrl[hmap->table_size + slot] == hmap->ctrl[slot]);
+  }
+
+  for (i = 0; i < 10000; i++) {
+    E(hmap_lookup(hmap, &keys[i], sizeof(keys[i]), &v));
+    ASSRT(v == &keys[i]);
+  }
+  err = hmap_lookup(hmap, "foobar", 6, &v);  ASSRT(err->code == HMAP_ERR_NOTFOUND);
+  err_dispose(err);
+  ASSRT(v == NULL);
+  ASSRT(hmap_try_lookup(hmap, "foobar", 6, &v) == 0);
+  ASSRT(hmap_try_lookup(hmap, &keys[9999], sizeof(keys[9999]), &v) == 1);
+  ASSRT(v == &keys[9999]);
+
+  /* Overwrite. */
+  E(hmap_write(hmap, &keys[5], sizeof(keys[5]), &keys[6]));
+  ASSRT(hmap->num_entries == 10000);
+  E(hmap_lookup(hmap, &keys[5], sizeof(keys[5]), &v));
+  ASSRT(v == &keys[6]);
+
+  memset(seen, 0, sizeof(seen));
+  count = 0;
+  iterator = NULL;
+  do {
+    E(hmap_next(hmap, &iterator));
+    if (iterator) {
+      int k = *(int *)iterator->key;
+      ASSRT(seen[k] == 0);
+      seen[k] = 1;
+      count++;
+    }
+  } while (iterator);
+  ASSRT(count == 10000);
+
+  E(hmap_swrite(hmap, "abc", "ABC"));
+  char *fetch;
+  E(hmap_slookup(hmap, "abc", (void *)&fetch));
+  ASSRT(strcmp(fetch, "ABC") == 0);
+
+  E(hmap_delete(hmap));
+
+  /* Fill a table right up to its load limit without growing. */
+  options.max_load = 0.99;
+  E(hmap_create_opts(&hmap, 64, &options));
+  for (i = 0; i < 63; i++) {
+    E(hmap_write(hmap, &keys[i], sizeof(keys[i]), &keys[i]));
+  }
+  ASSRT(hmap->table_size == 64);
+  for (i = 0; i < 63; i++) {
+    E(hmap_lookup(hmap, &keys[i], sizeof(keys[i]), &v));
+    ASSRT(v == &keys[i]);
+  }
+  err = hmap_lookup(hmap, &keys[63], sizeof(keys[63]), &v);  ASSRT(err->code == HMAP_ERR_NOTFOUND);
+  err_dispose(err);
+  E(hmap_delete(hmap));
+}  /* test4 */
+
+
+/* Arena mode. */
+void test7() {
+  hmap_t *hmap;
+  hmap_options_t options;
+  int keys[10000];
+  int i, layout;
+  size_t used, reserved;
+  void *v;
+
+  /* Not in arena mode. */
+  E(hmap_create(&hmap, 7919));
+  E(hmap_write(hmap, "abc", 3, NULL));
+  E(hmap_arena_usage(hmap, &used, &reserved));
+  ASSRT(used == 0 && reserved == 0);
+  E(hmap_delete(hmap));
+
+  for (layout = HMAP_LAYOUT_CHAINED; layout <= HMAP_LAYOUT_GROUP; layout++) {
+    hmap_options_init(&options);
+    options.layout = layout;
+    options.max_load = 0.8;
+    options.arena_slab_size = 4096;
+    options.inline_key_max = 0;  /* Separate key allocations. */
+    E(hmap_create_opts(&hmap, 64, &options));
+    E(hmap_arena_usage(hmap, &used, &reserved));
+    ASSRT(used == 0 && reserved == 0);
+
+    for (i = 0; i < 10000; i++) {
+      keys[i] = i;
+      E(hmap_write(hmap, &keys[i], sizeof(keys[i]), &keys[i]));
+    }
+    /* A key bigger than a slab gets a slab of its own. */
+    char big_key[5000];
+    memset(big_key, 'x', sizeof(big_key));
+    E(hmap_write(hmap, big_key, sizeof(big_key), big_key));
+
+    E(hmap_arena_usage(hmap, &used, &reserved));
+    if (layout == HMAP_LAYOUT_CHAINED) {
+      /* 16-byte rounded entry plus 16 bytes for each int key. */
+      size_t entry_size = (sizeof(hmap_entry_t) + 15) & ~(size_t)15;
+      ASSRT(used == 10000 * (entry_size + 16) + entry_size + 5008);
+    } else {
+      ASSRT(used == 10000 * 16 + 5008);  /* Open layouts only allocate keys. */
+    }
+    ASSRT(reserved >= used);
+    ASSRT(reserved < used + used / 4);
+
+    for (i = 0; i < 10000; i++) {
+      E(hmap_lookup(hmap, &keys[i], sizeof(keys[i]), &v));
+      ASSRT(v == &keys[i]);
+    }
+    E(hmap_lookup(hmap, big_key, sizeof(big_key), &v));
+    ASSRT(v == big_key);
+
+    E(hmap_delete(hmap));
+  }
+}  /* test7 */
+
+
+/* Inline keys. */
+void test8() {
+  hmap_t *hmap;
+  hmap_options_t options;
+  hmap_entry_t *iterator;
+  char keys[1000][41];
+  char seen[1000];
+  int i, count, layout;
+  size_t used;
+  void *v;
+  err_t *err;
+
+  hmap_options_init(&options);
+  ASSRT(options.inline_key_max == HMAP_INLINE_KEY_DEFAULT);
+  options.inline_key_max = HMAP_INLINE_KEY_LIMIT + 1;  /* Error. */
+  err = hmap_create_opts(&hmap, 7, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+
+  /* Keys from 5 to 40 bytes straddle the inline threshold. */
+  size_t expected_used = 0;
+  for (i = 0; i < 1000; i++) {
+    int len = 5 + i % 36;
+    if (len > 20) {
+      expected_used += (len + 15) & ~15;
+    }
+    memset(keys[i], 'a' + i % 26, len);
+    sprintf(keys[i], "%d", i);
+    keys[i][strlen(keys[i])] = '-';
+    keys[i][len] = '\0';
+  }
+
+  for (layout = HMAP_LAYOUT_CHAINED; layout <= HMAP_LAYOUT_GROUP; layout++) {
+    hmap_options_init(&options);
+    options.layout = layout;
+    options.max_load = 0.7;
+    options.inline_key_max = 20;
+    options.arena_slab_size = (layout == HMAP_LAYOUT_GROUP) ? 65536 : 0;
+    E(hmap_create_opts(&hmap, 4, &options));
+
+    for (i = 0; i < 1000; i++) {
+      E(hmap_write(hmap, keys[i], strlen(keys[i]), keys[i]));
+    }
+    ASSRT(hmap->table_size > 1000);  /* Entries moved around while growing. */
+
+    for (i = 0; i < 1000; i++) {
+      E(hmap_lookup(hmap, keys[i], strlen(keys[i]), &v));
+      ASSRT(v == keys[i]);
+    }
+    ASSRT(hmap_try_lookup(hmap, "0-", 2, &v) == 0);
+
+    memset(seen, 0, sizeof(seen));
+    count = 0;
+    iterator = NULL;
+    do {
+      E(hmap_next(hmap, &iterator));
+      if (iterator) {
+        i = atoi(iterator->key);
+        ASSRT(iterator->value == keys[i]);
+        ASSRT(iterator->key_size == strlen(keys[i]));
+        ASSRT(memcmp(iterator->key, keys[i], iterator->key_size) == 0);
+        /* Short keys are stored right after the entry. */
+        if (iterator->key_size <= 20) {
+          ASSRT(iterator->key == (void *)(iterator + 1));
+        } else {
+          ASSRT(iterator->key != (void *)(iterator + 1));
+        }
+        ASSRT(seen[i] == 0);
+        seen[i] = 1;
+        count++;
+      }
+    } while (iterator);
+    ASSRT(count == 1000);
+
+    if (layout == HMAP_LAYOUT_GROUP) {
+      /* Only keys longer than 20 are allocated. */
+      E(hmap_arena_usage(hmap, &used, NULL));
+      ASSRT(used == expected_used);
+    }
+
+    E(hmap_delete(hmap));
+  }
+}  /* test8 */
+
+
+/* Power-of-two sizing and bucket reduction. */
+void test9() {
+  static const size_t sizes[] = { 1, 2, 3, 5, 7, 16, 100, 5009, 7919, 65536, 1000003,
+      2147483647, 2147483648u };
+  hmap_t *hmap;
+  hmap_options_t options;
+  uint32_t hash;
+  int i, s;
+  void *v;
+
+  /* Fastmod gives exactly hash % table_size. */
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+    uint64_t reduce_m = hmap_reduce_init(sizes[s]);
+    if ((sizes[s] & (sizes[s] - 1)) == 0) {
+      ASSRT(reduce_m == 0);
+    }
+    for (i = 0; i < 100000; i++) {
+      hash = hmap_murmur3_32(&i, sizeof(i), 42);
+      if (reduce_m != 0) {
+        ASSRT(hmap_reduce(hash, sizes[s], reduce_m) == hash % sizes[s]);
+      } else {
+        ASSRT(hmap_reduce(hash, sizes[s], reduce_m) < sizes[s]);
+      }
+    }
+    if (reduce_m != 0) {
+      ASSRT(hmap_reduce(0, sizes[s], reduce_m) == 0);
+      ASSRT(hmap_reduce(0xffffffff, sizes[s], reduce_m) == 0xffffffff % sizes[s]);
+    }
+  }
+
+  /* A weak hash (multiples of 65536) still spreads over a power-of-two table. */
+  {
+    char used[1024];
+    int num_used = 0;
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < 1024; i++) {
+      size_t bucket = hmap_reduce((uint32_t)i << 16, 1024, 0);
+      if (!used[bucket]) {
+        used[bucket] = 1;
+        num_used++;
+      }
+    }
+    ASSRT(num_used == 1024);
+  }
+
+  hmap_options_init(&options);
+  options.pow2 = 1;
+  options.max_load = 1.0;
+  E(hmap_create_opts(&hmap, 5009, &options));
+  ASSRT(hmap->table_size == 8192);
+  ASSRT(hmap->reduce_m == 0);
+  for (i = 0; i < 20000; i++) {
+    E(hmap_write(hmap, &i, sizeof(i), NULL));
+  }
+  ASSRT(hmap->table_size == 32768);  /* Stays a power of two as it grows. */
+  for (i = 0; i < 20000; i++) {
+    E(hmap_lookup(hmap, &i, sizeof(i), &v));
+  }
+  E(hmap_delete(hmap));
+
+  E(hmap_create_opts(&hmap, 8192, &options));
+  ASSRT(hmap->table_size == 8192);
+  E(hmap_delete(hmap));
+}  /* test9 */
+
+
+/* Benchmark: cost of reducing a hash to a bucket number. */
+void test10() {
+  size_t num_hashes = 1 << 16;
+  uint32_t *hashes = malloc(num_hashes * sizeof(uint32_t));
+  volatile size_t table_sizes[2] = { 1000003, 1048576 };  /* Runtime values. */
+  size_t prime_size = table_sizes[0];
+  size_t pow2_size = table_sizes[1];
+  uint64_t prime_m = hmap_reduce_init(prime_size);
+  int loops = 200;
+  int loop;
+  size_t i, sum;
+  uint64_t start_ns, mod_ns, fastmod_ns, mask_ns;
+  ASSRT(hashes);
+
+  for (i = 0; i < num_hashes; i++) {
+    hashes[i] = hmap_murmur3_32(&i, sizeof(i), 42);
+  }
+
+  sum = 0;
+  start_ns = now_ns();
+  for (loop = 0; loop < loops; loop++) {
+    for (i = 0; i < num_hashes; i++) {
+      sum += hashes[i] % prime_size;
+    }
+  }
+  mod_ns = now_ns() - start_ns;
+
+  start_ns = now_ns();
+  for (loop = 0; loop < loops; loop++) {
+    for (i = 0; i < num_hashes; i++) {
+      sum += hmap_reduce(hashes[i], prime_size, prime_m);
+    }
+  }
+  fastmod_ns = now_ns() - start_ns;
+
+  start_ns = now_ns();
+  for (loop = 0; loop < loops; loop++) {
+    for (i = 0; i < num_hashes; i++) {
+      sum += hmap_reduce(hashes[i], pow2_size, 0);
+    }
+  }
+  mask_ns = now_ns() - start_ns;
+
+  printf("reduction,ns_per_op\n");
+  printf("modulo_prime,%.3f\n", (double)mod_ns / (num_hashes * loops));
+  printf("fastmod_prime,%.3f\n", (double)fastmod_ns / (num_hashes * loops));
+  printf("mask_pow2,%.3f\n", (double)mask_ns / (num_hashes * loops));
+  printf("(checksum %lu)\n", (unsigned long)sum);
+
+  free(hashes);
+}  /* test10 */
+
+
+/* Murmur3 matches the reference implementation; 64-bit hash maps. */
+void test11() {
+  static const uint64_t fox128[2] = { 0xe34bbc7bbc071b6cull, 0x7a433ca9c49a9347ull };
+  const char *fox = "The quick brown fox jumps over the lazy dog";
+  uint8_t key[256];
+  uint8_t hashes[256 * 16];
+  uint64_t hash128[2];
+  uint32_t hash32;
+  hmap_options_t options;
+  hmap_t *hmap;
+  err_t *err;
+  int i, layout;
+  void *v;
+
+  /* Reference values (assumes a little-endian machine). */
+  ASSRT(hmap_murmur3_32("", 0, 0) == 0);
+  ASSRT(hmap_murmur3_32("", 0, 1) == 0x514e28b7);
+  ASSRT(hmap_murmur3_32("", 0, 0xffffffff) == 0x81f16f39);
+  ASSRT(hmap_murmur3_32("\0\0\0\0", 4, 0) == 0x2362f9de);
+  ASSRT(hmap_murmur3_32("a", 1, 0x9747b28c) == 0x7fa09ea6);
+  ASSRT(hmap_murmur3_32("abc", 3, 0x9747b28c) == 0xc84a62dd);
+  ASSRT(hmap_murmur3_32("abcd", 4, 0x9747b28c) == 0xf0478627);
+  ASSRT(hmap_murmur3_32("Hello, world!", 13, 0x9747b28c) == 0x24884cba);
+  ASSRT(hmap_murmur3_32(fox, strlen(fox), 0x9747b28c) == 0x2fa826cd);
+  hmap_murmur3_x64_128(fox, strlen(fox), 0, hash128);
+  ASSRT(hash128[0] == fox128[0] && hash128[1] == fox128[1]);
+  hmap_murmur3_x64_128("", 0, 0, hash128);
+  ASSRT(hash128[0] == 0 && hash128[1] == 0);
+
+  /* SMHasher's VerificationTest: hash keys {}, {0}, {0,1}, ... {0..254}
+   * with seed 256-n, then hash the concatenated results with seed 0. This
+   * covers every tail length. */
+  for (i = 0; i < 256; i++) {
+    key[i] = (uint8_t)i;
+  }
+  for (i = 0; i < 256; i++) {
+    hash32 = hmap_murmur3_32(key, i, 256 - i);
+    memcpy(&hashes[i * 4], &hash32, 4);
+  }
+  ASSRT(hmap_murmur3_32(hashes, 256 * 4, 0) == 0xb0f57ee3);
+  for (i = 0; i < 256; i++) {
+    hmap_murmur3_x64_128(key, i, 256 - i, hash128);
+    memcpy(&hashes[i * 16], hash128, 16);
+  }
+  hmap_murmur3_x64_128(hashes, 256 * 16, 0, hash128);
+  ASSRT((uint32_t)hash128[0] == 0x6384ba69);
+
+  /* Misaligned keys hash the same as aligned ones. */
+  memcpy(&hashes[1], fox, strlen(fox));
+  ASSRT(hmap_murmur3_32(&hashes[1], strlen(fox), 0x9747b28c) == 0x2fa826cd);
+  hmap_murmur3_x64_128(&hashes[1], strlen(fox), 0, hash128);
+  ASSRT(hash128[0] == fox128[0] && hash128[1] == fox128[1]);
+
+  /* 64-bit hashes in every layout. */
+  for (layout = HMAP_LAYOUT_CHAINED; layout <= HMAP_LAYOUT_GROUP; layout++) {
+    hmap_options_init(&options);
+    options.hash_bits = 64;
+    options.layout = layout;
+    options.max_load = (layout == HMAP_LAYOUT_CHAINED) ? 1.0 : 0;
+    E(hmap_create_opts(&hmap, 17, &options));
+    for (i = 0; i < 5000; i++) {
+      E(hmap_write(hmap, &i, sizeof(i), (void *)(intptr_t)(i + 1)));
+    }
+    ASSRT(hmap->num_entries == 5000);
+    for (i = 0; i < 5000; i++) {
+      E(hmap_lookup(hmap, &i, sizeof(i), &v));
+      ASSRT(v == (void *)(intptr_t)(i + 1));
+    }
+    ASSRT(!hmap_try_lookup(hmap, &i, sizeof(i), &v));
+
+    hmap_entry_t *entry = NULL;
+    E(hmap_next(hmap, &entry));
+    ASSRT(entry);
+    hmap_murmur3_x64_128(entry->key, entry->key_size, hmap->seed, hash128);
+    ASSRT(entry->hash == hash128[0]);
+    E(hmap_delete(hmap));
+  }
+
+  hmap_options_init(&options);
+  ASSRT(options.hash_bits == 32);
+  options.hash_bits = 16;  /* Error. */
+  err = hmap_create_opts(&hmap, 17, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+}  /* test11 */
+
+
+/* Benchmark: hash throughput by key length. */
+void test12() {
+  static const size_t key_lens[] = { 4, 8, 16, 32, 64, 256, 1024, 4096 };
+  size_t buf_size = 1 << 20;
+  uint8_t *buf = malloc(buf_size);
+  uint64_t hash128[2];
+  uint64_t sum = 0;
+  size_t i, k;
+  ASSRT(buf);
+
+  for (i = 0; i < buf_size; i++) {
+    buf[i] = (uint8_t)(i * 7);
+  }
+
+  printf("key_len,murmur3_32_gbps,murmur3_x64_128_gbps\n");
+  for (k = 0; k < sizeof(key_lens) / sizeof(key_lens[0]); k++) {
+    size_t key_len = key_lens[k];
+    size_t num_keys = buf_size / key_len;
+    int loops = 16;
+    int loop;
+    uint64_t start_ns, ns32, ns128;
+
+    start_ns = now_ns();
+    for (loop = 0; loop < loops; loop++) {
+      for (i = 0; i < num_keys; i++) {
+        sum += hmap_murmur3_32(&buf[i * key_len], key_len, 42);
+      }
+    }
+    ns32 = now_ns() - start_ns;
+
+    start_ns = now_ns();
+    for (loop = 0; loop < loops; loop++) {
+      for (i = 0; i < num_keys; i++) {
+        hmap_murmur3_x64_128(&buf[i * key_len], key_len, 42, hash128);
+        sum += hash128[0];
+      }
+    }
+    ns128 = now_ns() - start_ns;
+
+    /* Bytes per ns is GB/s. */
+    printf("%lu,%.3f,%.3f\n", (unsigned long)key_len,
+        (double)(num_keys * key_len * loops) / ns32,
+        (double)(num_keys * key_len * loops) / ns128);
+  }
+  printf("(checksum %lu)\n", (unsigned long)sum);
+
+  free(buf);
+}  /* test12 */
+
+
+/* Multiplicative hash for 8-byte integer keys. */
+static uint64_t test_u64_hash(const void *key, size_t key_size, uint32_t seed) {
+  uint64_t k;
+  (void)key_size;
+  memcpy(&k, key, sizeof(k));
+  k = (k ^ seed) * 0x9e3779b97f4a7c15ull;
+  return k ^ (k >> 32);
+}  /* test_u64_hash */
+
+static int test_u64_equal(const void *key1, size_t key1_size, const void *key2, size_t key2_size) {
+  (void)key1_size;  (void)key2_size;
+  return memcmp(key1, key2, sizeof(uint64_t)) == 0;
+}  /* test_u64_equal */
+
+/* Case-insensitive C strings. */
+static uint64_t test_nocase_hash(const void *key, size_t key_size, uint32_t seed) {
+  char lower[64];
+  size_t i;
+  ASSRT(key_size <= sizeof(lower));
+  for (i = 0; i < key_size; i++) {
+    lower[i] = (char)tolower(((const unsigned char *)key)[i]);
+  }
+  return hmap_murmur3_32(lower, key_size, seed);
+}  /* test_nocase_hash */
+
+static int test_nocase_equal(const void *key1, size_t key1_size, const void *key2, size_t key2_size) {
+  size_t i;
+  if (key1_size != key2_size) {
+    return 0;
+  }
+  for (i = 0; i < key1_size; i++) {
+    if (tolower(((const unsigned char *)key1)[i]) != tolower(((const unsigned char *)key2)[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}  /* test_nocase_equal */
+
+
+/* Seed and user hash/equality callbacks. */
+void test13() {
+  hmap_options_t options;
+  hmap_t *hmap;
+  hmap_t *hmap2;
+  hmap_entry_t *entry;
+  hmap_entry_t *entry2;
+  uint64_t k;
+  int layout;
+  void *v;
+
+  hmap_options_init(&options);
+  ASSRT(options.seed == 42 && options.hash_fn == NULL && options.equal_fn == NULL);
+
+  /* Different seeds, different hashes. */
+  options.seed = 0x12345678;
+  E(hmap_create_opts(&hmap, 101, &options));
+  ASSRT(hmap->seed == 0x12345678);
+  options.seed = 0x9abcdef0;
+  E(hmap_create_opts(&hmap2, 101, &options));
+  E(hmap_swrite(hmap, "key", NULL));
+  E(hmap_swrite(hmap2, "key", NULL));
+  entry = NULL;  E(hmap_next(hmap, &entry));
+  entry2 = NULL;  E(hmap_next(hmap2, &entry2));
+  ASSRT(entry->hash == hmap_murmur3_32("key", 4, 0x12345678));
+  ASSRT(entry2->hash == hmap_murmur3_32("key", 4, 0x9abcdef0));
+  ASSRT(entry->hash != entry2->hash);
+  E(hmap_slookup(hmap, "key", &v));
+  E(hmap_slookup(hmap2, "key", &v));
+  E(hmap_delete(hmap));
+  E(hmap_delete(hmap2));
+
+  /* Integer keys with a multiplicative hash, in every layout. */
+  for (layout = HMAP_LAYOUT_CHAINED; layout <= HMAP_LAYOUT_GROUP; layout++) {
+    hmap_options_init(&options);
+    options.layout = layout;
+    options.max_load = (layout == HMAP_LAYOUT_CHAINED) ? 1.0 : 0;
+    options.hash_fn = test_u64_hash;
+    options.equal_fn = test_u64_equal;
+    E(hmap_create_opts(&hmap, 16, &options));
+    for (k = 0; k < 10000; k++) {
+      uint64_t id = k * 1000003;
+      E(hmap_write(hmap, &id, sizeof(id), (void *)(uintptr_t)(k + 1)));
+    }
+    ASSRT(hmap->num_entries == 10000);
+    for (k = 0; k < 10000; k++) {
+      uint64_t id = k * 1000003;
+      ASSRT(hmap_try_lookup(hmap, &id, sizeof(id), &v));
+      ASSRT(v == (void *)(uintptr_t)(k + 1));
+      id++;
+      ASSRT(!hmap_try_lookup(hmap, &id, sizeof(id), &v));
+    }
+    entry = NULL;  E(hmap_next(hmap, &entry));
+    ASSRT(entry->hash == test_u64_hash(entry->key, sizeof(uint64_t), hmap->seed));
+    E(hmap_delete(hmap));
+  }
+
+  /* Case-insensitive string keys. */
+  hmap_options_init(&options);
+  options.hash_fn = test_nocase_hash;
+  options.equal_fn = test_nocase_equal;
+  E(hmap_create_opts(&hmap, 101, &options));
+  E(hmap_swrite(hmap, "Hello", (void *)1));
+  E(hmap_slookup(hmap, "hELLO", &v));  ASSRT(v == (void *)1);
+  E(hmap_swrite(hmap, "HELLO", (void *)2));  /* Overwrites. */
+  ASSRT(hmap->num_entries == 1);
+  E(hmap_slookup(hmap, "hello", &v));  ASSRT(v == (void *)2);
+  ASSRT(!hmap_try_slookup(hmap, "hell", &v));
+  E(hmap_delete(hmap));
+}  /* test13 */
+
+
+/* Integer-key maps from hmap_int.h. */
+void test14() {
+  hmap_options_t options;
+  hmap_u64_t *map64 = NULL;
+  hmap_u32_t *map32 = NULL;
+  hmap_u64_entry_t *entry;
+  err_t *err;
+  uint64_t k;
+  uint32_t k32;
+  int count;
+  void *v;
+
+  err = hmap_u64_create(&map64, 0, NULL);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  hmap_options_init(&options);
+  options.max_load = 1.0;  /* Error (open addressing). */
+  err = hmap_u64_create(&map64, 7, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  ASSRT(map64 == NULL);
+
+  /* Strided order IDs, including 0, grow from a tiny table. */
+  E(hmap_u64_create(&map64, 3, NULL));
+  ASSRT(map64->max_load == HMAP_OPEN_DEFAULT_LOAD);
+  for (k = 0; k < 100000; k++) {
+    E(hmap_u64_write(map64, k << 20, (void *)(uintptr_t)(k + 1)));
+  }
+  ASSRT(map64->num_entries == 100000);
+  ASSRT(map64->num_entries <= map64->max_load * map64->table_size);
+  for (k = 0; k < 100000; k++) {
+    ASSRT(hmap_u64_try_lookup(map64, k << 20, &v));
+    ASSRT(v == (void *)(uintptr_t)(k + 1));
+    ASSRT(!hmap_u64_try_lookup(map64, (k << 20) + 1, &v) && v == NULL);
+  }
+  E(hmap_u64_write(map64, 0, (void *)7));  /* Overwrite. */
+  ASSRT(map64->num_entries == 100000);
+  E(hmap_u64_lookup(map64, 0, &v));  ASSRT(v == (void *)7);
+  err = hmap_u64_lookup(map64, 1, &v);  ASSRT(err->code == HMAP_ERR_NOTFOUND);
+  err_dispose(err);
+
+  count = 0;
+  entry = NULL;
+  do {
+    E(hmap_u64_next(map64, &entry));
+    if (entry) {
+      ASSRT((entry->key & 0xfffff) == 0);
+      count++;
+    }
+  } while (entry);
+  ASSRT(count == 100000);
+  E(hmap_u64_delete(map64));
+
+  hmap_options_init(&options);
+  options.pow2 = 1;
+  options.seed = 7;
+  E(hmap_u32_create(&map32, 1000, &options));
+  ASSRT(map32->table_size == 1024 && map32->reduce_m == 0 && map32->seed == 7);
+  for (k32 = 0; k32 < 5000; k32++) {
+    E(hmap_u32_write(map32, k32 * 16, (void *)(uintptr_t)(k32 + 1)));
+  }
+  ASSRT(map32->table_size == 8192);
+  for (k32 = 0; k32 < 5000; k32++) {
+    ASSRT(hmap_u32_try_lookup(map32, k32 * 16, &v));
+    ASSRT(v == (void *)(uintptr_t)(k32 + 1));
+  }
+  ASSRT(!hmap_u32_try_lookup(map32, 1, NULL));
+  E(hmap_u32_delete(map32));
+}  /* test14 */
+
+
+/* Benchmark: generic map with 8-byte keys vs. hmap_u64_t. */
+void test15() {
+  int num_keys = 1000000;
+  hmap_t *hmap;
+  hmap_u64_t *map64;
+  uint64_t k;
+  uint64_t start_ns, generic_write_ns, generic_lookup_ns, int_write_ns, int_lookup_ns;
+  uintptr_t sum = 0;
+  void *v;
+
+  E(hmap_create(&hmap, num_keys));
+  E(hmap_u64_create(&map64, num_keys, NULL));
+
+  start_ns = now_ns();
+  for (k = 0; k < (uint64_t)num_keys; k++) {
+    uint64_t id = k * 7919;
+    E(hmap_write(hmap, &id, sizeof(id), (void *)(uintptr_t)k));
+  }
+  generic_write_ns = now_ns() - start_ns;
+
+  start_ns = now_ns();
+  for (k = 0; k < (uint64_t)num_keys; k++) {
+    uint64_t id = k * 7919;
+    hmap_try_lookup(hmap, &id, sizeof(id), &v);
+    sum += (uintptr_t)v;
+  }
+  generic_lookup_ns = now_ns() - start_ns;
+
+  start_ns = now_ns();
+  for (k = 0; k < (uint64_t)num_keys; k++) {
+    E(hmap_u64_write(map64, k * 7919, (void *)(uintptr_t)k));
+  }
+  int_write_ns = now_ns() - start_ns;
+
+  start_ns = now_ns();
+  for (k = 0; k < (uint64_t)num_keys; k++) {
+    hmap_u64_try_lookup(map64, k * 7919, &v);
+    sum += (uintptr_t)v;
+  }
+  int_lookup_ns = now_ns() - start_ns;
+
+  printf("map,write_ns,lookup_ns\n");
+  printf("hmap_t,%.1f,%.1f\n", (double)generic_write_ns / num_keys, (double)generic_lookup_ns / num_keys);
+  printf("hmap_u64_t,%.1f,%.1f\n", (double)int_write_ns / num_keys, (double)int_lookup_ns / num_keys);
+  printf("(checksum %lu)\n", (unsigned long)sum);
+
+  E(hmap_delete(hmap));
+  E(hmap_u64_delete(map64));
+}  /* test15 */
+
+/* Shared by the concurrent mode test and benchmark threads. */
+typedef struct conc_arg_s {
+  hmap_t *hmap;
+  pthread_mutex_t *lock;  /* Non-NULL: lock around lookups instead. */
+  int num_keys;
+  int iterate;
+  volatile int *stop;
+  uint64_t lookups;
+} conc_arg_t;
+
+
+/* Look up preinserted keys until told to stop; each must be found with
+ * value key+1. */
+void *conc_reader(void *in_arg) {
+  conc_arg_t *arg = in_arg;
+  uint64_t k = 0;
+  void *v;
+
+  while (!__atomic_load_n(arg->stop, __ATOMIC_RELAXED)) {
+    uint64_t id = (k * 7919) % (uint64_t)arg->num_keys;
+    ASSRT(hmap_try_lookup(arg->hmap, &id, sizeof(id), &v));
+    ASSRT(v == (void *)(uintptr_t)(id + 1));
+    k++;
+
+    if (arg->iterate && k % 10000 == 0) {
+      hmap_entry_t *entry = NULL;
+      int count = 0;
+      uint32_t token = hmap_read_begin(arg->hmap);
+      do {
+        E(hmap_next(arg->hmap, &entry));
+        if (entry && entry->key_size == sizeof(uint64_t)) {
+          count++;
+        }
+      } while (entry);
+      hmap_read_end(arg->hmap, token);
+      ASSRT(count == arg->num_keys);
+    }
+  }
+  arg->lookups = k;
+  return NULL;
+}  /* conc_reader */
+
+/* Benchmark reader: lookups only, with or without a lock around each. */
+void *conc_bench_reader(void *in_arg) {
+  conc_arg_t *arg = in_arg;
+  uint64_t k = 0;
+  uintptr_t sum = 0;
+  void *v;
+
+  while (!__atomic_load_n(arg->stop, __ATOMIC_RELAXED)) {
+    uint64_t id = (k * 7919) % (uint64_t)arg->num_keys;
+    if (arg->lock) {
+      pthread_mutex_lock(arg->lock);
+      hmap_try_lookup(arg->hmap, &id, sizeof(id), &v);
+      pthread_mutex_unlock(arg->lock);
+    } else {
+      hmap_try_lookup(arg->hmap, &id, sizeof(id), &v);
+    }
+    sum += (uintptr_t)v;
+    k++;
+  }
+  ASSRT(sum != 0);
+  arg->lookups = k;
+  return NULL;
+}  /* conc_bench_reader */
+
+
+/* Concurrent mode: lock-free readers while a writer grows the table. */
+void test16() {
+  hmap_options_t options;
+  hmap_t *hmap;
+  err_t *err;
+  pthread_t threads[4];
+  conc_arg_t args[4];
+  volatile int stop = 0;
+  int num_keys = 1000;
+  uint64_t k;
+  int i;
+  void *v;
+
+  hmap_options_init(&options);
+  options.layout = HMAP_LAYOUT_ROBINHOOD;
+  options.concurrent = 1;
+  err = hmap_create_opts(&hmap, 16, &options);  ASSRT(err->code == HMAP_ERR_PARAM);  /* CHAINED only. */
+  err_dispose(err);
+
+  options.layout = HMAP_LAYOUT_CHAINED;
+  options.max_load = 1.0;
+  options.inline_key_max = 8;  /* Writer keys are 16 bytes, so not inline. */
+  E(hmap_create_opts(&hmap, 16, &options));
+  ASSRT(hmap->conc != NULL);
+  for (k = 0; k < (uint64_t)num_keys; k++) {
+    E(hmap_write(hmap, &k, sizeof(k), (void *)(uintptr_t)(k + 1)));
+  }
+
+  for (i = 0; i < 4; i++) {
+    args[i].hmap = hmap;
+    args[i].lock = NULL;
+    args[i].num_keys = num_keys;
+    args[i].iterate = (i == 0);
+    args[i].stop = &stop;
+    ASSRT(pthread_create(&threads[i], NULL, conc_reader, &args[i]) == 0);
+  }
+
+  /* Grow the table many times while the readers run, and overwrite the
+   * preinserted keys with the values they already have. */
+  for (k = 0; k < 200000; k++) {
+    uint64_t id[2] = {k, 0xfeed};
+    E(hmap_write(hmap, id, sizeof(id), (void *)(uintptr_t)k));
+    if (k % 100 == 0) {
+      uint64_t old_id = k % (uint64_t)num_keys;
+      E(hmap_write(hmap, &old_id, sizeof(old_id), (void *)(uintptr_t)(old_id + 1)));
+    }
+  }
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < 4; i++) {
+    ASSRT(pthread_join(threads[i], NULL) == 0);
+    ASSRT(args[i].lookups > 0);
+  }
+
+  ASSRT(hmap->num_entries == num_keys + 200000);
+  ASSRT(hmap->table_size >= 200000);
+  for (k = 0; k < 200000; k++) {
+    uint64_t id[2] = {k, 0xfeed};
+    ASSRT(hmap_try_lookup(hmap, id, sizeof(id), &v));
+    ASSRT(v == (void *)(uintptr_t)k);
+  }
+
+  /* Inside its own read section a writer can't wait for readers: writes
+   * don't grow the table and removes are refused. */
+  hmap_t *small;
+  E(hmap_create_opts(&small, 16, &options));
+  uint32_t token = hmap_read_begin(small);
+  for (k = 0; k < 100; k++) {
+    E(hmap_write(small, &k, sizeof(k), (void *)(uintptr_t)(k + 1)));
+  }
+  ASSRT(small->table_size == 16);
+  k = 5;
+  err = hmap_remove(small, &k, sizeof(k), &v);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  hmap_read_end(small, token);
+  k = 100;
+  E(hmap_write(small, &k, sizeof(k), (void *)(uintptr_t)(k + 1)));
+  ASSRT(small->table_size > 16);
+  k = 5;
+  E(hmap_remove(small, &k, sizeof(k), &v));  ASSRT(v == (void *)(uintptr_t)6);
+  ASSRT(small->num_entries == 100);
+  E(hmap_delete(small));
+
+  /* Read sections are no-ops on ordinary maps. */
+  hmap_t *plain;
+  E(hmap_create(&plain, 16));
+  hmap_read_end(plain, hmap_read_begin(plain));
+  E(hmap_delete(plain));
+
+  E(hmap_delete(hmap));
+}  /* test16 */
+
+
+/* Benchmark: lookup throughput as reader threads are added, concurrent
+ * mode vs. an ordinary map behind a mutex. */
+void test17() {
+  int num_keys = 100000;
+  int thread_counts[] = {1, 2, 4, 8};
+  pthread_t threads[8];
+  conc_arg_t args[8];
+  pthread_mutex_t lock;
+  int mode, t, i;
+  uint64_t k;
+
+  pthread_mutex_init(&lock, NULL);
+  printf("mode,threads,mlookups_per_sec\n");
+  for (mode = 0; mode < 2; mode++) {
+    hmap_options_t options;
+    hmap_t *hmap;
+    hmap_options_init(&options);
+    options.concurrent = (mode == 0);
+    options.max_load = 1.0;
+    E(hmap_create_opts(&hmap, 16, &options));
+    for (k = 0; k < (uint64_t)num_keys; k++) {
+      E(hmap_write(hmap, &k, sizeof(k), (void *)(uintptr_t)(k + 1)));
+    }
+
+    for (t = 0; t < 4; t++) {
+      volatile int stop = 0;
+      uint64_t total = 0;
+      for (i = 0; i < thread_counts[t]; i++) {
+        args[i].hmap = hmap;
+        args[i].lock = (mode == 0) ? NULL : &lock;
+        args[i].num_keys = num_keys;
+        args[i].iterate = 0;
+        args[i].stop = &stop;
+        ASSRT(pthread_create(&threads[i], NULL, conc_bench_reader, &args[i]) == 0);
+      }
+      struct timespec run_time = {1, 0};
+      uint64_t start_ns = now_ns();
+      nanosleep(&run_time, NULL);
+      __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+      for (i = 0; i < thread_counts[t]; i++) {
+        ASSRT(pthread_join(threads[i], NULL) == 0);
+        total += args[i].lookups;
+      }
+      double secs = (double)(now_ns() - start_ns) / 1e9;
+      printf("%s,%d,%.2f\n", (mode == 0) ? "concurrent" : "mutex", thread_counts[t],
+          (double)total / secs / 1e6);
+      fflush(stdout);
+    }
+    E(hmap_delete(hmap));
+  }
+  pthread_mutex_destroy(&lock);
+}  /* test17 */
+
+typedef struct seg_writer_arg_s {
+  hmap_t *hmap;
+  int thread_num;
+  int num_threads;
+  int num_keys;
+} seg_writer_arg_t;
+
+
+/* Value a writer stores for a key. Keys that several threads write get the
+ * same value from each, so the final contents don't depend on timing. */
+#define SEG_VAL(seg__key) ((void *)(uintptr_t)((seg__key) * 3 + 1))
+
+
+/* Write this thread's share of the keys, plus every 10th key (which all
+ * threads write). */
+void *seg_writer(void *in_arg) {
+  seg_writer_arg_t *arg = in_arg;
+  uint64_t k;
+
+  for (k = 0; k < (uint64_t)arg->num_keys; k++) {
+    if (k % (uint64_t)arg->num_threads == (uint64_t)arg->thread_num || k % 10 == 0) {
+      uint64_t id = k * 7919;
+      E(hmap_write(arg->hmap, &id, sizeof(id), SEG_VAL(k)));
+    }
+  }
+  return NULL;
+}  /* seg_writer */
+
+
+/* Segmented map: many writers, checked against a single-threaded map. */
+void test18() {
+  hmap_options_t options;
+  hmap_t *hmap;
+  hmap_t *reference;
+  err_t *err;
+  pthread_t threads[8];
+  seg_writer_arg_t args[8];
+  int num_keys = 200000;
+  int num_entries, total_entries;
+  uint64_t contended;
+  uint64_t k;
+  int i;
+  void *v;
+
+  hmap_options_init(&options);
+  options.max_load = 1.0;
+  options.segments = 8;
+  options.layout = HMAP_LAYOUT_GROUP;
+  err = hmap_create_opts(&hmap, 16, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  options.layout = HMAP_LAYOUT_CHAINED;
+  options.segments = HMAP_MAX_SEGMENTS + 1;
+  err = hmap_create_opts(&hmap, 16, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+
+  options.segments = 8;
+  E(hmap_create_opts(&hmap, 16, &options));
+  ASSRT(hmap->num_segments == 8);
+  ASSRT(hmap->table_size == 16);  /* 8 segments of 2. */
+  options.segments = 0;
+  options.concurrent = 1;
+  E(hmap_create_opts(&reference, 16, &options));
+
+  for (i = 0; i < 8; i++) {
+    args[i].hmap = hmap;
+    args[i].thread_num = i;
+    args[i].num_threads = 8;
+    args[i].num_keys = num_keys;
+    ASSRT(pthread_create(&threads[i], NULL, seg_writer, &args[i]) == 0);
+  }
+  for (k = 0; k < (uint64_t)num_keys; k++) {
+    uint64_t id = k * 7919;
+    E(hmap_write(reference, &id, sizeof(id), SEG_VAL(k)));
+  }
+  for (i = 0; i < 8; i++) {
+    ASSRT(pthread_join(threads[i], NULL) == 0);
+  }
+
+  /* Same contents as the reference. */
+  for (k = 0; k < (uint64_t)num_keys; k++) {
+    uint64_t id = k * 7919;
+    ASSRT(hmap_try_lookup(hmap, &id, sizeof(id), &v));
+    ASSRT(v == SEG_VAL(k));
+    id++;
+    ASSRT(!hmap_try_lookup(hmap, &id, sizeof(id), &v));
+  }
+  total_entries = 0;
+  for (i = 0; i < 8; i++) {
+    E(hmap_segment_stats(hmap, i, &num_entries, &contended));
+    ASSRT(num_entries > num_keys / 16);  /* Keys are spread over the segments. */
+    ASSRT(hmap->segments[i]->table_size >= (size_t)num_entries);  /* Each grew on its own. */
+    total_entries += num_entries;
+  }
+  ASSRT(total_entries == reference->num_entries);
+  ASSRT(hmap->num_entries == num_keys);  /* The map's total follows its segments. */
+  err = hmap_segment_stats(hmap, 8, NULL, NULL);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+
+  /* Iteration visits every segment. */
+  {
+    hmap_entry_t *entry = NULL;
+    int count = 0;
+    uint32_t token = hmap_read_begin(hmap);
+    do {
+      E(hmap_next(hmap, &entry));
+      if (entry) {
+        ASSRT(hmap_try_lookup(reference, entry->key, entry->key_size, &v));
+        ASSRT(v == entry->value);
+        count++;
+      }
+    } while (entry);
+    hmap_read_end(hmap, token);
+    ASSRT(count == num_keys);
+  }
+
+  /* Overwrites don't change the total; removes do. */
+  k = 7919;
+  E(hmap_write(hmap, &k, sizeof(k), SEG_VAL(1)));
+  ASSRT(hmap->num_entries == num_keys);
+  E(hmap_remove(hmap, &k, sizeof(k), &v));  ASSRT(v == SEG_VAL(1));
+  ASSRT(hmap->num_entries == num_keys - 1);
+  hmap_stats_t stats;
+  E(hmap_stats(hmap, &stats));
+  ASSRT(stats.num_entries == (size_t)hmap->num_entries);
+
+  /* A concurrent map is one segment; it had only one writer. */
+  E(hmap_segment_stats(reference, 0, &num_entries, &contended));
+  ASSRT(num_entries == num_keys && contended == 0);
+
+  E(hmap_delete(hmap));
+  E(hmap_delete(reference));
+}  /* test18 */
+
+typedef struct shard_worker_arg_s {
+  hmap_sharded_t *sharded;
+  int shard;
+  int num_keys;  /* test19: key range. test20: keys to insert. */
+  int *done;  /* Number of workers that have sent all their writes. */
+  uint64_t *keys;  /* test20: this worker's keys. */
+} shard_worker_arg_t;
+
+
+/* Keep applying queued writes until every worker has sent all of its
+ * writes, then take whatever is left. */
+void shard_drain(shard_worker_arg_t *arg) {
+  while (__atomic_load_n(arg->done, __ATOMIC_ACQUIRE) < arg->sharded->num_shards) {
+    E(hmap_sharded_poll(arg->sharded, arg->shard, NULL));
+    sched_yield();
+  }
+  E(hmap_sharded_poll(arg->sharded, arg->shard, NULL));
+}  /* shard_drain */
+
+
+/* Write this worker's share of the keys (plus every 10th key, which all
+ * workers write), alternating single writes and batches. */
+void *shard_writer(void *in_arg) {
+  shard_worker_arg_t *arg = in_arg;
+  int num_shards = arg->sharded->num_shards;
+  const void *batch_keys[8];
+  size_t batch_sizes[8];
+  void *batch_vals[8];
+  uint64_t batch_ids[8];
+  int batch_len = 0;
+  uint64_t k;
+
+  for (k = 0; k < (uint64_t)arg->num_keys; k++) {
+    if (k % (uint64_t)num_shards != (uint64_t)arg->shard && k % 10 != 0) {
+      continue;
+    }
+    uint64_t id = k * 7919;
+    if (k & 1) {
+      E(hmap_sharded_write(arg->sharded, arg->shard, &id, sizeof(id), SEG_VAL(k)));
+    } else {
+      batch_ids[batch_len] = id;
+      batch_keys[batch_len] = &batch_ids[batch_len];
+      batch_sizes[batch_len] = sizeof(uint64_t);
+      batch_vals[batch_len] = SEG_VAL(k);
+      batch_len++;
+      if (batch_len == 8) {
+        E(hmap_sharded_write_batch(arg->sharded, arg->shard, batch_keys, batch_sizes, batch_vals, 8));
+        batch_len = 0;
+      }
+    }
+    if (k % 64 == 0) {
+      E(hmap_sharded_poll(arg->sharded, arg->shard, NULL));
+    }
+  }
+  E(hmap_sharded_write_batch(arg->sharded, arg->shard, batch_keys, batch_sizes, batch_vals, batch_len));
+  __atomic_fetch_add(arg->done, 1, __ATOMIC_RELEASE);
+
+  shard_drain(arg);
+  return NULL;
+}  /* shard_writer */
+
+
+/* Look keys up from outside the shards while they are written: any key
+ * found must have its right value. */
+void *shard_reader(void *in_arg) {
+  shard_worker_arg_t *arg = in_arg;
+  uint64_t k = 0;
+  void *v;
+
+  while (__atomic_load_n(arg->done, __ATOMIC_ACQUIRE) < arg->sharded->num_shards) {
+    uint64_t id = k * 7919;
+    if (hmap_sharded_try_lookup(arg->sharded, &id, sizeof(id), &v)) {
+      ASSRT(v == SEG_VAL(k));
+    }
+    k = (k + 1) % (uint64_t)arg->num_keys;
+  }
+  return NULL;
+}  /* shard_reader */
+
+
+/* Sharded map: workers exchange writes through queues. */
+void test19() {
+  hmap_options_t options;
+  hmap_sharded_t *sharded;
+  err_t *err;
+  pthread_t threads[5];
+  shard_worker_arg_t args[5];
+  int num_keys = 100000;
+  int done;
+  int total_entries;
+  int shared_reads;
+  uint64_t k;
+  int i;
+  void *v;
+
+  hmap_options_init(&options);
+  options.layout = HMAP_LAYOUT_ROBINHOOD;
+  options.concurrent = 1;  /* Shared reads need concurrent, so chained, shards. */
+  err = hmap_sharded_create(&sharded, 4, 16, 16, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  hmap_options_init(&options);
+  options.segments = 4;
+  err = hmap_sharded_create(&sharded, 4, 16, 16, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  hmap_options_init(&options);
+  options.max_load = 1.0;
+  err = hmap_sharded_create(&sharded, 0, 16, 16, &options);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  ASSRT(hmap_sharded_owner(NULL, &k, sizeof(k)) == -1);
+  v = (void *)1;
+  ASSRT(!hmap_sharded_try_lookup(NULL, &k, sizeof(k), &v) && v == NULL);
+  err = hmap_sharded_lookup_batch(NULL, NULL, NULL, 0, NULL, NULL);  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+
+  /* Small queues, so senders often find them full. */
+  E(hmap_sharded_create(&sharded, 4, 16, 10, &options));
+  ASSRT(sharded->num_shards == 4 && sharded->queue_size == 16);
+  ASSRT(!sharded->shared_reads && sharded->shards[0]->conc == NULL);
+
+  /* Keys too long to go in a message are sent as copies; ones still
+   * queued when the map is deleted are freed with it. */
+  {
+    char long_key[HMAP_SHARD_KEY_INLINE + 100];
+    memset(long_key, 'x', sizeof(long_key));
+    int owner = hmap_sharded_owner(sharded, long_key, sizeof(long_key));
+    E(hmap_sharded_write(sharded, (owner + 1) % 4, long_key, sizeof(long_key), SEG_VAL(1)));
+    ASSRT(!hmap_sharded_try_lookup(sharded, long_key, sizeof(long_key), &v));
+    E(hmap_sharded_poll(sharded, owner, NULL));
+    ASSRT(hmap_sharded_try_lookup(sharded, long_key, sizeof(long_key), &v) && v == SEG_VAL(1));
+    long_key[0] = 'y';
+    owner = hmap_sharded_owner(sharded, long_key, sizeof(long_key));
+    E(hmap_sharded_write(sharded, (owner + 1) % 4, long_key, sizeof(long_key), SEG_VAL(2)));
+    E(hmap_sharded_delete(sharded));
+  }
+
+  /* Owner-only shards (of any layout), then shared reads, with a thread
+   * looking keys up while the workers write. */
+  for (shared_reads = 0; shared_reads < 2; shared_reads++) {
+    hmap_options_init(&options);
+    if (shared_reads) {
+      options.max_load = 1.0;
+      options.concurrent = 1;
+    } else {
+      options.layout = HMAP_LAYOUT_ROBINHOOD;
+    }
+    E(hmap_sharded_create(&sharded, 4, 16, 10, &options));
+    ASSRT(sharded->shared_reads == shared_reads && (sharded->shards[0]->conc != NULL) == shared_reads);
+    done = 0;
+    for (i = 0; i < 4; i++) {
+      args[i].sharded = sharded;
+      args[i].shard = i;
+      args[i].num_keys = num_keys;
+      args[i].done = &done;
+      ASSRT(pthread_create(&threads[i], NULL, shard_writer, &args[i]) == 0);
+    }
+    if (shared_reads) {
+      args[4] = args[0];
+      ASSRT(pthread_create(&threads[4], NULL, shard_reader, &args[4]) == 0);
+    }
+    for (i = 0; i < 4 + shared_reads; i++) {
+      ASSRT(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /* Once every queue is drained, any thread may look up. */
+    for (k = 0; k < (uint64_t)num_keys; k++) {
+      uint64_t id = k * 7919;
+      ASSRT(hmap_sharded_try_lookup(sharded, &id, sizeof(id), &v));
+      ASSRT(v == SEG_VAL(k));
+      id++;
+      ASSRT(!hmap_sharded_try_lookup(sharded, &id, sizeof(id), &v));
+    }
+    {
+      uint64_t ids[100];
+      const void *key_ptrs[100];
+      size_t key_sizes[100];
+      void *vals[100];
+      size_t num_found;
+      for (i = 0; i < 100; i++) {
+        ids[i] = (uint64_t)i * 7919 + (i % 10 == 9);  /* Every 10th misses. */
+        key_ptrs[i] = &ids[i];
+        key_sizes[i] = sizeof(uint64_t);
+      }
+      E(hmap_sharded_lookup_batch(sharded, key_ptrs, key_sizes, 100, vals, &num_found));
+      ASSRT(num_found == 90);
+      for (i = 0; i < 100; i++) {
+        ASSRT(vals[i] == ((i % 10 == 9) ? NULL : SEG_VAL(i)));
+      }
+    }
+
+    /* Each shard holds only the keys it owns. */
+    total_entries = 0;
+    for (i = 0; i < 4; i++) {
+      hmap_entry_t *entry = NULL;
+      uint32_t token = hmap_read_begin(sharded->shards[i]);
+      do {
+        E(hmap_next(sharded->shards[i], &entry));
+        if (entry) {
+          ASSRT(hmap_sharded_owner(sharded, entry->key, entry->key_size) == i);
+        }
+      } while (entry);
+      hmap_read_end(sharded->shards[i], token);
+      ASSRT(sharded->shards[i]->num_entries > num_keys / 8);
+      total_entries += sharded->shards[i]->num_entries;
+    }
+    ASSRT(total_entries == num_keys);
+    E(hmap_sharded_delete(sharded));
+  }  /* for shared_reads */
+}  /* test19 */
+
+
+/* Benchmark worker: insert this worker's keys in batches. */
+void *shard_bench_writer(void *in_arg) {
+  shard_worker_arg_t *arg = in_arg;
+  const void *batch_keys[64];
+  size_t batch_sizes[64];
+  void *batch_vals[64];
+  int i, j;
+
+  for (i = 0; i < arg->num_keys; i += 64) {
+    int batch_len = (arg->num_keys - i < 64) ? arg->num_keys - i : 64;
+    for (j = 0; j < batch_len; j++) {
+      batch_keys[j] = &arg->keys[i + j];
+      batch_sizes[j] = sizeof(uint64_t);
+      batch_vals[j] = (void *)(uintptr_t)(i + j + 1);
+    }
+    E(hmap_sharded_write_batch(arg->sharded, arg->shard, batch_keys, batch_sizes, batch_vals, batch_len));
+    E(hmap_sharded_poll(arg->sharded, arg->shard, NULL));
+  }
+  __atomic_fetch_add(arg->done, 1, __ATOMIC_RELEASE);
+
+  shard_drain(arg);
+  return NULL;
+}  /* shard_bench_writer */
+
+
+/* Benchmark: insert throughput of a sharded map as workers are added.
+ * Each worker inserts the same number of random keys, so perfect scaling
+ * is constant time per run. */
+void test20() {
+  int keys_per_worker = 500000;
+  int worker_counts[] = {1, 2, 4, 8};
+  pthread_t threads[8];
+  shard_worker_arg_t args[8];
+  hmap_options_t options;
+  int t, i, j;
+
+  hmap_options_init(&options);
+  options.max_load = 1.0;
+  printf("workers,minserts_per_sec\n");
+  for (t = 0; t < 4; t++) {
+    int num_workers = worker_counts[t];
+    hmap_sharded_t *sharded;
+    int done = 0;
+    E(hmap_sharded_create(&sharded, num_workers, 1024, 4096, &options));
+    for (i = 0; i < num_workers; i++) {
+      args[i].sharded = sharded;
+      args[i].shard = i;
+      args[i].num_keys = keys_per_worker;
+      args[i].done = &done;
+      args[i].keys = malloc(keys_per_worker * sizeof(uint64_t));
+      ASSRT(args[i].keys);
+      for (j = 0; j < keys_per_worker; j++) {
+        uint64_t k = (uint64_t)i * keys_per_worker + j;
+        args[i].keys[j] = k * 0x9e3779b97f4a7c15ull;
+      }
+    }
+
+    uint64_t start_ns = now_ns();
+    for (i = 0; i < num_workers; i++) {
+      ASSRT(pthread_create(&threads[i], NULL, shard_bench_writer, &args[i]) == 0);
+    }
+    for (i = 0; i < num_workers; i++) {
+      ASSRT(pthread_join(threads[i], NULL) == 0);
+    }
+    uint64_t elapsed_ns = now_ns() - start_ns;
+
+    printf("%d,%.2f\n", num_workers, (double)num_workers * keys_per_worker / ((double)elapsed_ns / 1e9) / 1e6);
+    fflush(stdout);
+    for (i = 0; i < num_workers; i++) {
+      free(args[i].keys);
+    }
+    E(hmap_sharded_delete(sharded));
+  }
+}  /* test20 */
+
+
+/* hmap_lookup_batch() agrees with hmap_try_lookup(). */
+void test21() {
+  int layouts[] = {HMAP_LAYOUT_CHAINED, HMAP_LAYOUT_ROBINHOOD, HMAP_LAYOUT_GROUP,
+      HMAP_LAYOUT_CHAINED, HMAP_LAYOUT_CHAINED};
+  const void *keys[300];
+  size_t key_sizes[300];
+  void *vals[300];
+  char key_bufs[300][16];
+  size_t num_found, expect_found;
+  int layout, i;
+  void *v;
+
+  for (layout = 0; layout < 5; layout++) {
+    hmap_options_t options;
+    hmap_t *hmap;
+    hmap_options_init(&options);
+    options.layout = layouts[layout];
+    options.max_load = (layouts[layout] == HMAP_LAYOUT_CHAINED) ? 1.0 : 0;
+    options.concurrent = (layout == 3);
+    options.segments = (layout == 4) ? 4 : 0;
+    E(hmap_create_opts(&hmap, 7, &options));
+    for (i = 0; i < 200; i++) {
+      snprintf(key_bufs[0], sizeof(key_bufs[0]), "key%d", i);
+      E(hmap_swrite(hmap, key_bufs[0], (void *)(uintptr_t)(i + 1)));
+    }
+
+    /* Hits and misses, in a batch longer than one chunk. */
+    for (i = 0; i < 300; i++) {
+      snprintf(key_bufs[i], sizeof(key_bufs[i]), "key%d", (i * 7) % 400);
+      keys[i] = key_bufs[i];
+      key_sizes[i] = strlen(key_bufs[i]) + 1;
+      vals[i] = (void *)1;
+    }
+    E(hmap_lookup_batch(hmap, keys, key_sizes, 300, vals, &num_found));
+    expect_found = 0;
+    for (i = 0; i < 300; i++) {
+      int found = hmap_try_lookup(hmap, keys[i], key_sizes[i], &v);
+      ASSRT(found == ((i * 7) % 400 < 200));
+      ASSRT(vals[i] == v);
+      expect_found += found;
+    }
+    ASSRT(num_found == expect_found);
+
+    E(hmap_lookup_batch(hmap, NULL, NULL, 0, NULL, &num_found));
+    ASSRT(num_found == 0);
+    E(hmap_delete(hmap));
+  }
+}  /* test21 */
+
+
+/* Benchmark: hmap_lookup_batch() vs. a loop of hmap_try_lookup() on
+ * tables much bigger than the last level cache. */
+void test22() {
+  int num_keys = 1 << 23;
+  int batch_sizes[] = {32, 256};
+  int layouts[] = {HMAP_LAYOUT_CHAINED, HMAP_LAYOUT_ROBINHOOD, HMAP_LAYOUT_GROUP};
+  const char *layout_names[] = {"chained", "robinhood", "group"};
+  uint64_t *lookup_ids = malloc(num_keys * sizeof(uint64_t));
+  const void **keys = malloc(num_keys * sizeof(void *));
+  size_t *key_sizes = malloc(num_keys * sizeof(size_t));
+  void **vals = malloc(num_keys * sizeof(void *));
+  uintptr_t sum = 0;
+  int layout, b, i;
+  void *v;
+
+  ASSRT(lookup_ids && keys && key_sizes && vals);
+  for (i = 0; i < num_keys; i++) {
+    lookup_ids[i] = ((uint64_t)i * 2654435761u) % (uint64_t)num_keys;  /* Random order. */
+    keys[i] = &lookup_ids[i];
+    key_sizes[i] = sizeof(uint64_t);
+  }
+
+  printf("layout,batch,lookup_ns\n");
+  for (layout = 0; layout < 3; layout++) {
+    hmap_options_t options;
+    hmap_t *hmap;
+    uint64_t k, start_ns;
+    hmap_options_init(&options);
+    options.layout = layouts[layout];
+    E(hmap_create_opts(&hmap, (size_t)(num_keys / 0.8), &options));
+    for (k = 0; k < (uint64_t)num_keys; k++) {
+      E(hmap_write(hmap, &k, sizeof(k), (void *)(uintptr_t)(k + 1)));
+    }
+
+    start_ns = now_ns();
+    for (i = 0; i < num_keys; i++) {
+      hmap_try_lookup(hmap, keys[i], key_sizes[i], &v);
+      sum += (uintptr_t)v;
+    }
+    printf("%s,1,%.1f\n", layout_names[layout], (double)(now_ns() - start_ns) / num_keys);
+    fflush(stdout);
+
+    for (b = 0; b < 2; b++) {
+      start_ns = now_ns();
+      for (i = 0; i < num_keys; i += batch_sizes[b]) {
+        E(hmap_lookup_batch(hmap, &keys[i], &key_sizes[i], batch_sizes[b], &vals[i], NULL));
+      }
+      printf("%s,%d,%.1f\n", layout_names[layout], batch_sizes[b], (double)(now_ns() - start_ns) / num_keys);
+      fflush(stdout);
+      for (i = 0; i < num_keys; i++) {
+        sum += (uintptr_t)vals[i];
+      }
+    }
+    E(hmap_delete(hmap));
+  }
+  printf("(checksum %lu)\n", (unsigned long)sum);
+
+  free(lookup_ids);
+  free(keys);
+  free(key_sizes);
+  free(vals);
+}  /* test22 */
+
+
+/* hmap_write_batch(). */
+void test23() {
+  int layouts[] = {HMAP_LAYOUT_CHAINED, HMAP_LAYOUT_CHAINED, HMAP_LAYOUT_CHAINED,
+      HMAP_LAYOUT_ROBINHOOD, HMAP_LAYOUT_GROUP};
+  int num_keys = 5000;
+  const void **keys = malloc(num_keys * sizeof(void *));
+  size_t *key_sizes = malloc(num_keys * sizeof(size_t));
+  void **vals = malloc(num_keys * sizeof(void *));
+  char (*key_bufs)[48] = malloc(num_keys * sizeof(*key_bufs));
+  int variant, i;
+  void *v;
+
+  ASSRT(keys && key_sizes && vals && key_bufs);
+  /* Some keys are longer than inline_key_max. */
+  for (i = 0; i < num_keys; i++) {
+    snprintf(key_bufs[i], sizeof(key_bufs[i]), (i % 3 == 0) ? "a long key, not stored inline %d" : "k%d", i);
+    keys[i] = key_bufs[i];
+    key_sizes[i] = strlen(key_bufs[i]) + 1;
+    vals[i] = (void *)(uintptr_t)(i + 1);
+  }
+
+  for (variant = 0; variant < 5; variant++) {
+    hmap_options_t options;
+    hmap_t *hmap;
+    hmap_entry_t *entry;
+    int count;
+    hmap_options_init(&options);
+    options.layout = layouts[variant];
+    options.max_load = (layouts[variant] == HMAP_LAYOUT_CHAINED) ? 1.0 : 0;
+    options.arena_slab_size = (variant == 1) ? 4096 : 0;
+    options.concurrent = (variant == 2);
+    E(hmap_create_opts(&hmap, 7, &options));
+
+    /* Existing keys are overwritten. */
+    E(hmap_swrite(hmap, key_bufs[10], NULL));
+    E(hmap_swrite(hmap, "not in batch", (void *)1));
+    E(hmap_write_batch(hmap, keys, key_sizes, vals, num_keys, 0));
+    ASSRT(hmap->num_entries == num_keys + 1);
+    if (variant == 0) {
+      ASSRT(hmap->table_size >= (size_t)num_keys);  /* Sized up front. */
+      ASSRT(hmap->old_table == NULL);
+    }
+    for (i = 0; i < num_keys; i++) {
+      ASSRT(hmap_try_lookup(hmap, keys[i], key_sizes[i], &v));
+      ASSRT(v == vals[i]);
+    }
+    ASSRT(hmap_try_slookup(hmap, "not in batch", &v) && v == (void *)1);
+
+    /* Repeats within a batch: the last one wins. */
+    {
+      const void *dup_keys[3] = {"dup", "dup", "other"};
+      size_t dup_sizes[3] = {4, 4, 6};
+      void *dup_vals[3] = {(void *)1, (void *)2, (void *)3};
+      E(hmap_write_batch(hmap, dup_keys, dup_sizes, dup_vals, 3, 0));
+      ASSRT(hmap_try_slookup(hmap, "dup", &v) && v == (void *)2);
+      ASSRT(hmap->num_entries == num_keys + 3);
+    }
+
+    /* Unique keys skip the duplicate check. */
+    {
+      const void *new_keys[2] = {"new1", "new2"};
+      size_t new_sizes[2] = {5, 5};
+      void *new_vals[2] = {(void *)4, (void *)5};
+      E(hmap_write_batch(hmap, new_keys, new_sizes, new_vals, 2, HMAP_BATCH_UNIQUE));
+      ASSRT(hmap_try_slookup(hmap, "new2", &v) && v == (void *)5);
+      E(hmap_write_batch(hmap, NULL, NULL, NULL, 0, 0));
+    }
+
+    /* Bulk entries behave like any others. */
+    E(hmap_swrite(hmap, key_bufs[0], (void *)7));
+    ASSRT(hmap_try_slookup(hmap, key_bufs[0], &v) && v == (void *)7);
+    for (i = 0; i < num_keys; i++) {
+      char key[16];
+      snprintf(key, sizeof(key), "grow%d", i);
+      E(hmap_swrite(hmap, key, NULL));
+    }
+    ASSRT(hmap_try_slookup(hmap, key_bufs[1], &v) && v == vals[1]);
+    count = 0;
+    entry = NULL;
+    do {
+      E(hmap_next(hmap, &entry));
+      count += (entry != NULL);
+    } while (entry);
+    ASSRT(count == hmap->num_entries);
+
+    E(hmap_delete(hmap));
+  }
+
+  free(keys);
+  free(key_sizes);
+  free(vals);
+  free(key_bufs);
+}  /* test23 */
+
+
+/* Benchmark: loading a map with hmap_write() vs. hmap_write_batch(). */
+void test24() {
+  int num_keys = 4000000;
+  uint64_t *ids = malloc(num_keys * sizeof(uint64_t));
+  const void **keys = malloc(num_keys * sizeof(void *));
+  size_t *key_sizes = malloc(num_keys * sizeof(size_t));
+  void **vals = malloc(num_keys * sizeof(void *));
+  const char *method_names[] = {"hmap_write", "hmap_write_batch", "hmap_write_batch(UNIQUE)"};
+  hmap_options_t options;
+  int method, i;
+
+  ASSRT(ids && keys && key_sizes && vals);
+  for (i = 0; i < num_keys; i++) {
+    ids[i] = (uint64_t)i * 0x9e3779b97f4a7c15ull;
+    keys[i] = &ids[i];
+    key_sizes[i] = sizeof(uint64_t);
+    vals[i] = (void *)(uintptr_t)(i + 1);
+  }
+  hmap_options_init(&options);
+  options.max_load = 1.0;
+
+  printf("method,load_ns_per_key\n");
+  for (method = 0; method < 3; method++) {
+    hmap_t *hmap;
+    uint64_t start_ns = now_ns();
+    E(hmap_create_opts(&hmap, 1024, &options));
+    if (method == 0) {
+      for (i = 0; i < num_keys; i++) {
+        E(hmap_write(hmap, keys[i], key_sizes[i], vals[i]));
+      }
+    } else {
+      E(hmap_write_batch(hmap, keys, key_sizes, vals, num_keys, (method == 2) ? HMAP_BATCH_UNIQUE : 0));
+    }
+    printf("%s,%.1f\n", method_names[method], (double)(now_ns() - start_ns) / num_keys);
+    fflush(stdout);
+    ASSRT(hmap->num_entries == num_keys);
+    E(hmap_delete(hmap));
+  }
+
+  free(ids);
+  free(keys);
+  free(key_sizes);
+  free(vals);
+}  /* test24 */
+
+
+/* Parallel bulk load and rehash give the same map as the serial ones. */
+void test25() {
+  int num_keys = 200000;
+  int num_ids = 150000;  /* So a quarter of the batch repeats keys. */
+  const void **keys = malloc(num_keys * sizeof(void *));
+  size_t *key_sizes = malloc(num_keys * sizeof(size_t));
+  void **vals = malloc(num_keys * sizeof(void *));
+  char (*key_bufs)[48] = malloc(num_keys * sizeof(*key_bufs));
+  int thread_counts[] = {1, 2, 3, 8};
+  hmap_options_t options;
+  hmap_t *hmap;
+  err_t *err;
+  int variant, i;
+  void *v;
+
+  ASSRT(keys && key_sizes && vals && key_bufs);
+  for (i = 0; i < num_keys; i++) {
+    int id = i % num_ids;
+    snprintf(key_bufs[i], sizeof(key_bufs[i]), (id % 3 == 0) ? "a long key, not stored inline %d" : "k%d", id);
+    keys[i] = key_bufs[i];
+    key_sizes[i] = strlen(key_bufs[i]) + 1;
+    vals[i] = (void *)(uintptr_t)(i + 1);
+  }
+
+  hmap_options_init(&options);
+  options.build_threads = HMAP_MAX_BUILD_THREADS + 1;
+  err = hmap_create_opts(&hmap, 16, &options);
+  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  options.build_threads = 2;
+  options.layout = HMAP_LAYOUT_GROUP;
+  err = hmap_create_opts(&hmap, 16, &options);
+  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+
+  for (variant = 0; variant < 4; variant++) {
+    hmap_entry_t *entry;
+    int count;
+    hmap_options_init(&options);
+    options.max_load = 1.0;
+    options.build_threads = thread_counts[variant];
+    E(hmap_create_opts(&hmap, 1000, &options));
+
+    E(hmap_swrite(hmap, key_bufs[10], NULL));
+    E(hmap_swrite(hmap, "not in batch", (void *)1));
+    E(hmap_write_batch(hmap, keys, key_sizes, vals, num_keys, 0));
+    ASSRT(hmap->num_entries == num_ids + 1);
+    ASSRT(hmap->table_size >= (size_t)num_ids);
+    /* Repeats within a batch: the last one wins. */
+    for (i = 0; i < num_ids; i++) {
+      int last = (i + num_ids < num_keys) ? i + num_ids : i;
+      ASSRT(hmap_try_lookup(hmap, keys[i], key_sizes[i], &v));
+      ASSRT(v == vals[last]);
+    }
+    ASSRT(hmap_try_slookup(hmap, "not in batch", &v) && v == (void *)1);
+
+    /* Entries are in their right buckets, so a lookup of each key from
+     * an iteration finds that same entry. */
+    count = 0;
+    entry = NULL;
+    do {
+      E(hmap_next(hmap, &entry));
+      if (entry) {
+        ASSRT(hmap_try_lookup(hmap, entry->key, entry->key_size, &v) && v == entry->value);
+        count++;
+      }
+    } while (entry);
+    ASSRT(count == hmap->num_entries);
+
+    /* Growth through single writes (all at once with build_threads). */
+    size_t old_table_size = hmap->table_size;
+    for (i = 0; (size_t)hmap->num_entries <= old_table_size; i++) {
+      char key[16];
+      snprintf(key, sizeof(key), "grow%d", i);
+      E(hmap_swrite(hmap, key, (void *)(uintptr_t)i));
+    }
+    ASSRT(hmap->table_size > old_table_size);
+    if (thread_counts[variant] > 1) {
+      ASSRT(hmap->old_table == NULL);
+    }
+    ASSRT(hmap_try_slookup(hmap, "grow0", &v) && v == (void *)0);
+    for (i = 0; i < num_ids; i++) {
+      ASSRT(hmap_try_lookup(hmap, keys[i], key_sizes[i], &v));
+    }
+    count = 0;
+    entry = NULL;
+    do {
+      E(hmap_next(hmap, &entry));
+      count += (entry != NULL);
+    } while (entry);
+    ASSRT(count == hmap->num_entries);
+
+    E(hmap_delete(hmap));
+  }
+
+  free(keys);
+  free(key_sizes);
+  free(vals);
+  free(key_bufs);
+}  /* test25 */
+
+
+/* Benchmark: bulk load and rehash time by build_threads. The load goes
+ * into a growing map (so includes its rehashes); the rehash is a table
+ * doubling of the loaded map, triggered by a one-key batch. */
+void test26() {
+  int num_keys = 1 << 22;
+  uint64_t *ids = malloc((num_keys + 1) * sizeof(uint64_t));
+  const void **keys = malloc((num_keys + 1) * sizeof(void *));
+  size_t *key_sizes = malloc((num_keys + 1) * sizeof(size_t));
+  void **vals = malloc((num_keys + 1) * sizeof(void *));
+  int thread_counts[] = {1, 2, 4, 8, 16, 32};
+  double load_ns_1 = 0, rehash_ns_1 = 0;
+  int variant, i;
+
+  ASSRT(ids && keys && key_sizes && vals);
+  for (i = 0; i <= num_keys; i++) {
+    ids[i] = (uint64_t)i * 0x9e3779b97f4a7c15ull;
+    keys[i] = &ids[i];
+    key_sizes[i] = sizeof(uint64_t);
+    vals[i] = (void *)(uintptr_t)(i + 1);
+  }
+
+  printf("threads,load_ns_per_key,rehash_ms,load_speedup,rehash_speedup\n");
+  for (variant = 0; variant < 6; variant++) {
+    hmap_options_t options;
+    hmap_t *hmap;
+    hmap_options_init(&options);
+    options.max_load = 1.0;
+    options.build_threads = thread_counts[variant];
+
+    uint64_t start_ns = now_ns();
+    E(hmap_create_opts(&hmap, 1024, &options));
+    E(hmap_write_batch(hmap, keys, key_sizes, vals, num_keys, 0));
+    double load_ns = (double)(now_ns() - start_ns);
+    ASSRT(hmap->table_size == (size_t)num_keys);
+
+    start_ns = now_ns();
+    E(hmap_write_batch(hmap, &keys[num_keys], &key_sizes[num_keys], &vals[num_keys], 1, 0));
+    double rehash_ns = (double)(now_ns() - start_ns);
+    ASSRT(hmap->table_size == (size_t)num_keys * 2);
+
+    if (variant == 0) {
+      load_ns_1 = load_ns;
+      rehash_ns_1 = rehash_ns;
+    }
+    printf("%d,%.1f,%.1f,%.2f,%.2f\n", thread_counts[variant], load_ns / num_keys,
+        rehash_ns / 1000000.0, load_ns_1 / load_ns, rehash_ns_1 / rehash_ns);
+    fflush(stdout);
+    E(hmap_delete(hmap));
+  }
+
+  free(ids);
+  free(keys);
+  free(key_sizes);
+  free(vals);
+}  /* test26 */
+
+
+/* hmap_remove() in every layout and mode, with writes and removes mixed
+ * so that backward shifts and partly migrated tables get exercised. */
+void test27() {
+  int num_ids = 20000;
+  int num_conc_keys = 1000;  /* uint64 keys the concurrent readers look up. */
+  char (*key_bufs)[48] = malloc(num_ids * sizeof(*key_bufs));
+  const void **keys = malloc(num_ids * sizeof(void *));
+  size_t *key_sizes = malloc(num_ids * sizeof(size_t));
+  void **vals = malloc(num_ids * sizeof(void *));
+  char *present = malloc(num_ids);
+  int variant, i;
+  void *v;
+
+  ASSRT(key_bufs && keys && key_sizes && vals && present);
+  for (i = 0; i < num_ids; i++) {
+    snprintf(key_bufs[i], sizeof(key_bufs[i]), (i % 3 == 0) ? "a long key, not stored inline %d" : "k%d", i);
+    keys[i] = key_bufs[i];
+    key_sizes[i] = strlen(key_bufs[i]) + 1;
+    vals[i] = (void *)(uintptr_t)(i + 1);
+  }
+
+  for (variant = 0; variant < 8; variant++) {
+    hmap_options_t options;
+    hmap_t *hmap;
+    hmap_entry_t *entry;
+    pthread_t threads[2];
+    conc_arg_t args[2];
+    volatile int stop = 0;
+    int extra = 0;
+    int count;
+    uint64_t k, r;
+    err_t *err;
+
+    hmap_options_init(&options);
+    switch (variant) {  /* 0: chained, 7: chained, bulk loaded. */
+      case 1: options.max_load = 1.0; break;
+      case 2: options.arena_slab_size = 4096; break;
+      case 3: options.concurrent = 1; options.max_load = 1.0; break;
+      case 4: options.segments = 4; options.max_load = 1.0; break;
+      case 5: options.layout = HMAP_LAYOUT_ROBINHOOD; break;
+      case 6: options.layout = HMAP_LAYOUT_GROUP; break;
+      default: break;
+    }
+    E(hmap_create_opts(&hmap, (variant == 1 || variant >= 3) ? 64 : 10007, &options));
+
+    if (variant == 3) {
+      extra = num_conc_keys;
+      for (k = 0; k < (uint64_t)num_conc_keys; k++) {
+        E(hmap_write(hmap, &k, sizeof(k), (void *)(uintptr_t)(k + 1)));
+      }
+      for (i = 0; i < 2; i++) {
+        args[i].hmap = hmap;
+        args[i].lock = NULL;
+        args[i].num_keys = num_conc_keys;
+        args[i].iterate = (i == 0);
+        args[i].stop = &stop;
+        ASSRT(pthread_create(&threads[i], NULL, conc_reader, &args[i]) == 0);
+      }
+    }
+
+    if (variant == 7) {
+      E(hmap_write_batch(hmap, keys, key_sizes, vals, num_ids, 0));
+    } else {
+      for (i = 0; i < num_ids; i++) {
+        E(hmap_write(hmap, keys[i], key_sizes[i], vals[i]));
+      }
+    }
+    memset(present, 1, num_ids);
+
+    /* Remove every odd key, getting its value back. */
+    for (i = 1; i < num_ids; i += 2) {
+      E(hmap_sremove(hmap, key_bufs[i], &v));
+      ASSRT(v == vals[i]);
+      present[i] = 0;
+    }
+    err = hmap_sremove(hmap, key_bufs[1], &v);
+    ASSRT(err->code == HMAP_ERR_NOTFOUND);
+    err_dispose(err);
+    ASSRT(v == NULL);
+
+    /* Churn: remove present keys and rewrite absent ones. */
+    r = 12345;
+    for (i = 0; i < 100000; i++) {
+      int id;
+      r = r * 6364136223846793005ull + 1442695040888963407ull;
+      id = (int)((r >> 33) % (uint64_t)num_ids);
+      if (present[id]) {
+        E(hmap_remove(hmap, keys[id], key_sizes[id], NULL));
+      } else {
+        E(hmap_write(hmap, keys[id], key_sizes[id], vals[id]));
+      }
+      present[id] = !present[id];
+    }
+
+    count = 0;
+    for (i = 0; i < num_ids; i++) {
+      if (present[i]) {
+        ASSRT(hmap_try_lookup(hmap, keys[i], key_sizes[i], &v) && v == vals[i]);
+        count++;
+      } else {
+        ASSRT(!hmap_try_lookup(hmap, keys[i], key_sizes[i], &v) && v == NULL);
+      }
+    }
+    if (variant != 4) {
+      ASSRT(hmap->num_entries == count + extra);
+    }
+    entry = NULL;
+    do {
+      E(hmap_next(hmap, &entry));
+      if (entry) {
+        count--;
+      }
+    } while (entry);
+    ASSRT(count + extra == 0);
+
+    /* Remove everything. */
+    for (i = 0; i < num_ids; i++) {
+      if (present[i]) {
+        E(hmap_remove(hmap, keys[i], key_sizes[i], &v));
+        ASSRT(v == vals[i]);
+      }
+    }
+    if (variant == 3) {
+      __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+      for (i = 0; i < 2; i++) {
+        ASSRT(pthread_join(threads[i], NULL) == 0);
+        ASSRT(args[i].lookups > 0);
+      }
+      for (k = 0; k < (uint64_t)num_conc_keys; k++) {
+        E(hmap_remove(hmap, &k, sizeof(k), NULL));
+      }
+    }
+    if (variant != 4) {
+      ASSRT(hmap->num_entries == 0);
+    }
+    entry = NULL;
+    E(hmap_next(hmap, &entry));
+    ASSRT(entry == NULL);
+    if (variant == 2) {
+      size_t used, reserved;
+      E(hmap_arena_usage(hmap, &used, &reserved));
+      ASSRT(used == 0 && reserved > 0);  /* All recycled. */
+    }
+
+    E(hmap_delete(hmap));
+  }
+
+  free(key_bufs);
+  free(keys);
+  free(key_sizes);
+  free(vals);
+  free(present);
+}  /* test27 */
+
+
+/* hmap_get_or_insert(): counting with in-place updates matches counting
+ * with lookups and writes, in each layout. */
+void test28() {
+  int num_ids = 5000;
+  int num_incs = 50000;
+  int variant;
+
+  for (variant = 0; variant < 5; variant++) {
+    hmap_options_t options;
+    hmap_t *hmap;
+    hmap_t *ref;
+    hmap_entry_t *entry;
+    void **val_ptr;
+    int inserted, i, num_inserted = 0;
+    uint64_t r = 99;
+    void *v;
+
+    hmap_options_init(&options);
+    options.max_load = 0.75;
+    switch (variant) {
+      case 0: options.max_load = 1.0; break;  /* Chained, resizing. */
+      case 1: options.max_load = 1.0; options.arena_slab_size = 4096; break;
+      case 2: options.layout = HMAP_LAYOUT_ROBINHOOD; break;
+      case 3: options.layout = HMAP_LAYOUT_GROUP; break;
+      case 4: options.max_load = 0; break;  /* Chained, fixed size. */
+      default: break;
+    }
+    E(hmap_create_opts(&hmap, 16, &options));
+    E(hmap_create(&ref, 10007));
+
+    for (i = 0; i < num_incs; i++) {
+      char key[48];
+      int id;
+      r = r * 6364136223846793005ull + 1442695040888963407ull;
+      id = (int)((r >> 33) % (uint64_t)num_ids);
+      snprintf(key, sizeof(key), (id % 3 == 0) ? "a long key, not stored inline %d" : "k%d", id);
+
+      E(hmap_sget_or_insert(hmap, key, &val_ptr, &inserted));
+      if (inserted) {
+        ASSRT(*val_ptr == NULL);
+        num_inserted++;
+      }
+      *val_ptr = (void *)((uintptr_t)*val_ptr + 1);
+
+      if (hmap_try_slookup(ref, key, &v)) {
+        ASSRT(!inserted);
+      } else {
+        ASSRT(inserted);
+        v = NULL;
+      }
+      E(hmap_swrite(ref, key, (void *)((uintptr_t)v + 1)));
+    }
+    ASSRT(hmap->num_entries == num_inserted && ref->num_entries == num_inserted);
+
+    entry = NULL;
+    do {
+      E(hmap_next(ref, &entry));
+      if (entry) {
+        ASSRT(hmap_try_lookup(hmap, entry->key, entry->key_size, &v) && v == entry->value);
+      }
+    } while (entry);
+
+    /* The pointer is to the stored value. */
+    E(hmap_get_or_insert(hmap, "k1", 3, &val_ptr, NULL));
+    *val_ptr = (void *)7;
+    ASSRT(hmap_try_slookup(hmap, "k1", &v) && v == (void *)7);
+
+    E(hmap_delete(hmap));
+    E(hmap_delete(ref));
+  }
+
+  {
+    hmap_options_t options;
+    hmap_t *hmap;
+    void **val_ptr;
+    err_t *err;
+    hmap_options_init(&options);
+    options.concurrent = 1;
+    E(hmap_create_opts(&hmap, 16, &options));
+    err = hmap_sget_or_insert(hmap, "key", &val_ptr, NULL);
+    ASSRT(err->code == HMAP_ERR_PARAM);
+    err_dispose(err);
+    E(hmap_delete(hmap));
+  }
+}  /* test28 */
+
+
+/* Benchmark: counting keys with hmap_lookup() + hmap_write(),
+ * hmap_try_lookup() + hmap_write(), and hmap_get_or_insert(). */
+void test29() {
+  static const char *method_names[] = {"lookup+write", "try_lookup+write", "get_or_insert"};
+  int num_ids = 1000000;
+  int num_incs = 10000000;
+  uint64_t *ids = malloc(num_incs * sizeof(uint64_t));
+  int method, i;
+
+  ASSRT(ids);
+  for (i = 0; i < num_incs; i++) {
+    ids[i] = hmap_fmix64((uint64_t)i % (uint64_t)num_ids + 1);
+  }
+
+  printf("method,ns_per_inc\n");
+  for (method = 0; method < 3; method++) {
+    hmap_options_t options;
+    hmap_t *hmap;
+    void **val_ptr;
+    void *v;
+    hmap_options_init(&options);
+    options.max_load = 1.0;
+    E(hmap_create_opts(&hmap, 1024, &options));
+
+    uint64_t start_ns = now_ns();
+    for (i = 0; i < num_incs; i++) {
+      if (method == 0) {
+        err_t *err = hmap_lookup(hmap, &ids[i], sizeof(uint64_t), &v);
+        if (err) {
+          err_dispose(err);
+          v = NULL;
+        }
+        E(hmap_write(hmap, &ids[i], sizeof(uint64_t), (void *)((uintptr_t)v + 1)));
+      } else if (method == 1) {
+        if (!hmap_try_lookup(hmap, &ids[i], sizeof(uint64_t), &v)) {
+          v = NULL;
+        }
+        E(hmap_write(hmap, &ids[i], sizeof(uint64_t), (void *)((uintptr_t)v + 1)));
+      } else {
+        E(hmap_get_or_insert(hmap, &ids[i], sizeof(uint64_t), &val_ptr, NULL));
+        *val_ptr = (void *)((uintptr_t)*val_ptr + 1);
+      }
+    }
+    printf("%s,%.1f\n", method_names[method], (double)(now_ns() - start_ns) / num_incs);
+    fflush(stdout);
+    ASSRT(hmap->num_entries == num_ids);
+    ASSRT(hmap_try_lookup(hmap, &ids[0], sizeof(uint64_t), &v) && v == (void *)(uintptr_t)(num_incs / num_ids));
+    E(hmap_delete(hmap));
+  }
+
+  free(ids);
+}  /* test29 */
+
+
+/* Walk a stats histogram: returns the number of entries it accounts for
+ * (when no chain is HMAP_STATS_HIST - 1 or longer). */
+size_t stats_hist_total(const hmap_stats_t *stats, size_t *rtn_count) {
+  size_t total = 0;
+  size_t count = 0;
+  int length;
+  for (length = 0; length < HMAP_STATS_HIST; length++) {
+    total += (size_t)length * stats->chain_hist[length];
+    count += stats->chain_hist[length];
+  }
+  *rtn_count = count;
+  return total;
+}  /* stats_hist_total */
+
+
+uint64_t stats_bad_hash(const void *key, size_t key_size, uint32_t seed) {
+  (void)seed;
+  return hmap_murmur3_32(key, key_size, 42) & 3;  /* Four buckets at most. */
+}  /* stats_bad_hash */
+
+
+/* Look up keys 0 to 1999 (1000 of them hits) in a mapped map. */
+void *stats_mapped_reader(void *in_arg) {
+  hmap_t *mapped = in_arg;
+  uint64_t k;
+  void *v;
+  for (k = 0; k < 2000; k++) {
+    hmap_try_lookup(mapped, &k, sizeof(k), &v);
+  }
+  return NULL;
+}  /* stats_mapped_reader */
+
+
+/* hmap_stats(): table shape in each layout, and (with -DHMAP_COUNTERS)
+ * the operation counters. */
+void test30() {
+  hmap_options_t options;
+  hmap_stats_t stats;
+  hmap_t *hmap;
+  size_t count;
+  uint64_t k;
+  void *v;
+
+  /* Overloaded fixed-size chained table. */
+  E(hmap_create(&hmap, 1000));
+  for (k = 0; k < 3000; k++) {
+    E(hmap_write(hmap, &k, sizeof(k), (void *)(uintptr_t)(k + 1)));
+  }
+  for (k = 0; k < 4000; k++) {  /* 3000 hits, 1000 misses. */
+    hmap_try_lookup(hmap, &k, sizeof(k), &v);
+  }
+  E(hmap_stats(hmap, &stats));
+  ASSRT(stats.table_size == 1000 && stats.num_entries == 3000);
+  ASSRT(stats.load_factor == 3.0);
+  ASSRT(stats.empty_buckets + stats.used_buckets == 1000);
+  ASSRT(stats.chain_hist[0] == stats.empty_buckets);
+  ASSRT(stats.max_chain >= 3 && stats.max_chain < HMAP_STATS_HIST - 1);
+  ASSRT(stats_hist_total(&stats, &count) == 3000 && count == 1000);
+#if defined(HMAP_COUNTERS)
+  ASSRT(stats.counters.writes == 3000);
+  ASSRT(stats.counters.lookups == 4000);
+  ASSRT(stats.counters.hits == 3000 && stats.counters.misses == 1000);
+  /* Every write and lookup visited entries, and a hit visits at least one. */
+  ASSRT(stats.counters.probes >= 3000);
+#else
+  ASSRT(stats.counters.lookups == 0 && stats.counters.probes == 0);
+#endif
+  E(hmap_delete(hmap));
+
+  /* A bad hash piles everything into a few buckets. */
+  hmap_options_init(&options);
+  options.hash_fn = stats_bad_hash;
+  E(hmap_create_opts(&hmap, 1000, &options));
+  for (k = 0; k < 100; k++) {
+    E(hmap_write(hmap, &k, sizeof(k), NULL));
+  }
+  E(hmap_stats(hmap, &stats));
+  ASSRT(stats.used_buckets <= 4);
+  ASSRT(stats.max_chain >= 25);
+  ASSRT(stats.chain_hist[HMAP_STATS_HIST - 1] >= 1);
+  E(hmap_delete(hmap));
+
+  /* Open addressing: entries by distance from home. */
+  {
+    int layouts[] = {HMAP_LAYOUT_ROBINHOOD, HMAP_LAYOUT_GROUP};
+    int i;
+    for (i = 0; i < 2; i++) {
+      hmap_options_init(&options);
+      options.layout = layouts[i];
+      options.max_load = 0.9;
+      E(hmap_create_opts(&hmap, 1024, &options));
+      for (k = 0; k < 900; k++) {
+        E(hmap_write(hmap, &k, sizeof(k), NULL));
+      }
+      E(hmap_stats(hmap, &stats));
+      ASSRT(stats.table_size == 1024 && stats.num_entries == 900);
+      ASSRT(stats.used_buckets == 900 && stats.empty_buckets == 124);
+      stats_hist_total(&stats, &count);
+      ASSRT(count == 900);
+      ASSRT(stats.chain_hist[0] > 0 && stats.max_chain > 0);
+      E(hmap_delete(hmap));
+    }
+  }
+
+  /* Segmented maps add up their segments. */
+  hmap_options_init(&options);
+  options.segments = 4;
+  options.max_load = 1.0;
+  E(hmap_create_opts(&hmap, 400, &options));
+  for (k = 0; k < 1000; k++) {
+    E(hmap_write(hmap, &k, sizeof(k), NULL));
+  }
+  E(hmap_stats(hmap, &stats));
+  ASSRT(stats.num_entries == 1000);
+  ASSRT(stats.table_size == stats.empty_buckets + stats.used_buckets);
+  stats_hist_total(&stats, &count);
+  ASSRT(count == stats.table_size);
+#if defined(HMAP_COUNTERS)
+  ASSRT(stats.counters.writes == 1000);
+#endif
+  E(hmap_delete(hmap));
+
+  /* A mapped map counts correctly with two threads looking up at once. */
+  {
+    pthread_t threads[2];
+    hmap_t *mapped;
+    int i;
+    E(hmap_create(&hmap, 1000));
+    for (k = 0; k < 1000; k++) {
+      E(hmap_write(hmap, &k, sizeof(k), NULL));
+    }
+    E(hmap_save(hmap, "hmap_test.30.snap", 0));
+    E(hmap_delete(hmap));
+    E(hmap_open_mmap(&mapped, "hmap_test.30.snap", NULL, 0));
+    for (i = 0; i < 2; i++) {
+      ASSRT(pthread_create(&threads[i], NULL, stats_mapped_reader, mapped) == 0);
+    }
+    for (i = 0; i < 2; i++) {
+      ASSRT(pthread_join(threads[i], NULL) == 0);
+    }
+    E(hmap_stats(mapped, &stats));
+    ASSRT(stats.num_entries == 1000);
+#if defined(HMAP_COUNTERS)
+    ASSRT(stats.counters.lookups == 4000);
+    ASSRT(stats.counters.hits == 2000 && stats.counters.misses == 2000);
+    ASSRT(stats.counters.probes >= 2000);
+#endif
+    E(hmap_delete(mapped));
+    unlink("hmap_test.30.snap");
+  }
+}  /* test30 */
+
+
+/* Sum the key sizes of a map's entries by walking it. */
+size_t mem_walk_keys(hmap_t *hmap, size_t min_key_size) {
+  hmap_entry_t *entry = NULL;
+  size_t key_bytes = 0;
+  do {
+    E(hmap_next(hmap, &entry));
+    if (entry && entry->key_size >= min_key_size) {
+      key_bytes += entry->key_size;
+    }
+  } while (entry);
+  return key_bytes;
+}  /* mem_walk_keys */
+
+
+/* Write distinct keys of 8 to 71 bytes until the map refuses one.
+ * Returns how many went in. */
+int mem_fill(hmap_t *hmap, char *key_buf, int first_key) {
+  int i;
+  err_t *err;
+  for (i = first_key; ; i++) {
+    int key_size = 8 + i % 64;
+    memset(key_buf, 'k', key_size);
+    memcpy(key_buf, &i, sizeof(i));
+    err = hmap_write(hmap, key_buf, key_size, NULL);
+    if (err) {
+      ASSRT(err->code == HMAP_ERR_BUDGET);
+      err_dispose(err);
+      return i - first_key;
+    }
+  }
+}  /* mem_fill */
+
+
+/* hmap_memory_usage() and the mem_budget option. */
+void test31() {
+  hmap_options_t options;
+  hmap_memory_t mem;
+  hmap_t *hmap;
+  err_t *err;
+  char key_buf[80];
+  uint64_t k;
+  void *v;
+  int i;
+
+  err = hmap_memory_usage(NULL, &mem);
+  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+
+  /* Chained, growing, with inline and separate keys. Removing every
+   * entry takes the entry, key and malloc overhead back to nothing. */
+  hmap_options_init(&options);
+  options.max_load = 1.0;
+  E(hmap_create_opts(&hmap, 100, &options));
+  for (i = 0; i < 5000; i++) {
+    int key_size = 8 + i % 64;
+    memset(key_buf, 'k', key_size);
+    memcpy(key_buf, &i, sizeof(i));
+    E(hmap_write(hmap, key_buf, key_size, NULL));
+  }
+  E(hmap_memory_usage(hmap, &mem));
+  ASSRT(mem.entry_bytes == 5000 * sizeof(hmap_entry_t));
+  ASSRT(mem.key_bytes == mem_walk_keys(hmap, 0));
+  ASSRT(mem.table_bytes >= hmap->table_size * sizeof(hmap_entry_t *));
+  ASSRT(mem.overhead_bytes > 5000 * 8);  /* Malloc headers, at least. */
+  ASSRT(mem.total_bytes == mem.table_bytes + mem.entry_bytes + mem.key_bytes + mem.overhead_bytes);
+  for (i = 0; i < 5000; i++) {
+    int key_size = 8 + i % 64;
+    memset(key_buf, 'k', key_size);
+    memcpy(key_buf, &i, sizeof(i));
+    E(hmap_remove(hmap, key_buf, key_size, NULL));
+  }
+  E(hmap_memory_usage(hmap, &mem));
+  ASSRT(mem.entry_bytes == 0 && mem.key_bytes == 0);
+  ASSRT(hmap->mem_overhead == 0);
+  ASSRT(mem.overhead_bytes < sizeof(hmap_t) + 100);  /* Just the map's own blocks. */
+  E(hmap_delete(hmap));
+
+  /* Arena: freed chunks stay with the map, as overhead. */
+  hmap_options_init(&options);
+  options.max_load = 1.0;
+  options.arena_slab_size = 64 * 1024;
+  E(hmap_create_opts(&hmap, 100, &options));
+  for (k = 0; k < 5000; k++) {
+    E(hmap_write(hmap, &k, sizeof(k), NULL));
+  }
+  E(hmap_memory_usage(hmap, &mem));
+  ASSRT(mem.entry_bytes == 5000 * sizeof(hmap_entry_t) && mem.key_bytes == 5000 * sizeof(k));
+  ASSRT(mem.entry_bytes + mem.key_bytes + hmap->mem_overhead >= hmap->arena_reserved);
+  for (k = 0; k < 5000; k++) {
+    E(hmap_remove(hmap, &k, sizeof(k), NULL));
+  }
+  E(hmap_memory_usage(hmap, &mem));
+  ASSRT(mem.entry_bytes == 0 && mem.key_bytes == 0);
+  ASSRT(hmap->mem_overhead >= hmap->arena_reserved);
+  E(hmap_delete(hmap));
+
+  /* Open addressing: slots are table bytes; only long keys are counted. */
+  {
+    int layouts[] = {HMAP_LAYOUT_ROBINHOOD, HMAP_LAYOUT_GROUP};
+    for (i = 0; i < 2; i++) {
+      int j;
+      hmap_options_init(&options);
+      options.layout = layouts[i];
+      E(hmap_create_opts(&hmap, 64, &options));
+      for (j = 0; j < 2000; j++) {
+        int key_size = 8 + j % 64;
+        memset(key_buf, 'k', key_size);
+        memcpy(key_buf, &j, sizeof(j));
+        E(hmap_write(hmap, key_buf, key_size, NULL));
+      }
+      E(hmap_memory_usage(hmap, &mem));
+      ASSRT(mem.entry_bytes == 0);
+      ASSRT(mem.key_bytes == mem_walk_keys(hmap, HMAP_INLINE_KEY_DEFAULT + 1));
+      ASSRT(mem.table_bytes >= hmap->table_size * hmap->slot_size);
+      E(hmap_delete(hmap));
+    }
+  }
+
+  /* Bulk entries: removing one leaves its space in the block. */
+  {
+    uint64_t bulk_keys[1000];
+    const void *key_ptrs[1000];
+    size_t key_sizes[1000];
+    void *vals[1000];
+    size_t total;
+    for (i = 0; i < 1000; i++) {
+      bulk_keys[i] = (uint64_t)i;
+      key_ptrs[i] = &bulk_keys[i];
+      key_sizes[i] = sizeof(uint64_t);
+      vals[i] = NULL;
+    }
+    hmap_options_init(&options);
+    options.max_load = 1.0;
+    E(hmap_create_opts(&hmap, 2000, &options));
+    E(hmap_write_batch(hmap, key_ptrs, key_sizes, vals, 1000, 0));
+    E(hmap_memory_usage(hmap, &mem));
+    ASSRT(mem.entry_bytes == 1000 * sizeof(hmap_entry_t) && mem.key_bytes == 1000 * sizeof(uint64_t));
+    total = mem.total_bytes;
+    for (k = 0; k < 500; k++) {
+      E(hmap_remove(hmap, &k, sizeof(k), NULL));
+    }
+    E(hmap_memory_usage(hmap, &mem));
+    ASSRT(mem.entry_bytes == 500 * sizeof(hmap_entry_t) && mem.key_bytes == 500 * sizeof(uint64_t));
+    ASSRT(mem.total_bytes == total);
+    E(hmap_delete(hmap));
+  }
+
+  /* Budget: each kind of map fills up, refuses new keys with
+   * HMAP_ERR_BUDGET while still taking overwrites, and takes new keys
+   * again once some are removed. */
+  {
+    struct {
+      int layout;
+      size_t arena_slab_size;
+      int concurrent;
+      int segments;
+    } variants[] = {
+      {HMAP_LAYOUT_CHAINED, 0, 0, 0},
+      {HMAP_LAYOUT_CHAINED, 16 * 1024, 0, 0},
+      {HMAP_LAYOUT_CHAINED, 0, 1, 0},
+      {HMAP_LAYOUT_CHAINED, 0, 0, 4},
+      {HMAP_LAYOUT_ROBINHOOD, 0, 0, 0},
+      {HMAP_LAYOUT_GROUP, 0, 0, 0},
+    };
+    const size_t budget = 256 * 1024;
+    int v_num;
+    for (v_num = 0; v_num < (int)(sizeof(variants) / sizeof(variants[0])); v_num++) {
+      int num_written;
+      hmap_options_init(&options);
+      options.layout = variants[v_num].layout;
+      options.max_load = (options.layout == HMAP_LAYOUT_CHAINED) ? 1.0 : 0.9;
+      options.arena_slab_size = variants[v_num].arena_slab_size;
+      options.concurrent = variants[v_num].concurrent;
+      options.segments = variants[v_num].segments;
+      options.mem_budget = budget;
+      E(hmap_create_opts(&hmap, 64, &options));
+
+      num_written = mem_fill(hmap, key_buf, 0);
+      ASSRT(num_written > 1000);
+      E(hmap_memory_usage(hmap, &mem));
+      ASSRT(mem.total_bytes <= budget);
+      /* Open addressing stops short when the doubled table won't fit
+       * alongside the current one. */
+      ASSRT(mem.total_bytes > budget / 3);
+
+      /* Everything written is there, and can be overwritten. */
+      for (i = 0; i < num_written; i++) {
+        int key_size = 8 + i % 64;
+        memset(key_buf, 'k', key_size);
+        memcpy(key_buf, &i, sizeof(i));
+        ASSRT(hmap_try_lookup(hmap, key_buf, key_size, &v) && v == NULL);
+        E(hmap_write(hmap, key_buf, key_size, (void *)1));
+      }
+
+      for (i = 0; i < num_written; i += 2) {
+        int key_size = 8 + i % 64;
+        memset(key_buf, 'k', key_size);
+        memcpy(key_buf, &i, sizeof(i));
+        E(hmap_remove(hmap, key_buf, key_size, NULL));
+      }
+      ASSRT(mem_fill(hmap, key_buf, num_written) > 0);
+      E(hmap_memory_usage(hmap, &mem));
+      ASSRT(mem.total_bytes <= budget);
+      E(hmap_delete(hmap));
+    }
+  }
+
+  /* A batch that doesn't fit is refused whole. */
+  {
+    uint64_t bulk_keys[4000];
+    const void *key_ptrs[4000];
+    size_t key_sizes[4000];
+    void *vals[4000];
+    for (i = 0; i < 4000; i++) {
+      bulk_keys[i] = (uint64_t)i;
+      key_ptrs[i] = &bulk_keys[i];
+      key_sizes[i] = sizeof(uint64_t);
+      vals[i] = NULL;
+    }
+    hmap_options_init(&options);
+    options.max_load = 1.0;
+    options.mem_budget = 64 * 1024;
+    E(hmap_create_opts(&hmap, 100, &options));
+    err = hmap_write_batch(hmap, key_ptrs, key_sizes, vals, 4000, 0);
+    ASSRT(err->code == HMAP_ERR_BUDGET);
+    err_dispose(err);
+    ASSRT(hmap->num_entries == 0);
+    E(hmap_write_batch(hmap, key_ptrs, key_sizes, vals, 100, 0));
+    ASSRT(hmap->num_entries == 100);
+    E(hmap_delete(hmap));
+  }
+}  /* test31 */
+
+
+#define SNAP_FILE "hmap_test.32.snap"
+
+/* Overwrite "len" bytes of the snapshot at "offset". */
+void snap_patch(long offset, const void *bytes, size_t len) {
+  FILE *fp = fopen(SNAP_FILE, "r+b");
+  ASSRT(fp);
+  ASSRT(fseek(fp, offset, SEEK_SET) == 0);
+  ASSRT(fwrite(bytes, 1, len, fp) == len);
+  ASSRT(fclose(fp) == 0);
+}  /* snap_patch */
+
+
+/* Recompute the header checksum after patching the header, so the damage
+ * gets past it (the checksum covers the first 80 bytes). */
+void snap_resign() {
+  unsigned char header[80];
+  uint64_t hash[2];
+  FILE *fp = fopen(SNAP_FILE, "rb");
+  ASSRT(fp);
+  ASSRT(fread(header, 1, sizeof(header), fp) == sizeof(header));
+  ASSRT(fclose(fp) == 0);
+  hmap_murmur3_x64_128(header, sizeof(header), 0, hash);
+  snap_patch(80, &hash[0], sizeof(hash[0]));
+}  /* snap_resign */
+
+
+/* Open the snapshot expecting an error with this code. */
+void snap_open_fails(const hmap_options_t *options, int flags, char *code) {
+  hmap_t *hmap = NULL;
+  err_t *err = hmap_open_mmap(&hmap, SNAP_FILE, options, flags);
+  ASSRT(err && err->code == code);
+  ASSRT(hmap == NULL);
+  err_dispose(err);
+}  /* snap_open_fails */
+
+
+/* hmap_save() and hmap_open_mmap(). */
+void test32() {
+  hmap_options_t options;
+  hmap_stats_t stats;
+  hmap_memory_t mem;
+  hmap_entry_t *entry;
+  hmap_t *hmap;
+  hmap_t *mapped;
+  err_t *err;
+  uint64_t k;
+  void *v;
+  void **vp;
+  int i, count, inserted;
+
+  err = hmap_open_mmap(&mapped, "hmap_test.32.missing", NULL, 0);
+  ASSRT(err->code == HMAP_ERR_IO);
+  err_dispose(err);
+
+  /* Integer values, every kind of map. */
+  for (i = 0; i < 5; i++) {
+    hmap_options_init(&options);
+    if (i == 1) {
+      options.layout = HMAP_LAYOUT_ROBINHOOD;
+    } else if (i == 2) {
+      options.layout = HMAP_LAYOUT_GROUP;
+    } else if (i == 3) {
+      options.concurrent = 1;
+    } else if (i == 4) {
+      options.segments = 4;
+    }
+    options.hash_bits = (i % 2) ? 64 : 32;
+    options.seed = 7;
+    E(hmap_create_opts(&hmap, 128, &options));
+    for (k = 0; k < 10000; k++) {
+      E(hmap_write(hmap, &k, sizeof(k), (void *)(uintptr_t)(k * 3 + 1)));
+    }
+    E(hmap_save(hmap, SNAP_FILE, 0));
+    ASSRT(access(SNAP_FILE ".tmp", F_OK) != 0);
+
+    E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, HMAP_MMAP_VERIFY));
+    ASSRT(mapped->num_entries == 10000);
+    for (k = 0; k < 10000; k++) {
+      E(hmap_lookup(mapped, &k, sizeof(k), &v));
+      ASSRT(v == (void *)(uintptr_t)(k * 3 + 1));
+      k += 10000;
+      ASSRT(!hmap_try_lookup(mapped, &k, sizeof(k), &v) && v == NULL);
+      k -= 10000;
+    }
+    count = 0;
+    entry = NULL;
+    do {
+      E(hmap_next(mapped, &entry));
+      if (entry) {
+        ASSRT(entry->key_size == sizeof(k));
+        memcpy(&k, entry->key, sizeof(k));
+        ASSRT(k < 10000 && entry->value == (void *)(uintptr_t)(k * 3 + 1));
+        count++;
+      }
+    } while (entry);
+    ASSRT(count == 10000);
+    E(hmap_stats(mapped, &stats));
+    ASSRT(stats.num_entries == 10000 && stats.table_size == 10000);
+    ASSRT(stats.used_buckets + stats.empty_buckets == stats.table_size);
+    E(hmap_memory_usage(mapped, &mem));
+    ASSRT(mem.table_bytes == 0 && mem.entry_bytes == 0 && mem.key_bytes == 0);
+
+    /* A mapped map can be saved again. */
+    E(hmap_save(mapped, SNAP_FILE, 0));
+    E(hmap_delete(mapped));
+    E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, HMAP_MMAP_VERIFY));
+    k = 9999;
+    ASSRT(hmap_try_lookup(mapped, &k, sizeof(k), &v) && v == (void *)(uintptr_t)(k * 3 + 1));
+    E(hmap_delete(mapped));
+    E(hmap_delete(hmap));
+  }
+
+  /* Read-only. */
+  E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, 0));
+  k = 1;
+  err = hmap_write(mapped, &k, sizeof(k), NULL);
+  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  err = hmap_remove(mapped, &k, sizeof(k), NULL);
+  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  err = hmap_get_or_insert(mapped, &k, sizeof(k), &vp, &inserted);
+  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  {
+    const void *key_ptrs[1] = {&k};
+    size_t key_sizes[1] = {sizeof(k)};
+    void *vals[1] = {NULL};
+    size_t num_found;
+    err = hmap_write_batch(mapped, key_ptrs, key_sizes, vals, 1, 0);
+    ASSRT(err->code == HMAP_ERR_PARAM);
+    err_dispose(err);
+    E(hmap_lookup_batch(mapped, key_ptrs, key_sizes, 1, vals, &num_found));
+    ASSRT(num_found == 1 && vals[0] == (void *)(uintptr_t)4);
+  }
+  E(hmap_delete(mapped));
+
+  /* Values saved by content, string keys, a NULL value. */
+  {
+    char key_buf[40];
+    double val_buf[1000];
+    hmap_options_init(&options);
+    E(hmap_create_opts(&hmap, 100, &options));
+    for (i = 0; i < 1000; i++) {
+      snprintf(key_buf, sizeof(key_buf), "key number %d", i);
+      val_buf[i] = i * 0.5;
+      E(hmap_swrite(hmap, key_buf, (i == 7) ? NULL : &val_buf[i]));
+    }
+    E(hmap_save(hmap, SNAP_FILE, sizeof(double)));
+    E(hmap_delete(hmap));
+    memset(val_buf, 0, sizeof(val_buf));
+
+    E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, HMAP_MMAP_VERIFY));
+    for (i = 0; i < 1000; i++) {
+      snprintf(key_buf, sizeof(key_buf), "key number %d", i);
+      E(hmap_slookup(mapped, key_buf, &v));
+      if (i == 7) {
+        ASSRT(v == NULL);
+      } else {
+        ASSRT(v != (void *)&val_buf[i] && ((uintptr_t)v % 8) == 0);
+        ASSRT(*(double *)v == i * 0.5);
+      }
+    }
+    ASSRT(!hmap_try_slookup(mapped, "key number 1000", &v));
+    E(hmap_delete(mapped));
+  }
+
+  /* User hash: the reader must supply it. */
+  hmap_options_init(&options);
+  options.hash_fn = test_u64_hash;
+  options.equal_fn = test_u64_equal;
+  E(hmap_create_opts(&hmap, 100, &options));
+  for (k = 0; k < 500; k++) {
+    E(hmap_write(hmap, &k, sizeof(k), (void *)(uintptr_t)(k + 1)));
+  }
+  E(hmap_save(hmap, SNAP_FILE, 0));
+  E(hmap_delete(hmap));
+  snap_open_fails(NULL, 0, HMAP_ERR_PARAM);
+  E(hmap_open_mmap(&mapped, SNAP_FILE, &options, 0));
+  for (k = 0; k < 500; k++) {
+    ASSRT(hmap_try_lookup(mapped, &k, sizeof(k), &v) && v == (void *)(uintptr_t)(k + 1));
+  }
+  E(hmap_delete(mapped));
+
+  /* Empty map. */
+  E(hmap_create(&hmap, 10));
+  E(hmap_save(hmap, SNAP_FILE, 0));
+  E(hmap_delete(hmap));
+  E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, HMAP_MMAP_VERIFY));
+  ASSRT(mapped->num_entries == 0);
+  k = 0;
+  ASSRT(!hmap_try_lookup(mapped, &k, sizeof(k), &v));
+  entry = NULL;
+  E(hmap_next(mapped, &entry));
+  ASSRT(entry == NULL);
+  E(hmap_delete(mapped));
+
+  /* Damage. The header is always checked; the body only on request. */
+  E(hmap_create(&hmap, 10));
+  for (k = 0; k < 100; k++) {
+    E(hmap_write(hmap, &k, sizeof(k), NULL));
+  }
+  E(hmap_save(hmap, SNAP_FILE, 0));
+  snap_patch(200, "X", 1);  /* A record. */
+  E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, 0));
+  E(hmap_delete(mapped));
+  snap_open_fails(NULL, HMAP_MMAP_VERIFY, HMAP_ERR_FORMAT);
+
+  E(hmap_save(hmap, SNAP_FILE, 0));
+  snap_patch(24, "X", 1);  /* num_entries. */
+  snap_open_fails(NULL, 0, HMAP_ERR_FORMAT);
+
+  E(hmap_save(hmap, SNAP_FILE, 0));
+  snap_patch(0, "HMAPSNAQ", 8);
+  snap_open_fails(NULL, 0, HMAP_ERR_FORMAT);
+
+  E(hmap_save(hmap, SNAP_FILE, 0));
+  snap_resign();
+  E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, 0));  /* Re-signed but undamaged. */
+  E(hmap_delete(mapped));
+  {
+    uint64_t bad = UINT64_MAX - 3;  /* value_size; aligning it would wrap to 0. */
+    snap_patch(48, &bad, sizeof(bad));
+    snap_resign();
+    snap_open_fails(NULL, 0, HMAP_ERR_FORMAT);
+    bad = 4000 + 8;  /* value_size: more than all the records. */
+    snap_patch(48, &bad, sizeof(bad));
+    snap_resign();
+    snap_open_fails(NULL, 0, HMAP_ERR_FORMAT);
+  }
+
+  /* Damaged offsets are caught when followed; opening doesn't read them.
+   * Records are 40 bytes from offset 88; the bucket table starts at 4088. */
+  {
+    uint64_t bad;
+    size_t bucket;
+    E(hmap_save(hmap, SNAP_FILE, 0));
+    bad = 92;  /* Misaligned. */
+    for (bucket = 0; bucket < 100; bucket += 2) {
+      snap_patch(4088 + 8 * bucket, &bad, sizeof(bad));
+    }
+    E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, 0));
+    count = 0;
+    for (k = 0; k < 100; k++) {
+      count += hmap_try_lookup(mapped, &k, sizeof(k), &v);
+    }
+    ASSRT(count > 0 && count < 100);
+    count = 0;
+    entry = NULL;
+    do {
+      E(hmap_next(mapped, &entry));
+      count += (entry != NULL);
+    } while (entry);
+    ASSRT(count == 100);  /* Iteration goes by records, not buckets. */
+    E(hmap_delete(mapped));
+
+    E(hmap_save(hmap, SNAP_FILE, 0));
+    bad = UINT64_MAX - 3;  /* Key size of the 6th record. */
+    snap_patch(88 + 40 * 5 + 16, &bad, sizeof(bad));
+    bad = 88 + 40 * 50;  /* Next of the 51st record: itself. */
+    snap_patch(88 + 40 * 50, &bad, sizeof(bad));
+    bad = 1 << 30;  /* Next of the 71st record: far past the end. */
+    snap_patch(88 + 40 * 70, &bad, sizeof(bad));
+    E(hmap_open_mmap(&mapped, SNAP_FILE, NULL, 0));
+    count = 0;
+    for (k = 0; k < 100; k++) {
+      count += hmap_try_lookup(mapped, &k, sizeof(k), &v);
+    }
+    ASSRT(count >= 90 && count < 100);
+    count = 0;
+    entry = NULL;
+    do {
+      E(hmap_next(mapped, &entry));
+      count += (entry != NULL);
+    } while (entry);
+    ASSRT(count == 5);  /* Stops at the damaged record. */
+    E(hmap_stats(mapped, &stats));
+    E(hmap_delete(mapped));
+  }
+
+  E(hmap_save(hmap, SNAP_FILE, 0));
+  ASSRT(truncate(SNAP_FILE, 1000) == 0);
+  snap_open_fails(NULL, 0, HMAP_ERR_FORMAT);
+  ASSRT(truncate(SNAP_FILE, 10) == 0);
+  snap_open_fails(NULL, 0, HMAP_ERR_FORMAT);
+  E(hmap_delete(hmap));
+
+  err = hmap_save(NULL, SNAP_FILE, 0);
+  ASSRT(err->code == HMAP_ERR_PARAM);
+  err_dispose(err);
+  unlink(SNAP_FILE);
+}  /* test32 */
+
+
+/* Count the probes a lookup takes by walking the table's internals.
+ * Chained: entries visited. Robin Hood: slots visited.
+ * Group: control-byte groups loaded. */
+int bench_probes(hmap_t *hmap, const void *key, size_t key_size) {
+  uint32_t hash = hmap_murmur3_32(key, key_size, hmap->seed);
+  size_t home = hmap_reduce(hash, hmap->table_size, hmap->reduce_m);
+  size_t slot;
+  int probes = 0;
+
+  if (hmap->layout == HMAP_LAYOUT_CHAINED) {
+    hmap_entry_t *entry = hmap->table[home];
+    while (entry) {
+      probes++;
+      if (entry->key_size == key_size && memcmp(entry->key, key, key_size) == 0) break;
+      entry = entry->next;
+    }
+    return probes;
+  }
+
+  for (slot = home; ; slot = (slot + 1) % hmap->table_size) {
+    int used = (hmap->layout == HMAP_LAYOUT_GROUP) ?
+        (hmap->ctrl[slot] & 0x80) == 0 : hmap->hashes[slot] != 0;
+    size_t dist = (slot + hmap->table_size - home) % hmap->table_size;
+    if (hmap->layout == HMAP_LAYOUT_ROBINHOOD) {
+      probes++;
+    } else if (dist % HMAP_GROUP_WIDTH == 0) {
+      probes++;
+    }
+    if (!used) break;
+    if (hmap->layout == HMAP_LAYOUT_ROBINHOOD &&
+        dist > (slot + hmap->table_size -
+            hmap_reduce(hmap->hashes[slot], hmap->table_size, hmap->reduce_m)) % hmap->table_size) {
+      break;  /* Robin Hood early termination. */
+    }
+    if (HMAP_SLOT(hmap, slot)->key_size == key_size &&
+        memcmp(HMAP_SLOT(hmap, slot)->key, key, key_size) == 0) break;
+  }
+  return probes;
+}  /* bench_probes */
+
+
+/* Benchmark: lookup cost of each layout at a range of load factors. */
+void test5() {
+  static const char *layout_names[] = { "chained", "robinhood", "group" };
+  size_t table_size = 1 << 20;
+  uint64_t *keys = malloc(table_size * sizeof(uint64_t));
+  int load_pct, layout;
+  void *v;
+  ASSRT(keys);
+
+  printf("layout,load,entries,hit_probes,miss_probes,hit_ns\n");
+  for (load_pct = 50; load_pct <= 90; load_pct += 10) {
+    for (layout = HMAP_LAYOUT_CHAINED; layout <= HMAP_LAYOUT_GROUP; layout++) {
+      hmap_t *hmap;
+      hmap_options_t options;
+      size_t num_keys = table_size * load_pct / 100;
+      size_t i;
+      uint64_t hit_probes = 0, miss_probes = 0;
+
+      hmap_options_init(&options);
+      options.layout = layout;
+      if (layout != HMAP_LAYOUT_CHAINED) {
+        options.max_load = 0.95;  /* Don't grow during the test. */
+      }
+      E(hmap_create_opts(&hmap, table_size, &options));
+      for (i = 0; i < num_keys; i++) {
+        keys[i] = i * 2;  /* Odd numbers are misses. */
+        E(hmap_write(hmap, &keys[i], sizeof(keys[i]), &keys[i]));
+      }
+      ASSRT(hmap->table_size == table_size);
+
+      for (i = 0; i < num_keys; i++) {
+        uint64_t miss_key = keys[i] + 1;
+        hit_probes += bench_probes(hmap, &keys[i], sizeof(keys[i]));
+        miss_probes += bench_probes(hmap, &miss_key, sizeof(miss_key));
+      }
+
+      uint64_t start_ns = now_ns();
+      for (i = 0; i < num_keys; i++) {
+        E(hmap_lookup(hmap, &keys[i], sizeof(keys[i]), &v));
+      }
+      uint64_t hit_ns = now_ns() - start_ns;
+
+      printf("%s,%.1f,%lu,%.3f,%.3f,%.1f\n", layout_names[layout], load_pct / 100.0,
+          (unsigned long)num_keys, (double)hit_probes / num_keys,
+          (double)miss_probes / num_keys, (double)hit_ns / num_keys);
+      fflush(stdout);
+      E(hmap_delete(hmap));
+    }
+  }
+
+  free(keys);
+}  /* test5 */
+
+
+/* Benchmark: hit and miss cost of hmap_lookup() vs hmap_try_lookup(). */
+void test6() {
+  static const char *layout_names[] = { "chained", "robinhood", "group" };
+  size_t num_keys = 100000;
+  int loops = 20;
+  uint64_t *keys = malloc(num_keys * sizeof(uint64_t));
+  int layout, loop;
+  void *v;
+  ASSRT(keys);
+
+  printf("layout,api,hit_ns,miss_ns\n");
+  for (layout = HMAP_LAYOUT_CHAINED; layout <= HMAP_LAYOUT_GROUP; layout++) {
+    hmap_t *hmap;
+    hmap_options_t options;
+    uint64_t start_ns, hit_ns, miss_ns;
+    size_t i;
+
+    hmap_options_init(&options);
+    options.layout = layout;
+    options.max_load = 0.75;
+    E(hmap_create_opts(&hmap, 1024, &options));
+    for (i = 0; i < num_keys; i++) {
+      keys[i] = i * 2;  /* Odd numbers are misses. */
+      E(hmap_write(hmap, &keys[i], sizeof(keys[i]), &keys[i]));
+    }
+
+    start_ns = now_ns();
+    for (loop = 0; loop < loops; loop++) {
+      for (i = 0; i < num_keys; i++) {
+        E(hmap_lookup(hmap, &keys[i], sizeof(keys[i]), &v));
+      }
+    }
+    hit_ns = now_ns() - start_ns;
+    start_ns = now_ns();
+    for (loop = 0; loop < loops; loop++) {
+      for (i = 0; i < num_keys; i++) {
+        uint64_t miss_key = keys[i] + 1;
+        err_t *err = hmap_lookup(hmap, &miss_key, sizeof(miss_key), &v);
+        ASSRT(err != ERR_OK);
+        err_dispose(err);
+      }
+    }
+    miss_ns = now_ns() - start_ns;
+    printf("%s,hmap_lookup,%.1f,%.1f\n", layout_names[layout],
+        (double)hit_ns / (num_keys * loops), (double)miss_ns / (num_keys * loops));
+
+    start_ns = now_ns();
+    for (loop = 0; loop < loops; loop++) {
+      for (i = 0; i < num_keys; i++) {
+        ASSRT(hmap_try_lookup(hmap, &keys[i], sizeof(keys[i]), &v));
+      }
+    }
+    hit_ns = now_ns() - start_ns;
+    start_ns = now_ns();
+    for (loop = 0; loop < loops; loop++) {
+      for (i = 0; i < num_keys; i++) {
+        uint64_t miss_key = keys[i] + 1;
+        ASSRT(! hmap_try_lookup(hmap, &miss_key, sizeof(miss_key), &v));
+      }
+    }
+    miss_ns = now_ns() - start_ns;
+    printf("%s,hmap_try_lookup,%.1f,%.1f\n", layout_names[layout],
+        (double)hit_ns / (num_keys * loops), (double)miss_ns / (num_keys * loops));
+    fflush(stdout);
+
+    E(hmap_delete(hmap));
+  }
+
+  free(keys);
+}  /* test6 */
+
+
+int main(int argc, char **argv) {
+  parse_cmdline(argc, argv);
+
+  if (o_testnum == 0 || o_testnum == 1) {
+    test1();
+    printf("test1: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 2) {
+    test2();
+    printf("test2: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 3) {
+    test3();
+    printf("test3: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 4) {
+    test4();
+    printf("test4: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 7) {
+    test7();
+    printf("test7: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 8) {
+    test8();
+    printf("test8: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 9) {
+    test9();
+    printf("test9: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 11) {
+    test11();
+    printf("test11: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 13) {
+    test13();
+    printf("test13: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 14) {
+    test14();
+    printf("test14: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 16) {
+    test16();
+    printf("test16: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 18) {
+    test18();
+    printf("test18: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 19) {
+    test19();
+    printf("test19: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 21) {
+    test21();
+    printf("test21: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 23) {
+    test23();
+    printf("test23: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 25) {
+    test25();
+    printf("test25: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 27) {
+    test27();
+    printf("test27: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 28) {
+    test28();
+    printf("test28: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 30) {
+    test30();
+    printf("test30: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 31) {
+    test31();
+    printf("test31: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 0 || o_testnum == 32) {
+    test32();
+    printf("test32: success\n"); fflush(stdout);
+  }
+
+  /* Benchmarks. */
+  if (o_testnum == 5) {
+    test5();
+    printf("test5: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 6) {
+    test6();
+    printf("test6: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 10) {
+    test10();
+    printf("test10: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 12) {
+    test12();
+    printf("test12: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 15) {
+    test15();
+    printf("test15: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 17) {
+    test17();
+    printf("test17: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 20) {
+    test20();
+    printf("test20: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 22) {
+    test22();
+    printf("test22: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 24) {
+    test24();
+    printf("test24: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 26) {
+    test26();
+    printf("test26: success\n"); fflush(stdout);
+  }
+
+  if (o_testnum == 29) {
+    test29();
+    printf("test29: success\n"); fflush(stdout);
   }
 
   return 0;
@@ -33,4 +33,141 @@ if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
   $B -t 1 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
 fi
 
+T=2
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 2 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=3
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 3 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=4
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 4 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=7
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 7 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=8
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 8 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=9
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 9 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=11
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 11 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=13
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 13 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=14
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 14 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=16
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 16 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=18
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 18 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=19
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 19 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=21
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 21 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=23
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 23 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=25
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 25 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=27
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 27 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=28
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 28 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=30
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 30 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+  ./hmap_counters_test -t 30 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=31
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 31 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=32
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  $B -t 32 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=100  # C++ tests.
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  ./hmap_cpp_test 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
+T=200  # Benchmark smoke run.
+if [ "$SINGLE_T" -eq 0 -o "$SINGLE_T" -eq "$T" ]; then :
+  TEST
+  ./hmap_bench -s -f csv 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+  # 3 layouts x 2 key types x 2 sizes x 2 dists x 2 miss percents.
+  ASSRT "`grep -c '^lookup,' $B.$T.log` -eq 48"
+  # Counters must not stop the run where they are unavailable.
+  ./hmap_bench -s -p -w lookup -l chained -k bin 2>&1 | tee -a $B.$T.log;  ST=${PIPESTATUS[0]}; if [ $ST -ne 0 ]; then exit 1; fi
+fi
+
 echo "All done."